@@ -0,0 +1,100 @@
+#pragma once
+
+#include "Hit.hpp"
+#include "RingBuffer.hpp"
+
+#include <cassert>
+#include <cstddef>
+#include <vector>
+
+namespace dbscan {
+//======================================================================
+//
+// The recent hits on each channel, each channel in its own
+// time-ordered RingBuffer, so that a neighbour search only has to look
+// at the channels within the metric's channel window instead of at
+// every hit in the time window. Hits are added in time order and
+// removed oldest first, in step with IncrementalDBSCAN's hit window
+//
+// The table covers the range of channels seen so far, and grows at
+// either end as needed, so channel numbers can be negative, but they
+// should be reasonably compact
+template<class T>
+class ChannelRings
+{
+public:
+    // The initial capacity of each channel's ring. They grow as
+    // needed, but most channels only ever have a few hits in the
+    // window
+    static constexpr size_t kInitialCapacity = 16;
+
+    void push_back(Hit<T>* h)
+    {
+        if (m_rings.empty()) {
+            m_first_chan = h->chan;
+            m_rings.emplace_back(kInitialCapacity);
+        } else if (h->chan < m_first_chan) {
+            m_rings.insert(m_rings.begin(),
+                           size_t(m_first_chan - h->chan),
+                           RingBuffer<Hit<T>*>(kInitialCapacity));
+            m_first_chan = h->chan;
+        } else if (size_t(h->chan - m_first_chan) >= m_rings.size()) {
+            m_rings.resize(size_t(h->chan - m_first_chan) + 1,
+                           RingBuffer<Hit<T>*>(kInitialCapacity));
+        }
+        m_rings[size_t(h->chan - m_first_chan)].push_back(h);
+    }
+
+    // Remove `h`, which must be the earliest hit on its channel
+    void pop_front(Hit<T>* h)
+    {
+        RingBuffer<Hit<T>*>& ring = m_rings[size_t(h->chan - m_first_chan)];
+        assert(!ring.empty() && ring.front() == h);
+        (void)h;
+        ring.pop_front();
+    }
+
+    bool empty() const { return m_rings.empty(); }
+
+    // The range of channels in the table. Only valid if !empty()
+    int first_channel() const { return m_first_chan; }
+    int last_channel() const { return m_first_chan + int(m_rings.size()) - 1; }
+
+    // The hits on channel `chan`, in time order. `chan` must be in the
+    // range of the table
+    const RingBuffer<Hit<T>*>& channel(int chan) const
+    {
+        return m_rings[size_t(chan - m_first_chan)];
+    }
+
+    // The bytes allocated for the table and the rings
+    size_t memory_bytes() const
+    {
+        size_t bytes = m_rings.capacity() * sizeof(RingBuffer<Hit<T>*>);
+        for (auto const& ring : m_rings) {
+            bytes += ring.capacity() * sizeof(Hit<T>*);
+        }
+        return bytes;
+    }
+
+    // Remove all of the hits, keeping the table
+    void clear()
+    {
+        for (auto& ring : m_rings) {
+            ring.clear();
+        }
+    }
+
+private:
+    // m_rings[i] has the hits on channel m_first_chan + i
+    std::vector<RingBuffer<Hit<T>*>> m_rings;
+    int m_first_chan{ 0 };
+};
+
+}
+
+// Local Variables:
+// mode: c++
+// c-basic-offset: 4
+// c-file-style: "linux"
+// End:
@@ -1,19 +1,31 @@
 #include "Hit.hpp"
 
 #include <algorithm>
+#include <cassert>
 
 namespace dbscan {
 
 //======================================================================
-HitSet::HitSet()
-{
-    hits.reserve(10);
-}
+template<class T>
+HitSet<T>::HitSet(Mode mode, int stamp)
+    : m_mode(mode)
+    , m_stamp(stamp)
+{}
 
 //======================================================================
-void
-HitSet::insert(Hit* h)
+template<class T>
+bool
+HitSet<T>::insert(Hit<T>* h)
 {
+    if (m_mode == Mode::kAppend) {
+        if (h->stamp == m_stamp)
+            return false;
+        assert(h->stamp == kUndefined);
+        h->stamp = m_stamp;
+        hits.push_back(h);
+        return true;
+    }
+
     // We're typically inserting hits at or near the end, so do a
     // linear scan instead of full binary search. This turns out to be much
     // faster in our case
@@ -21,54 +33,94 @@ HitSet::insert(Hit* h)
     while (it != hits.rend() && (*it)->time >= h->time) {
         // Don't insert the hit if we already have it
         if (*it == h) {
-            return;
+            return false;
         }
         ++it;
     }
     
-    if (it == hits.rend() || *it != h) {
-        hits.insert(it.base(), h);
+    hits.insert(it.base(), h);
+    m_sorted_size = hits.size();
+    return true;
+}
+
+//======================================================================
+template<class T>
+void
+HitSet<T>::sort()
+{
+    if (is_sorted()) {
+        return;
+    }
+
+    // Order by pointer within equal times, so that the order doesn't
+    // depend on the order of insertion
+    auto comp = [](const Hit<T>* a, const Hit<T>* b) {
+        return a->time < b->time || (a->time == b->time && a < b);
+    };
+    auto middle = hits.begin() + m_sorted_size;
+    std::sort(middle, hits.end(), comp);
+    std::inplace_merge(hits.begin(), middle, hits.end(), comp);
+    m_sorted_size = hits.size();
+}
+
+//======================================================================
+template<class T>
+void
+HitSet<T>::clear()
+{
+    if (m_mode == Mode::kAppend) {
+        for (auto h : hits) {
+            h->stamp = kUndefined;
+        }
+    }
+    hits.clear();
+    m_sorted_size = 0;
+}
+
+//======================================================================
+template<class T>
+std::vector<Hit<T>*>
+HitSet<T>::release()
+{
+    std::vector<Hit<T>*> ret;
+    ret.swap(hits);
+    m_sorted_size = 0;
+    if (m_mode == Mode::kAppend) {
+        for (auto h : ret) {
+            h->stamp = kUndefined;
+        }
     }
+    return ret;
 }
 
 //======================================================================
-Hit::Hit(float _time, int _chan)
+template<class T>
+Hit<T>::Hit(T _time, int _chan, float _charge)
 {
-    reset(_time, _chan);
+    reset(_time, _chan, _charge);
 }
 
 //======================================================================
 
+template<class T>
 void
-Hit::reset(float _time, int _chan)
+Hit<T>::reset(T _time, int _chan, float _charge)
 {
     time=_time;
     chan=_chan;
+    charge=_charge;
+    neighbour_charge=0;
     cluster=kUndefined;
+    stamp=kUndefined;
     connectedness=Connectedness::kUndefined;
     neighbours.clear();
 }
 
 //======================================================================
-
-// Return true if hit was indeed a neighbour
-bool
-Hit::add_potential_neighbour(Hit* other, float eps, int minPts)
-{
-    if (other != this && euclidean_distance_sqr(*this, *other) < eps*eps) {
-        neighbours.insert(other);
-        if (neighbours.size() + 1 >= minPts) {
-            connectedness = Connectedness::kCore;
-        }
-        // Neighbourliness is symmetric
-        other->neighbours.insert(this);
-        if (other->neighbours.size() + 1 >= minPts) {
-            other->connectedness = Connectedness::kCore;
-        }
-        return true;
-    }
-    return false;
-}
+template class HitSet<float>;
+template class HitSet<tick_t>;
+template struct Hit<float>;
+template struct Hit<tick_t>;
 
 }
 // Local Variables:
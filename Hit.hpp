@@ -2,6 +2,8 @@
 
 #include <vector>
 #include <cmath>
+#include <cstdint>
+#include <cstdlib>
 #include <list>
 
 namespace dbscan {
@@ -37,56 +39,160 @@ enum class Completeness
     kComplete,
 };
 
-class Hit;
+//======================================================================
+
+// Everything that touches hit times is templated on the time type
+// `T`. `float` is the original time domain (timestamps scaled and
+// converted to float), but float granularity grows with the
+// magnitude of the time, so after a few hours of data it exceeds
+// `eps` and the neighbour tests go wrong. For continuous running, use
+// `tick_t`: 64-bit integer ticks, with all of the distance
+// arithmetic done in integers
+typedef int64_t tick_t;
+
+template<class T>
+struct Hit;
 
 //======================================================================
 
 // An array of unique hits, sorted by time. The actual container
 // implementation is a std::vector, which seems to be faster than a
 // std::set (needs rechecking)
+//
+// In kAppend mode, insert() just appends to the array, and the
+// sorting is deferred until sort() is called. Duplicates are caught on
+// insertion using a "stamp" on each hit, which records the set it's
+// in. A hit can only be in one kAppend set at a time: it leaves when
+// the set is cleared or released, and can then go in another. This
+// makes building a big cluster linear instead of quadratic. Until
+// sort() is called, iteration is in insertion order
+template<class T>
 class HitSet
 {
 public:
-    HitSet();
-
-    // Insert a hit in the set, if not already present. Keeps the
-    // array sorted by time
-    void insert(Hit* h);
-
-    std::vector<Hit*>::iterator begin() { return hits.begin(); }
-    std::vector<Hit*>::iterator end() { return hits.end(); }
-
-    std::vector<Hit*>::const_iterator begin() const { return hits.cbegin(); }
-    std::vector<Hit*>::const_iterator end() const { return hits.cend(); }
-
-    void clear() { hits.clear(); }
+    enum class Mode
+    {
+        kSorted,
+        kAppend
+    };
+
+    // `stamp` identifies the set for kAppend mode, so it must be
+    // unique among the sets that a hit can be inserted into
+    explicit HitSet(Mode mode = Mode::kSorted, int stamp = kUndefined);
+
+    // Insert a hit in the set, if not already present. In kSorted
+    // mode, keeps the array sorted by time. Returns true if the hit
+    // was inserted. In kAppend mode, the hit mustn't be in another
+    // kAppend set
+    bool insert(Hit<T>* h);
+
+    // Sort the array by time. Cheap if already sorted
+    void sort();
+
+    bool is_sorted() const { return m_sorted_size == hits.size(); }
+
+    typename std::vector<Hit<T>*>::iterator begin() { return hits.begin(); }
+    typename std::vector<Hit<T>*>::iterator end() { return hits.end(); }
+
+    typename std::vector<Hit<T>*>::const_iterator begin() const
+    {
+        return hits.cbegin();
+    }
+    typename std::vector<Hit<T>*>::const_iterator end() const
+    {
+        return hits.cend();
+    }
+
+    // Empty the set, keeping the array's capacity. In kAppend mode,
+    // its hits are then free to go in another set
+    void clear();
+
+    // Empty the set, and return the hits it had
+    std::vector<Hit<T>*> release();
 
     size_t size() const { return hits.size(); }
 
-    std::vector<Hit*> hits;
+    std::vector<Hit<T>*> hits;
+
+private:
+    Mode m_mode;
+    int m_stamp;
+    // The first m_sorted_size entries in `hits` are sorted
+    size_t m_sorted_size{ 0 };
 };
 
 //======================================================================
+template<class T>
 struct Hit
 {
-    Hit(float _time, int _chan);
+    typedef T time_type;
 
-    void reset(float _time, int _chan);
-    // Add hit `other` to this hit's list of neighbours if they are
-    // closer than `eps`. Return true if so
-    bool add_potential_neighbour(Hit* other, float eps, int minPts);
+    Hit(T _time, int _chan, float _charge = 1);
 
-    float time;
+    void reset(T _time, int _chan, float _charge = 1);
+    // Add hit `other` to this hit's list of neighbours if they are
+    // neighbours according to `metric` (one of the policies in
+    // metrics.hpp). Return true if so
+    template<class Metric, class Core>
+    bool add_potential_neighbour(Hit* other,
+                                 const Metric& metric,
+                                 const Core& core)
+    {
+        if (other != this && metric.is_neighbour(*this, *other)) {
+            add_neighbour(other, core);
+            return true;
+        }
+        return false;
+    }
+
+    // Add `other` to this hit's list of neighbours, and vice versa,
+    // and update the hits' connectedness according to `core` (one of
+    // the criteria in core_criteria.hpp)
+    template<class Core>
+    void add_neighbour(Hit* other, const Core& core)
+    {
+        neighbours.insert(other);
+        neighbour_charge += other->charge;
+        if (core.is_core(*this)) {
+            connectedness = Connectedness::kCore;
+        }
+        // Neighbourliness is symmetric
+        other->neighbours.insert(this);
+        other->neighbour_charge += charge;
+        if (core.is_core(*other)) {
+            other->connectedness = Connectedness::kCore;
+        }
+    }
+
+    T time;
     int chan, cluster;
+    // The hit's charge, and the total charge of its neighbours. The
+    // charge must not be negative. The total is kept in double, like
+    // the sums in dbscan_grid_weighted(), so that rounding doesn't
+    // decide core points that are right at the threshold
+    float charge;
+    double neighbour_charge;
+    // The stamp of the kAppend-mode HitSet that this hit is in, or
+    // kUndefined
+    int stamp;
     Connectedness connectedness;
-    HitSet neighbours;
+    HitSet<T> neighbours;
 };
 
 //======================================================================
-inline float
-manhattan_distance(const Hit& p, const Hit& q)
+template<class T>
+inline T
+abs_diff(T a, T b)
 {
-    return fabs((p.time - q.time)) + fabs(p.chan - q.chan);
+    return a > b ? a - b : b - a;
+}
+
+//======================================================================
+template<class T>
+inline T
+manhattan_distance(const Hit<T>& p, const Hit<T>& q)
+{
+    return abs_diff(p.time, q.time) + T(std::abs(p.chan - q.chan));
 }
 
 //======================================================================
@@ -98,22 +204,43 @@ sqr(T x)
 }
 
 //======================================================================
+template<class T>
 inline float
-euclidean_distance(const Hit& p, const Hit& q)
+euclidean_distance(const Hit<T>& p, const Hit<T>& q)
 {
-    return std::sqrt(sqr(p.time - q.time) + sqr(p.chan - q.chan));
+    return std::sqrt(float(sqr(p.time - q.time) + sqr(T(p.chan - q.chan))));
 }
 
 //======================================================================
-inline float
-euclidean_distance_sqr(const Hit& p, const Hit& q)
+
+// Squared distance, in the time type. For integer times, the caller
+// must make sure the time difference is small enough that its square
+// doesn't overflow (see `is_eps_neighbour`)
+template<class T>
+inline T
+euclidean_distance_sqr(const Hit<T>& p, const Hit<T>& q)
 {
-    return sqr(p.time - q.time) + sqr(p.chan - q.chan);
+    return sqr(p.time - q.time) + sqr(T(p.chan - q.chan));
 }
 
 //======================================================================
+
+// Are `p` and `q` closer than `eps`? The separate time and channel
+// comparisons are a cheap early rejection, and also keep the squares
+// in range for integer times when the hits are far apart
+template<class T>
+inline bool
+is_eps_neighbour(const Hit<T>& p, const Hit<T>& q, T eps)
+{
+    return abs_diff(p.time, q.time) < eps &&
+           T(std::abs(p.chan - q.chan)) < eps &&
+           euclidean_distance_sqr(p, q) < eps * eps;
+}
+
+//======================================================================
+template<class T>
 inline bool
-time_comp_lower(const Hit* hit, const float t)
+time_comp_lower(const Hit<T>* hit, const T t)
 {
     return hit->time < t;
 };
@@ -0,0 +1,49 @@
+#pragma once
+
+#include "Hit.hpp"
+#include "Point.hpp"
+
+#include <deque>
+#include <vector>
+
+namespace dbscan {
+//======================================================================
+//
+// Owns a collection of hits, allocated in large blocks rather than
+// one `new` per hit. Pointers to the hits stay valid until the arena
+// is destroyed
+template<class T>
+class HitArena
+{
+public:
+    Hit<T>* make(T time, int chan, float charge = 1)
+    {
+        m_hits.emplace_back(time, chan, charge);
+        return &m_hits.back();
+    }
+
+    // Make a hit for each of `points`
+    std::vector<Hit<T>*> make_hits(const std::vector<Point>& points)
+    {
+        std::vector<Hit<T>*> ret;
+        ret.reserve(points.size());
+        for (auto const& p : points) {
+            ret.push_back(make(T(p.time), p.chan, p.charge));
+        }
+        return ret;
+    }
+
+    size_t size() const { return m_hits.size(); }
+
+private:
+    // A deque never moves its elements when growing at the end
+    std::deque<Hit<T>> m_hits;
+};
+
+}
+
+// Local Variables:
+// mode: c++
+// c-basic-offset: 4
+// c-file-style: "linux"
+// End:
@@ -0,0 +1,194 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+#include <vector>
+
+namespace dbscan {
+//======================================================================
+//
+// Which channels had hits in each recent time bin, as one bit per
+// channel. The bins are `bin_width` long, and kept in a ring of kNBins,
+// so only the most recent few are available. With the bin width set
+// to the metric's time window, the bins overlapping [t - window, t]
+// are at most the current one and the one before, so a query for the
+// neighbourhood of a hit at time t is an OR of two short runs of
+// words, without touching any hits
+//
+// Hits must be added in time order, and queries made at or after the
+// time of the latest hit. The channel range grows at either end as
+// needed, so channel numbers can be negative, but they should be
+// reasonably compact
+template<class T>
+class OccupancyBitmap
+{
+public:
+    static constexpr size_t kNBins = 4;
+
+    explicit OccupancyBitmap(T bin_width)
+        : m_bin_width(bin_width)
+    {}
+
+    // Mark channel `chan` as occupied in the bin containing `time`
+    void add(T time, int chan)
+    {
+        if (!m_started) {
+            m_started = true;
+            m_origin = time;
+            m_current_bin = 0;
+        }
+        advance(bin_of(time));
+        reserve_channel(chan);
+        size_t bit = size_t(chan - m_first_chan);
+        word(m_current_bin, bit / 64) |= uint64_t(1) << (bit % 64);
+    }
+
+    // Call `f(chan)` for each channel in [lo, hi] that had a hit in
+    // any of the bins overlapping [time - window, time], in increasing
+    // channel order. `window` must be at most the bin width
+    template<class F>
+    void for_each_occupied(T time, T window, int lo, int hi, F&& f) const
+    {
+        if (!m_started || m_n_words == 0)
+            return;
+        int64_t first_bin = bin_of(time - window);
+        int64_t last_bin = std::min(bin_of(time), m_current_bin);
+        first_bin = std::max(first_bin, m_current_bin - int64_t(kNBins) + 1);
+        if (first_bin > last_bin)
+            return;
+
+        long long first = m_first_chan;
+        long long last = first + 64 * (long long)m_n_words - 1;
+        if (lo < first)
+            lo = int(first);
+        if (hi > last)
+            hi = int(last);
+        if (lo > hi)
+            return;
+        size_t lo_bit = size_t(lo - m_first_chan);
+        size_t hi_bit = size_t(hi - m_first_chan);
+        for (size_t w = lo_bit / 64; w <= hi_bit / 64; ++w) {
+            uint64_t bits = 0;
+            for (int64_t b = first_bin; b <= last_bin; ++b) {
+                bits |= word(b, w);
+            }
+            // Mask off the channels outside [lo, hi]
+            if (w == lo_bit / 64)
+                bits &= ~uint64_t(0) << (lo_bit % 64);
+            if (w == hi_bit / 64 && hi_bit % 64 != 63)
+                bits &= (uint64_t(1) << (hi_bit % 64 + 1)) - 1;
+            while (bits) {
+                int b = __builtin_ctzll(bits);
+                f(m_first_chan + int(64 * w) + b);
+                bits &= bits - 1;
+            }
+        }
+    }
+
+    // The bytes allocated for the bitmaps
+    size_t memory_bytes() const
+    {
+        return m_words.capacity() * sizeof(uint64_t);
+    }
+
+    void clear()
+    {
+        m_started = false;
+        std::fill(m_words.begin(), m_words.end(), 0);
+    }
+
+private:
+    int64_t bin_of(T time) const
+    {
+        if constexpr (std::is_integral<T>::value) {
+            T d = time - m_origin;
+            // Round towards minus infinity
+            return int64_t(d >= 0 ? d / m_bin_width
+                                  : -((-d + m_bin_width - 1) / m_bin_width));
+        } else {
+            return int64_t(std::floor((time - m_origin) / m_bin_width));
+        }
+    }
+
+    uint64_t& word(int64_t bin, size_t w)
+    {
+        return m_words[size_t(bin & int64_t(kNBins - 1)) * m_n_words + w];
+    }
+
+    uint64_t word(int64_t bin, size_t w) const
+    {
+        return m_words[size_t(bin & int64_t(kNBins - 1)) * m_n_words + w];
+    }
+
+    // Move the current bin on to `bin`, clearing the bins in between,
+    // which had no hits
+    void advance(int64_t bin)
+    {
+        if (bin <= m_current_bin)
+            return;
+        int64_t first_cleared =
+            std::max(m_current_bin + 1, bin - int64_t(kNBins) + 1);
+        for (int64_t b = first_cleared; b <= bin; ++b) {
+            for (size_t w = 0; w < m_n_words; ++w) {
+                word(b, w) = 0;
+            }
+        }
+        m_current_bin = bin;
+    }
+
+    // Widen the channel range to include `chan`, in whole words
+    void reserve_channel(int chan)
+    {
+        // The word boundary at or below `chan`, rounding towards minus
+        // infinity
+        auto word_start = [](int c) {
+            return c >= 0 ? c - c % 64 : c - ((c % 64) + 64) % 64;
+        };
+        if (m_n_words == 0) {
+            m_first_chan = word_start(chan);
+            m_n_words = 1;
+            m_words.assign(kNBins, 0);
+            return;
+        }
+        size_t prepend = 0, append = 0;
+        if (chan < m_first_chan) {
+            prepend = size_t(m_first_chan - word_start(chan)) / 64;
+        } else if (size_t(chan - m_first_chan) >= 64 * m_n_words) {
+            append = size_t(chan - m_first_chan) / 64 + 1 - m_n_words;
+        } else {
+            return;
+        }
+        size_t n_words = m_n_words + prepend + append;
+        std::vector<uint64_t> words(kNBins * n_words, 0);
+        for (size_t slot = 0; slot < kNBins; ++slot) {
+            for (size_t w = 0; w < m_n_words; ++w) {
+                words[slot * n_words + prepend + w] =
+                    m_words[slot * m_n_words + w];
+            }
+        }
+        m_words.swap(words);
+        m_n_words = n_words;
+        m_first_chan -= int(64 * prepend);
+    }
+
+    T m_bin_width;
+    bool m_started{ false };
+    T m_origin{ 0 };
+    int64_t m_current_bin{ 0 };
+    // Bit i of word w in the bin in slot s is m_words[s * m_n_words +
+    // w], for channel m_first_chan + 64 * w + i
+    std::vector<uint64_t> m_words;
+    size_t m_n_words{ 0 };
+    int m_first_chan{ 0 };
+};
+
+}
+
+// Local Variables:
+// mode: c++
+// c-basic-offset: 4
+// c-file-style: "linux"
+// End:
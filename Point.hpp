@@ -1,7 +1,13 @@
 #pragma once
 
+#include <cstdint>
+
 struct Point
 {
     int chan;
-    float time;
+    // Time in integer ticks since the first hit in the file
+    int64_t time;
+    // The hit's charge (eg ADC integral or time over threshold), if
+    // the input has it
+    float charge{ 1 };
 };
@@ -0,0 +1,86 @@
+#pragma once
+
+#include <vector>
+#include <cstddef>
+
+namespace dbscan {
+//======================================================================
+//
+// A FIFO queue with random access, stored in a power-of-two-sized
+// array. Adding to the back and removing from the front are O(1) and
+// never move the other elements, unlike erasing from the front of a
+// std::vector. The storage doubles when it's full, so the capacity
+// settles at the largest size ever needed
+template<class T>
+class RingBuffer
+{
+public:
+    explicit RingBuffer(size_t capacity = 1024)
+    {
+        size_t n = 1;
+        while (n < capacity)
+            n *= 2;
+        m_buf.resize(n);
+        m_mask = n - 1;
+    }
+
+    void push_back(const T& x)
+    {
+        if (m_size == m_buf.size())
+            grow();
+        m_buf[(m_head + m_size) & m_mask] = x;
+        ++m_size;
+    }
+
+    // Precondition: !empty()
+    void pop_front()
+    {
+        m_head = (m_head + 1) & m_mask;
+        --m_size;
+    }
+
+    // Element `i` counting from the front
+    T& operator[](size_t i) { return m_buf[(m_head + i) & m_mask]; }
+    const T& operator[](size_t i) const { return m_buf[(m_head + i) & m_mask]; }
+
+    T& front() { return (*this)[0]; }
+    const T& front() const { return (*this)[0]; }
+    T& back() { return (*this)[m_size - 1]; }
+    const T& back() const { return (*this)[m_size - 1]; }
+
+    size_t size() const { return m_size; }
+    bool empty() const { return m_size == 0; }
+    size_t capacity() const { return m_buf.size(); }
+
+    void clear()
+    {
+        m_head = 0;
+        m_size = 0;
+    }
+
+private:
+    // Double the storage, unwrapping the contents to start at index 0
+    void grow()
+    {
+        std::vector<T> new_buf(2 * m_buf.size());
+        for (size_t i = 0; i < m_size; ++i) {
+            new_buf[i] = (*this)[i];
+        }
+        m_buf.swap(new_buf);
+        m_mask = m_buf.size() - 1;
+        m_head = 0;
+    }
+
+    std::vector<T> m_buf;
+    size_t m_mask{ 0 };
+    size_t m_head{ 0 };
+    size_t m_size{ 0 };
+};
+
+}
+
+// Local Variables:
+// mode: c++
+// c-basic-offset: 4
+// c-file-style: "linux"
+// End:
@@ -0,0 +1,426 @@
+#include "Point.hpp"
+#include "read_hits.hpp"
+
+#include "dbscan.hpp"
+#include "dbscan_factory.hpp"
+#include "cluster_stream.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "CLI11.hpp"
+
+// Benchmark: times IncrementalDBSCAN over a hit file with eps and
+// minPts set at run time, and with the specialisation chosen by
+// make_incremental_dbscan(). Also compares the two neighbour indices,
+// optionally with the channels folded onto fewer channels to see how
+// they scale with the channel count, and times writing the clusters
+// to a cluster stream against the clustering rate
+
+using dbscan::tick_t;
+
+//======================================================================
+//
+// The result of one benchmark variant: the best time over the repeats,
+// and the number of clusters found (which should be the same for all
+// variants)
+struct BenchResult
+{
+    double seconds;
+    size_t n_clusters;
+};
+
+//======================================================================
+//
+// Run `f(clusters)` `repeats` times, and return the fastest
+template<class F>
+BenchResult
+best_of(int repeats, F&& f)
+{
+    BenchResult ret{ 1e99, 0 };
+    for (int i = 0; i < repeats; ++i) {
+        std::vector<dbscan::Cluster<tick_t>> clusters;
+        auto start = std::chrono::steady_clock::now();
+        f(clusters);
+        double seconds = std::chrono::duration<double>(
+                             std::chrono::steady_clock::now() - start)
+                             .count();
+        ret.seconds = std::min(ret.seconds, seconds);
+        ret.n_clusters = clusters.size();
+    }
+    return ret;
+}
+
+//======================================================================
+void
+print_result(const std::string& name,
+             const BenchResult& result,
+             size_t n_hits,
+             double baseline_seconds)
+{
+    std::cout << name << ": " << result.seconds << "s, "
+              << (n_hits / result.seconds / 1e6) << " Mhits/s, "
+              << result.n_clusters << " clusters, speedup "
+              << (baseline_seconds / result.seconds) << std::endl;
+}
+
+//======================================================================
+//
+// Time the runtime version with each of the neighbour indices, on the
+// hits with times `times` and channels `channels`. Returns false if
+// they found different numbers of clusters
+bool
+compare_indices(const std::string& label,
+                const std::vector<tick_t>& times,
+                const std::vector<int>& channels,
+                tick_t eps,
+                unsigned int minPts,
+                int repeats,
+                double baseline_seconds)
+{
+    auto run_with = [&](dbscan::NeighbourIndex index) {
+        return best_of(repeats, [&](auto& clusters) {
+            dbscan::IncrementalDBSCAN<tick_t> dbscanner(
+                eps, minPts, 100000, index);
+            for (size_t i = 0; i < times.size(); ++i) {
+                dbscanner.add_point(times[i], channels[i], &clusters);
+            }
+            dbscanner.flush(&clusters);
+        });
+    };
+    auto time_ordered = run_with(dbscan::NeighbourIndex::kTimeOrdered);
+    print_result(label + ", time-ordered index",
+                 time_ordered,
+                 times.size(),
+                 baseline_seconds);
+    auto per_channel = run_with(dbscan::NeighbourIndex::kPerChannel);
+    print_result(label + ", per-channel index",
+                 per_channel,
+                 times.size(),
+                 baseline_seconds);
+    auto occupancy = run_with(dbscan::NeighbourIndex::kPerChannelOccupancy);
+    print_result(label + ", occupancy index",
+                 occupancy,
+                 times.size(),
+                 baseline_seconds);
+    if (per_channel.n_clusters != time_ordered.n_clusters ||
+        occupancy.n_clusters != time_ordered.n_clusters) {
+        std::cerr << "The neighbour indices found different numbers of "
+                     "clusters"
+                  << std::endl;
+        return false;
+    }
+    return true;
+}
+
+//======================================================================
+//
+// `points` ordered by time, channel and charge, so that two lists of
+// the same hits compare equal whatever order equal-time hits are in
+std::vector<Point>
+sorted_points(std::vector<Point> points)
+{
+    std::sort(points.begin(),
+              points.end(),
+              [](const Point& a, const Point& b) {
+                  if (a.time != b.time)
+                      return a.time < b.time;
+                  if (a.chan != b.chan)
+                      return a.chan < b.chan;
+                  return a.charge < b.charge;
+              });
+    return points;
+}
+
+//======================================================================
+//
+// Check that `decoded`, read back from a cluster stream, holds the same
+// clusters as `clusters` in the same order, with the same indices and
+// hits. The stream leaves out empty clusters. Prints the first
+// difference and returns false if they differ
+bool
+same_clusters(const std::string& label,
+              const std::vector<dbscan::Cluster<tick_t>>& clusters,
+              const std::vector<dbscan::StoredCluster>& decoded)
+{
+    size_t k = 0;
+    for (auto const& cluster : clusters) {
+        if (cluster.hits.size() == 0)
+            continue;
+        if (k == decoded.size()) {
+            std::cerr << label << ": only " << decoded.size()
+                      << " clusters read back" << std::endl;
+            return false;
+        }
+        const dbscan::StoredCluster& d = decoded[k++];
+        // A cluster's hit set can hold a hit twice until it's sorted
+        std::vector<const dbscan::Hit<tick_t>*> hits(cluster.hits.begin(),
+                                                     cluster.hits.end());
+        std::sort(hits.begin(), hits.end());
+        hits.erase(std::unique(hits.begin(), hits.end()), hits.end());
+        std::vector<Point> expected;
+        for (auto h : hits) {
+            expected.push_back(Point{ h->chan, h->time, h->charge });
+        }
+        expected = sorted_points(expected);
+        std::vector<Point> got = sorted_points(d.hits);
+
+        bool same = d.index == cluster.index && got.size() == expected.size();
+        for (size_t i = 0; same && i < got.size(); ++i) {
+            same = got[i].time == expected[i].time &&
+                   got[i].chan == expected[i].chan &&
+                   got[i].charge == expected[i].charge;
+        }
+        if (!same) {
+            std::cerr << label << ": cluster " << cluster.index << " ("
+                      << expected.size() << " hits) read back as cluster "
+                      << d.index << " (" << got.size()
+                      << " hits) with different hits" << std::endl;
+            return false;
+        }
+    }
+    if (k != decoded.size()) {
+        std::cerr << label << ": " << decoded.size() - k
+                  << " extra clusters read back" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+//======================================================================
+//
+// Time encoding the clusters of `points` to a cluster stream, with and
+// without compression, and decoding them again, and compare the times
+// to the clustering time of the same hits. The writer has to keep up
+// with the clusterer, or it'll be the bottleneck. Returns false if
+// the decoded clusters don't match
+bool
+bench_cluster_stream(const std::vector<Point>& points,
+                     tick_t eps,
+                     unsigned int minPts,
+                     int repeats,
+                     double cluster_seconds)
+{
+    // Keep every hit in the pool, so the clusters stay intact to be
+    // written over and over
+    dbscan::IncrementalDBSCAN<tick_t> dbscanner(
+        eps, minPts, points.size() + 1);
+    std::vector<dbscan::Cluster<tick_t>> clusters;
+    for (auto const& p : points) {
+        dbscanner.add_point_with_charge(
+            p.time, p.chan, p.charge, &clusters, nullptr);
+    }
+    dbscanner.flush(&clusters);
+    size_t n_hits = 0;
+    for (auto const& c : clusters) {
+        n_hits += c.hits.size();
+    }
+    auto report = [&](const std::string& name, double seconds) {
+        std::cout << name << ": " << seconds << "s, "
+                  << (n_hits / seconds / 1e6) << " Mhits/s, "
+                  << (cluster_seconds / seconds)
+                  << " times as fast as the clustering" << std::endl;
+    };
+
+    for (bool compress : { false, true }) {
+        std::string stream;
+        double best = 1e99;
+        for (int i = 0; i < repeats; ++i) {
+            std::ostringstream os;
+            auto start = std::chrono::steady_clock::now();
+            dbscan::ClusterStreamWriter writer(os, compress);
+            for (auto const& c : clusters) {
+                writer.write(c);
+            }
+            writer.close();
+            best = std::min(best,
+                            std::chrono::duration<double>(
+                                std::chrono::steady_clock::now() - start)
+                                .count());
+            stream = os.str();
+        }
+        std::string label =
+            compress ? "cluster stream, compressed" : "cluster stream, raw";
+        std::cout << label << ": " << stream.size() << " bytes, "
+                  << (double(stream.size()) / n_hits) << " per hit"
+                  << std::endl;
+        report(label + ", write", best);
+
+        best = 1e99;
+        for (int i = 0; i < repeats; ++i) {
+            std::istringstream is(stream);
+            auto start = std::chrono::steady_clock::now();
+            dbscan::ClusterStreamReader reader(is);
+            dbscan::StoredCluster c;
+            while (reader.read(c)) {
+            }
+            best = std::min(best,
+                            std::chrono::duration<double>(
+                                std::chrono::steady_clock::now() - start)
+                                .count());
+        }
+        report(label + ", read", best);
+
+        // Outside the timing, check that the stream decodes to the
+        // clusters that were written
+        std::istringstream is(stream);
+        dbscan::ClusterStreamReader reader(is);
+        std::vector<dbscan::StoredCluster> decoded;
+        dbscan::StoredCluster c;
+        while (reader.read(c)) {
+            decoded.push_back(c);
+        }
+        if (reader.error()) {
+            std::cerr << label << ": error reading back the stream"
+                      << std::endl;
+            return false;
+        }
+        if (!same_clusters(label, clusters, decoded))
+            return false;
+    }
+    return true;
+}
+
+//======================================================================
+int
+main(int argc, char** argv)
+{
+    CLI::App cliapp{ "Benchmark IncrementalDBSCAN specialisations" };
+
+    std::string filename;
+    cliapp.add_option("-f,--file", filename, "Input file of hits")
+        ->required();
+    int nhits = -1;
+    cliapp.add_option(
+        "-n,--nhits", nhits, "Maximum number of hits to read from file");
+    int nskip = 0;
+    cliapp.add_option(
+        "-s,--nskip", nskip, "Number of hits at start of file to skip");
+    tick_t eps = 10;
+    cliapp.add_option(
+        "-d,--distance", eps, "Distance threshold for points to be neighbours");
+    unsigned int minPts = 2;
+    cliapp.add_option(
+        "-m,--minpts", minPts, "Minimum number of hits to form a cluster");
+    int repeats = 5;
+    cliapp.add_option(
+        "-r,--repeats", repeats, "Number of runs of each variant (best is kept)");
+    std::vector<int> channel_counts;
+    cliapp.add_option("--channel-counts",
+                      channel_counts,
+                      "Also compare the neighbour indices with the channels "
+                      "folded onto each of these numbers of channels");
+
+    CLI11_PARSE(cliapp, argc, argv);
+
+    auto points = get_points(filename, nhits, nskip);
+    if (points.empty()) {
+        std::cerr << "No hits read from " << filename << std::endl;
+        return 1;
+    }
+    sort_points_by_time(points);
+
+    std::vector<tick_t> times;
+    std::vector<int> channels;
+    times.reserve(points.size());
+    channels.reserve(points.size());
+    for (auto const& p : points) {
+        times.push_back(p.time);
+        channels.push_back(p.chan);
+    }
+
+    std::cout << "Benchmarking " << points.size() << " hits, eps=" << eps
+              << " minPts=" << minPts << ", best of " << repeats << std::endl;
+
+    auto runtime = best_of(repeats, [&](auto& clusters) {
+        dbscan::IncrementalDBSCAN<tick_t> dbscanner(eps, minPts);
+        for (size_t i = 0; i < times.size(); ++i) {
+            dbscanner.add_point(times[i], channels[i], &clusters);
+        }
+        dbscanner.flush(&clusters);
+    });
+    print_result("runtime eps/minPts", runtime, points.size(), runtime.seconds);
+
+    auto unfiltered = best_of(repeats, [&](auto& clusters) {
+        dbscan::IncrementalDBSCAN<tick_t> dbscanner(eps, minPts);
+        dbscanner.set_prefilter(false);
+        for (size_t i = 0; i < times.size(); ++i) {
+            dbscanner.add_point(times[i], channels[i], &clusters);
+        }
+        dbscanner.flush(&clusters);
+    });
+    print_result(
+        "runtime, no prefilter", unfiltered, points.size(), runtime.seconds);
+    if (unfiltered.n_clusters != runtime.n_clusters) {
+        std::cerr << "Prefiltered and unfiltered versions found different "
+                     "numbers of clusters"
+                  << std::endl;
+        return 1;
+    }
+
+    if (!compare_indices("runtime", times, channels, eps, minPts, repeats,
+                         runtime.seconds)) {
+        return 1;
+    }
+    for (int n_channels : channel_counts) {
+        if (n_channels <= 0) {
+            std::cerr << "Channel counts must be positive" << std::endl;
+            return 1;
+        }
+        std::vector<int> folded(channels.size());
+        for (size_t i = 0; i < channels.size(); ++i) {
+            folded[i] = ((channels[i] % n_channels) + n_channels) % n_channels;
+        }
+        if (!compare_indices(std::to_string(n_channels) + " channels",
+                             times, folded, eps, minPts, repeats,
+                             runtime.seconds)) {
+            return 1;
+        }
+    }
+
+    if (!bench_cluster_stream(points, eps, minPts, repeats, runtime.seconds))
+        return 1;
+
+    auto general = best_of(repeats, [&](auto& clusters) {
+        auto dbscanner = dbscan::make_incremental_dbscan(
+            eps, minPts, 100000, false);
+        dbscanner->add_points(
+            times.data(), channels.data(), times.size(), &clusters);
+        dbscanner->flush(&clusters);
+    });
+    print_result(
+        "factory, general", general, points.size(), runtime.seconds);
+
+    if (!dbscan::make_incremental_dbscan(eps, minPts, 1)->is_specialised()) {
+        std::cout << "No specialisation compiled in for eps=" << eps
+                  << " minPts=" << minPts << std::endl;
+        return 0;
+    }
+
+    auto specialised = best_of(repeats, [&](auto& clusters) {
+        auto dbscanner = dbscan::make_incremental_dbscan(eps, minPts);
+        dbscanner->add_points(
+            times.data(), channels.data(), times.size(), &clusters);
+        dbscanner->flush(&clusters);
+    });
+    print_result(
+        "factory, specialised", specialised, points.size(), runtime.seconds);
+
+    if (specialised.n_clusters != runtime.n_clusters) {
+        std::cerr << "Specialised and runtime versions found different "
+                     "numbers of clusters"
+                  << std::endl;
+        return 1;
+    }
+    return 0;
+}
+
+// Local Variables:
+// mode: c++
+// c-basic-offset: 4
+// c-file-style: "linux"
+// End:
@@ -0,0 +1,250 @@
+#include "channel_filter.hpp"
+
+#include <algorithm>
+#include <cassert>
+#include <limits>
+
+namespace dbscan {
+
+//======================================================================
+template<class T>
+ChannelFilter<T>::ChannelFilter(const ChannelFilterConfig<T>& config)
+    : m_config(config)
+{
+    assert(m_config.window <= 0 || (m_config.unmask_rate > 0 &&
+                                     m_config.unmask_rate <= m_config.mask_rate));
+    for (int chan : m_config.static_mask) {
+        set_static_mask(chan, true);
+    }
+}
+
+//======================================================================
+template<class T>
+typename ChannelFilter<T>::ChannelState&
+ChannelFilter<T>::state(int chan)
+{
+    if (m_channels.empty()) {
+        m_first_chan = chan;
+        m_channels.emplace_back();
+        return m_channels.front();
+    }
+    long long first = m_first_chan;
+    long long size = (long long)m_channels.size();
+    if (chan < first) {
+        // Grow by at least the table's size, as in IsolationFilter::add
+        long long grow = std::max(first - chan, size);
+        grow = std::min({ grow,
+                          kMaxChannels - size,
+                          first - std::numeric_limits<int>::min() });
+        if (first - chan > grow)
+            return m_outliers[chan];
+        m_channels.insert(m_channels.begin(), size_t(grow), ChannelState());
+        m_first_chan = int(first - grow);
+        take_outliers();
+    } else if (chan - first >= size) {
+        if (chan - first >= kMaxChannels)
+            return m_outliers[chan];
+        m_channels.resize(size_t(chan - first) + 1);
+        take_outliers();
+    }
+    return m_channels[size_t(chan - m_first_chan)];
+}
+
+//======================================================================
+template<class T>
+const typename ChannelFilter<T>::ChannelState*
+ChannelFilter<T>::find_state(int chan) const
+{
+    long long i = (long long)chan - m_first_chan;
+    if (i >= 0 && i < (long long)m_channels.size())
+        return &m_channels[size_t(i)];
+    auto it = m_outliers.find(chan);
+    return it == m_outliers.end() ? nullptr : &it->second;
+}
+
+//======================================================================
+template<class T>
+void
+ChannelFilter<T>::take_outliers()
+{
+    if (m_outliers.empty())
+        return;
+    long long first = m_first_chan;
+    long long last = first + (long long)m_channels.size() - 1;
+    for (auto it = m_outliers.begin(); it != m_outliers.end();) {
+        if (it->first >= first && it->first <= last) {
+            m_channels[size_t(it->first - first)] = it->second;
+            it = m_outliers.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+//======================================================================
+template<class T>
+void
+ChannelFilter<T>::roll_buckets(ChannelState& s, T time) const
+{
+    const T window = m_config.window;
+    if (!s.seen) {
+        s.seen = true;
+        s.bucket_start = time;
+    } else if (time >= s.bucket_start + window) {
+        // Move on to the bucket containing `time`. If that skips a
+        // whole bucket, the previous one was empty
+        if (time < s.bucket_start + 2 * window) {
+            s.previous = s.current;
+            s.bucket_start += window;
+        } else {
+            s.previous = 0;
+            s.bucket_start = time;
+        }
+        s.current = 0;
+    }
+}
+
+//======================================================================
+template<class T>
+double
+ChannelFilter<T>::rate(const ChannelState& s, T time) const
+{
+    const T window = m_config.window;
+    if (!s.seen)
+        return 0;
+    // The same as rolling a copy of `s` on to `time`, for the cases
+    // where that's needed
+    if (time < s.bucket_start + window) {
+        double in_bucket = double(time - s.bucket_start) / double(window);
+        return s.current + s.previous * (1 - in_bucket);
+    }
+    if (time < s.bucket_start + 2 * window) {
+        double in_bucket =
+          double(time - s.bucket_start - window) / double(window);
+        return s.current * (1 - in_bucket);
+    }
+    return 0;
+}
+
+//======================================================================
+template<class T>
+void
+ChannelFilter<T>::mask(ChannelState& s, int chan)
+{
+    s.masked = true;
+    s.n_while_masked = 0;
+    m_masked.push_back(chan);
+    ++m_counters.n_mask_events;
+    ++m_counters.n_masked_now;
+}
+
+//======================================================================
+template<class T>
+void
+ChannelFilter<T>::unmask(ChannelState& s, int chan)
+{
+    s.masked = false;
+    auto it = std::find(m_masked.begin(), m_masked.end(), chan);
+    assert(it != m_masked.end());
+    *it = m_masked.back();
+    m_masked.pop_back();
+    ++m_counters.n_unmask_events;
+    --m_counters.n_masked_now;
+}
+
+//======================================================================
+template<class T>
+void
+ChannelFilter<T>::advance(T time)
+{
+    if (m_masked.empty() || time < m_next_sweep)
+        return;
+    // Backwards, since unmask() moves the last channel into the gap
+    for (size_t i = m_masked.size(); i-- > 0;) {
+        int chan = m_masked[i];
+        ChannelState& s = state(chan);
+        if (rate(s, time) < m_config.unmask_rate)
+            unmask(s, chan);
+    }
+    T step = m_config.window / 8;
+    m_next_sweep = time + (step > 0 ? step : m_config.window);
+}
+
+//======================================================================
+template<class T>
+bool
+ChannelFilter<T>::accept(T time, int chan)
+{
+    advance(time);
+    ChannelState& s = state(chan);
+    if (s.static_mask) {
+        ++m_counters.n_dropped_static;
+        return false;
+    }
+    if (m_config.window <= 0) {
+        ++m_counters.n_accepted;
+        return true;
+    }
+
+    // Unmask on the rate of the channel's other hits, so that a
+    // channel can be unmasked by its next hit at any positive
+    // `unmask_rate`, but mask on the rate including this one
+    roll_buckets(s, time);
+    double r = rate(s, time);
+    if (!s.masked && r + 1 > m_config.mask_rate)
+        mask(s, chan);
+    else if (s.masked && r < m_config.unmask_rate)
+        unmask(s, chan);
+    ++s.current;
+
+    if (s.masked) {
+        // Pass the first of each `downsample` hits
+        bool pass = m_config.downsample > 1 &&
+                    s.n_while_masked++ % m_config.downsample == 0;
+        if (!pass) {
+            ++m_counters.n_dropped_hot;
+            return false;
+        }
+    }
+    ++m_counters.n_accepted;
+    return true;
+}
+
+//======================================================================
+template<class T>
+void
+ChannelFilter<T>::set_static_mask(int chan, bool masked)
+{
+    state(chan).static_mask = masked;
+}
+
+//======================================================================
+template<class T>
+bool
+ChannelFilter<T>::is_masked(int chan) const
+{
+    const ChannelState* s = find_state(chan);
+    return s && (s->masked || s->static_mask);
+}
+
+//======================================================================
+template<class T>
+std::vector<int>
+ChannelFilter<T>::masked_channels() const
+{
+    std::vector<int> ret = m_masked;
+    std::sort(ret.begin(), ret.end());
+    return ret;
+}
+
+//======================================================================
+template class ChannelFilter<float>;
+template class ChannelFilter<tick_t>;
+
+}
+
+// Local Variables:
+// mode: c++
+// c-basic-offset: 4
+// c-file-style: "linux"
+// End:
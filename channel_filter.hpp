@@ -0,0 +1,160 @@
+#pragma once
+
+#include "Hit.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <unordered_map>
+#include <vector>
+
+namespace dbscan {
+//======================================================================
+//
+// Settings for ChannelFilter. Rates are in hits per `window`
+template<class T>
+struct ChannelFilterConfig
+{
+    // The length of the sliding window over which each channel's hit
+    // rate is measured. Zero turns off the automatic masking, leaving
+    // just the static mask
+    T window{ 0 };
+    // A channel is masked when its rate goes above `mask_rate`, and
+    // unmasked when it drops below `unmask_rate`. The gap between the
+    // two stops a channel that's hovering around the threshold from
+    // flapping. `unmask_rate` must be positive and at most `mask_rate`
+    double mask_rate{ 0 };
+    double unmask_rate{ 0 };
+    // If greater than 1, pass one in every `downsample` hits from a
+    // masked channel instead of dropping them all, so the channel
+    // isn't completely blind while it's hot
+    unsigned int downsample{ 0 };
+    // Channels that are always masked, whatever their rate
+    std::vector<int> static_mask;
+};
+
+//======================================================================
+//
+// Counts of what ChannelFilter has done, over its whole lifetime
+struct ChannelFilterCounters
+{
+    uint64_t n_accepted{ 0 };
+    // Hits dropped from channels masked for their rate, and from
+    // statically-masked channels
+    uint64_t n_dropped_hot{ 0 };
+    uint64_t n_dropped_static{ 0 };
+    // The number of times any channel was masked and unmasked
+    uint64_t n_mask_events{ 0 };
+    uint64_t n_unmask_events{ 0 };
+    // The number of channels masked for their rate right now
+    size_t n_masked_now{ 0 };
+};
+
+//======================================================================
+//
+// A stage to go ahead of IncrementalDBSCAN, which drops hits from hot
+// or noisy channels. One ringing channel fills the time window with
+// hits that every other hit nearby has to be compared with, and makes
+// an endless chain of clusters, so without this the clustering cost
+// is at the mercy of the hardware
+//
+// Each channel's rate is estimated over a sliding window with two
+// fixed buckets of length `window`: the current bucket's count plus
+// the previous bucket's count weighted by the part of it that's still
+// inside the window. That's O(1) time and memory per channel, whatever
+// the rate. The rate is of all the channel's hits, including the ones
+// that are dropped, so a masked channel is unmasked once it quietens
+// down: either at its next hit, if the rate of its other hits in the
+// window has dropped below `unmask_rate`, or by advance() if it has
+// gone silent
+//
+// The per-channel table grows at either end as needed, so channel
+// numbers can be negative. As in IsolationFilter, it never spans more
+// than kMaxChannels channels, and the channels outside that go in a
+// hash map
+template<class T>
+class ChannelFilter
+{
+public:
+    // The most channels the dense table spans
+    static constexpr long long kMaxChannels = 1 << 20;
+
+    explicit ChannelFilter(const ChannelFilterConfig<T>& config);
+
+    // Record a hit at `time` on channel `chan`, and return true if it
+    // should be passed on to the clustering. Hits must be given in
+    // time order. This calls advance(time) first
+    bool accept(T time, int chan);
+
+    // Unmask the masked channels whose rate has dropped below
+    // `unmask_rate` by `time`, without a hit. accept() calls this, but
+    // it only looks at the masked channels every eighth of a window, so
+    // call it directly to bring masked_channels() up to date when
+    // there are no hits. `time` must not be before the last hit
+    void advance(T time);
+
+    // Mask or unmask channel `chan` statically
+    void set_static_mask(int chan, bool masked);
+
+    // Is `chan` masked right now, for its rate or statically?
+    bool is_masked(int chan) const;
+
+    // The channels that are masked for their rate right now
+    std::vector<int> masked_channels() const;
+
+    const ChannelFilterCounters& counters() const { return m_counters; }
+
+private:
+    struct ChannelState
+    {
+        // The start time of the current bucket, and the hit counts in
+        // the current and previous buckets
+        T bucket_start{ 0 };
+        uint32_t current{ 0 };
+        uint32_t previous{ 0 };
+        // Hits seen while masked, for downsampling
+        uint32_t n_while_masked{ 0 };
+        bool seen{ false };
+        bool masked{ false };
+        bool static_mask{ false };
+    };
+
+    // The state of channel `chan`, growing the table if necessary
+    ChannelState& state(int chan);
+
+    // The state of channel `chan`, or null if it hasn't got one
+    const ChannelState* find_state(int chan) const;
+
+    // Move any hash map entries that the table now covers into it
+    void take_outliers();
+
+    // Move `s` on to the bucket containing `time`
+    void roll_buckets(ChannelState& s, T time) const;
+
+    // The estimated rate on `s` at `time`, not counting any hit there
+    double rate(const ChannelState& s, T time) const;
+
+    // Mask or unmask channel `chan`, whose state is `s`
+    void mask(ChannelState& s, int chan);
+    void unmask(ChannelState& s, int chan);
+
+    ChannelFilterConfig<T> m_config;
+    // m_channels[i] is the state of channel m_first_chan + i
+    std::vector<ChannelState> m_channels;
+    int m_first_chan{ 0 };
+    // The state of each channel outside the table
+    std::unordered_map<int, ChannelState> m_outliers;
+    // The channels masked for their rate, in no particular order, and
+    // the earliest time advance() looks at them again
+    std::vector<int> m_masked;
+    T m_next_sweep{ std::numeric_limits<T>::lowest() };
+    ChannelFilterCounters m_counters;
+};
+
+}
+
+// Local Variables:
+// mode: c++
+// c-basic-offset: 4
+// c-file-style: "linux"
+// End:
@@ -0,0 +1,221 @@
+#include "cluster_compare.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <iostream>
+#include <unordered_map>
+
+namespace dbscan {
+
+namespace {
+
+//======================================================================
+template<class T>
+struct HitKey
+{
+    T time;
+    int chan;
+    bool operator==(const HitKey& o) const
+    {
+        return time == o.time && chan == o.chan;
+    }
+};
+
+template<class T>
+struct HitKeyHash
+{
+    size_t operator()(const HitKey<T>& k) const
+    {
+        return std::hash<T>()(k.time) * 0x9e3779b97f4a7c15ULL ^
+               std::hash<int>()(k.chan);
+    }
+};
+
+template<class T>
+using HitLabelMap = std::unordered_map<HitKey<T>, uint32_t, HitKeyHash<T>>;
+
+//======================================================================
+//
+// Map each hit's (time, channel) to the position of its cluster in
+// `clusters`, and count the distinct hits in each cluster. If the same
+// (time, channel) appears more than once, the first one wins
+template<class T>
+void
+label_hits(const std::vector<Cluster<T>>& clusters,
+           HitLabelMap<T>& labels,
+           std::vector<size_t>& sizes)
+{
+    size_t n_hits = 0;
+    for (auto const& cluster : clusters) {
+        n_hits += cluster.hits.size();
+    }
+    labels.reserve(n_hits);
+    sizes.assign(clusters.size(), 0);
+
+    for (size_t i = 0; i < clusters.size(); ++i) {
+        for (auto const& hit : clusters[i].hits) {
+            if (labels.emplace(HitKey<T>{ hit->time, hit->chan }, i).second)
+                ++sizes[i];
+        }
+    }
+}
+
+//======================================================================
+inline double
+pairs(double n)
+{
+    return n * (n - 1) / 2;
+}
+
+}
+
+//======================================================================
+template<class T>
+ClusterComparison<T>
+compare_clusters(const std::vector<Cluster<T>>& clusters1,
+                 const std::vector<Cluster<T>>& clusters2,
+                 size_t max_mismatches)
+{
+    ClusterComparison<T> ret;
+    ret.n_clusters1 = clusters1.size();
+    ret.n_clusters2 = clusters2.size();
+
+    HitLabelMap<T> labels1, labels2;
+    std::vector<size_t> sizes1, sizes2;
+    label_hits(clusters1, labels1, sizes1);
+    label_hits(clusters2, labels2, sizes2);
+
+    // The contingency table: the number of hits in both cluster i of
+    // the first list and cluster j of the second, keyed by (i, j).
+    // Hits that are noise in the second list form clusters of one, so
+    // they don't contribute any pairs
+    std::unordered_map<uint64_t, size_t> overlaps;
+    size_t n_common = 0;
+    for (auto const& kv : labels1) {
+        auto it = labels2.find(kv.first);
+        if (it == labels2.end())
+            continue;
+        ++n_common;
+        ++overlaps[(uint64_t(kv.second) << 32) | it->second];
+    }
+    ret.n_hits = labels1.size() + labels2.size() - n_common;
+
+    // Adjusted Rand index, from the pair counts
+    double sum_ij = 0, sum_i = 0, sum_j = 0;
+    for (auto const& kv : overlaps) {
+        sum_ij += pairs(kv.second);
+    }
+    for (auto s : sizes1) {
+        sum_i += pairs(s);
+    }
+    for (auto s : sizes2) {
+        sum_j += pairs(s);
+    }
+    double expected = ret.n_hits > 1 ? sum_i * sum_j / pairs(ret.n_hits) : 0;
+    double max_index = (sum_i + sum_j) / 2;
+    if (max_index != expected) {
+        ret.adjusted_rand_index = (sum_ij - expected) / (max_index - expected);
+    }
+
+    // The best-overlapping partner of each cluster in the first list
+    std::vector<long> best(clusters1.size(), -1);
+    std::vector<size_t> best_overlap(clusters1.size(), 0);
+    for (auto const& kv : overlaps) {
+        uint32_t i = kv.first >> 32;
+        uint32_t j = kv.first & 0xffffffff;
+        if (kv.second > best_overlap[i]) {
+            best_overlap[i] = kv.second;
+            best[i] = j;
+        }
+    }
+
+    size_t n_matched = 0;
+    ret.jaccard.resize(clusters1.size());
+    double sum_jaccard = 0;
+    for (size_t i = 0; i < clusters1.size(); ++i) {
+        size_t size2 = best[i] >= 0 ? sizes2[best[i]] : 0;
+        size_t overlap = best_overlap[i];
+        size_t n_union = sizes1[i] + size2 - overlap;
+        double jaccard = n_union ? double(overlap) / n_union : 1;
+        ret.jaccard[i] = jaccard;
+        sum_jaccard += jaccard;
+        ret.min_jaccard = std::min(ret.min_jaccard, jaccard);
+
+        if (overlap == sizes1[i] && overlap == size2) {
+            ++n_matched;
+            continue;
+        }
+
+        ++ret.n_unmatched1;
+        if (ret.mismatches.size() < max_mismatches) {
+            ClusterMismatch<T> m{ i, best[i], sizes1[i], size2, overlap,
+                                  jaccard, 0, -1 };
+            if (clusters1[i].hits.size()) {
+                const Hit<T>* first = *clusters1[i].hits.begin();
+                m.first_time = first->time;
+                m.first_chan = first->chan;
+            }
+            ret.mismatches.push_back(m);
+        }
+    }
+    if (!clusters1.empty()) {
+        ret.mean_jaccard = sum_jaccard / clusters1.size();
+    }
+    // Identical clusters are disjoint, so each one in the second list
+    // can only be matched once
+    ret.n_unmatched2 = clusters2.size() - n_matched;
+    ret.identical = ret.n_unmatched1 == 0 && ret.n_unmatched2 == 0;
+
+    return ret;
+}
+
+//======================================================================
+template<class T>
+void
+print_comparison(std::ostream& os, const ClusterComparison<T>& c)
+{
+    os << (c.identical ? "Clusterings identical" : "Clusterings differ")
+       << ": " << c.n_clusters1 << " vs " << c.n_clusters2 << " clusters, "
+       << c.n_hits << " clustered hits. ARI=" << c.adjusted_rand_index
+       << ", Jaccard mean=" << c.mean_jaccard << " min=" << c.min_jaccard
+       << std::endl;
+    if (c.identical)
+        return;
+
+    os << c.n_unmatched1 << " clusters in the first list and "
+       << c.n_unmatched2 << " in the second have no identical partner"
+       << std::endl;
+    for (auto const& m : c.mismatches) {
+        os << "  cluster " << m.index1 << " (first hit " << m.first_time
+           << ", " << m.first_chan << "): " << m.size1 << " hits; ";
+        if (m.index2 < 0) {
+            os << "no overlapping cluster" << std::endl;
+        } else {
+            os << "best match " << m.index2 << " has " << m.size2
+               << " hits, " << m.overlap << " shared, Jaccard=" << m.jaccard
+               << std::endl;
+        }
+    }
+}
+
+template ClusterComparison<float>
+compare_clusters(const std::vector<Cluster<float>>&,
+                 const std::vector<Cluster<float>>&,
+                 size_t);
+template ClusterComparison<tick_t>
+compare_clusters(const std::vector<Cluster<tick_t>>&,
+                 const std::vector<Cluster<tick_t>>&,
+                 size_t);
+template void
+print_comparison(std::ostream&, const ClusterComparison<float>&);
+template void
+print_comparison(std::ostream&, const ClusterComparison<tick_t>&);
+
+}
+
+// Local Variables:
+// mode: c++
+// c-basic-offset: 4
+// c-file-style: "linux"
+// End:
@@ -0,0 +1,78 @@
+#pragma once
+
+#include "dbscan.hpp"
+
+#include <iosfwd>
+#include <vector>
+
+namespace dbscan {
+
+//======================================================================
+//
+// A cluster in the first list that has no identical partner in the
+// second list
+template<class T>
+struct ClusterMismatch
+{
+    // Position of the cluster in the first list
+    size_t index1;
+    // Position in the second list of the cluster with the largest
+    // overlap, or -1 if none of its hits are in any cluster there
+    long index2;
+    // Number of hits in each cluster, and in both
+    size_t size1, size2, overlap;
+    double jaccard;
+    // The earliest hit in the first cluster, to help find it
+    T first_time;
+    int first_chan;
+};
+
+//======================================================================
+//
+// The result of comparing two clusterings of the same hits. Hits are
+// identified by their (time, channel), and hits that aren't in any
+// cluster are noise. For the adjusted Rand index, each noise hit
+// counts as a cluster of its own
+template<class T>
+struct ClusterComparison
+{
+    // True if the two lists partition the hits identically (up to the
+    // order and numbering of the clusters)
+    bool identical{ true };
+    size_t n_clusters1{ 0 }, n_clusters2{ 0 };
+    // Number of distinct hits in clusters in either list
+    size_t n_hits{ 0 };
+    double adjusted_rand_index{ 1 };
+    // Jaccard index of each cluster in the first list with its
+    // best-overlapping cluster in the second
+    std::vector<double> jaccard;
+    double mean_jaccard{ 1 }, min_jaccard{ 1 };
+    // Number of clusters in each list with no identical partner
+    size_t n_unmatched1{ 0 }, n_unmatched2{ 0 };
+    // The first few clusters from the first list without identical
+    // partners
+    std::vector<ClusterMismatch<T>> mismatches;
+};
+
+//======================================================================
+//
+// Compare `clusters1` and `clusters2`, in time linear in the number
+// of hits. At most `max_mismatches` mismatched clusters are recorded
+template<class T>
+ClusterComparison<T>
+compare_clusters(const std::vector<Cluster<T>>& clusters1,
+                 const std::vector<Cluster<T>>& clusters2,
+                 size_t max_mismatches = 10);
+
+// Print a short summary of `comparison`
+template<class T>
+void
+print_comparison(std::ostream& os, const ClusterComparison<T>& comparison);
+
+}
+
+// Local Variables:
+// mode: c++
+// c-basic-offset: 4
+// c-file-style: "linux"
+// End:
@@ -0,0 +1,414 @@
+#include "cluster_store.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <ostream>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace dbscan {
+
+namespace {
+
+const char kStoreMagic[8] = { 'I', 'D', 'B', 'S', 'T', 'O', 'R', 'E' };
+const uint32_t kStoreVersion = 1;
+const size_t kHeaderSize = sizeof(kStoreMagic) + 2 * sizeof(uint32_t);
+
+// The end of the file: where the footer's block records start, how
+// many there are, the total number of clusters, and the magic again
+struct Trailer
+{
+    uint64_t footer_offset;
+    uint64_t n_blocks;
+    uint64_t n_clusters;
+    char magic[8];
+};
+
+//======================================================================
+//
+// Where each column starts in a block of `n` clusters with `h` hits in
+// total, relative to the start of the block
+struct BlockLayout
+{
+    BlockLayout(size_t n, size_t h)
+    {
+        index = column(n * sizeof(int32_t));
+        earliest_time = column(n * sizeof(int64_t));
+        latest_time = column(n * sizeof(int64_t));
+        min_chan = column(n * sizeof(int32_t));
+        max_chan = column(n * sizeof(int32_t));
+        total_charge = column(n * sizeof(double));
+        hit_offset = column((n + 1) * sizeof(uint32_t));
+        hit_time = column(h * sizeof(int64_t));
+        hit_chan = column(h * sizeof(int32_t));
+        hit_charge = column(h * sizeof(float));
+    }
+
+    size_t index, earliest_time, latest_time, min_chan, max_chan,
+        total_charge, hit_offset, hit_time, hit_chan, hit_charge;
+    size_t size{ 0 };
+
+private:
+    // Start a column of `bytes` bytes, padded to 8-byte alignment
+    size_t column(size_t bytes)
+    {
+        size_t start = size;
+        size += (bytes + 7) & ~size_t(7);
+        return start;
+    }
+};
+
+//======================================================================
+//
+// Write zeros from offset `pos` of the block up to `start`
+void
+pad_to(std::ostream& os, size_t& pos, size_t start)
+{
+    static const char zeros[8] = {};
+    os.write(zeros, start - pos);
+    pos = start;
+}
+
+// Write the vector `v` as a column starting at offset `start` of the
+// block
+template<class V>
+void
+write_column(std::ostream& os, size_t& pos, size_t start, const V& v)
+{
+    pad_to(os, pos, start);
+    os.write(reinterpret_cast<const char*>(v.data()),
+             v.size() * sizeof(typename V::value_type));
+    pos += v.size() * sizeof(typename V::value_type);
+}
+
+template<class V>
+const V*
+column(const uint8_t* block, size_t offset)
+{
+    return reinterpret_cast<const V*>(block + offset);
+}
+
+}
+
+//======================================================================
+ClusterStoreWriter::ClusterStoreWriter(std::ostream& os, size_t block_clusters)
+    : m_os(os)
+    , m_block_clusters(std::max<size_t>(block_clusters, 1))
+{
+    m_os.write(kStoreMagic, sizeof(kStoreMagic));
+    m_os.write(reinterpret_cast<const char*>(&kStoreVersion),
+               sizeof(kStoreVersion));
+    uint32_t reserved = 0;
+    m_os.write(reinterpret_cast<const char*>(&reserved), sizeof(reserved));
+    m_offset = kHeaderSize;
+    m_hit_offset.push_back(0);
+}
+
+//======================================================================
+ClusterStoreWriter::~ClusterStoreWriter()
+{
+    close();
+}
+
+//======================================================================
+void
+ClusterStoreWriter::write(const Cluster<tick_t>& cluster)
+{
+    m_points.clear();
+    for (auto h : cluster.hits) {
+        m_points.push_back(Point{ h->chan, h->time, h->charge });
+    }
+    // Completed clusters are already sorted, but others might not be
+    if (!cluster.hits.is_sorted()) {
+        std::stable_sort(
+            m_points.begin(),
+            m_points.end(),
+            [](const Point& a, const Point& b) { return a.time < b.time; });
+    }
+    append(cluster.index, m_points.data(), m_points.size());
+}
+
+//======================================================================
+void
+ClusterStoreWriter::write(const StoredCluster& cluster)
+{
+    append(cluster.index, cluster.hits.data(), cluster.hits.size());
+}
+
+//======================================================================
+void
+ClusterStoreWriter::append(int index, const Point* hits, size_t n)
+{
+    if (m_closed || n == 0)
+        return;
+
+    int min_chan = hits[0].chan;
+    int max_chan = hits[0].chan;
+    double total_charge = 0;
+    for (size_t i = 0; i < n; ++i) {
+        min_chan = std::min(min_chan, hits[i].chan);
+        max_chan = std::max(max_chan, hits[i].chan);
+        total_charge += hits[i].charge;
+        m_hit_time.push_back(hits[i].time);
+        m_hit_chan.push_back(hits[i].chan);
+        m_hit_charge.push_back(hits[i].charge);
+    }
+    m_index.push_back(index);
+    m_earliest_time.push_back(hits[0].time);
+    m_latest_time.push_back(hits[n - 1].time);
+    m_min_chan.push_back(min_chan);
+    m_max_chan.push_back(max_chan);
+    m_total_charge.push_back(total_charge);
+    m_hit_offset.push_back(uint32_t(m_hit_time.size()));
+    ++m_n_clusters;
+
+    if (m_index.size() == m_block_clusters)
+        write_block();
+}
+
+//======================================================================
+void
+ClusterStoreWriter::write_block()
+{
+    size_t n = m_index.size();
+    if (n == 0)
+        return;
+
+    ClusterStoreBlock block;
+    block.offset = m_offset;
+    block.n_clusters = uint32_t(n);
+    block.n_hits = uint32_t(m_hit_time.size());
+    block.min_time =
+        *std::min_element(m_earliest_time.begin(), m_earliest_time.end());
+    block.max_time =
+        *std::max_element(m_latest_time.begin(), m_latest_time.end());
+    block.min_chan = *std::min_element(m_min_chan.begin(), m_min_chan.end());
+    block.max_chan = *std::max_element(m_max_chan.begin(), m_max_chan.end());
+    block.min_hits = std::numeric_limits<uint32_t>::max();
+    block.max_hits = 0;
+    for (size_t i = 0; i < n; ++i) {
+        uint32_t n_hits = m_hit_offset[i + 1] - m_hit_offset[i];
+        block.min_hits = std::min(block.min_hits, n_hits);
+        block.max_hits = std::max(block.max_hits, n_hits);
+    }
+    m_blocks.push_back(block);
+
+    BlockLayout layout(n, m_hit_time.size());
+    size_t pos = 0;
+    write_column(m_os, pos, layout.index, m_index);
+    write_column(m_os, pos, layout.earliest_time, m_earliest_time);
+    write_column(m_os, pos, layout.latest_time, m_latest_time);
+    write_column(m_os, pos, layout.min_chan, m_min_chan);
+    write_column(m_os, pos, layout.max_chan, m_max_chan);
+    write_column(m_os, pos, layout.total_charge, m_total_charge);
+    write_column(m_os, pos, layout.hit_offset, m_hit_offset);
+    write_column(m_os, pos, layout.hit_time, m_hit_time);
+    write_column(m_os, pos, layout.hit_chan, m_hit_chan);
+    write_column(m_os, pos, layout.hit_charge, m_hit_charge);
+    pad_to(m_os, pos, layout.size);
+    m_offset += layout.size;
+
+    m_index.clear();
+    m_earliest_time.clear();
+    m_latest_time.clear();
+    m_min_chan.clear();
+    m_max_chan.clear();
+    m_total_charge.clear();
+    m_hit_offset.assign(1, 0);
+    m_hit_time.clear();
+    m_hit_chan.clear();
+    m_hit_charge.clear();
+}
+
+//======================================================================
+bool
+ClusterStoreWriter::close()
+{
+    if (m_closed)
+        return bool(m_os);
+    write_block();
+
+    Trailer trailer;
+    trailer.footer_offset = m_offset;
+    trailer.n_blocks = m_blocks.size();
+    trailer.n_clusters = m_n_clusters;
+    std::memcpy(trailer.magic, kStoreMagic, sizeof(kStoreMagic));
+    m_os.write(reinterpret_cast<const char*>(m_blocks.data()),
+               m_blocks.size() * sizeof(ClusterStoreBlock));
+    m_os.write(reinterpret_cast<const char*>(&trailer), sizeof(trailer));
+    m_offset += m_blocks.size() * sizeof(ClusterStoreBlock) + sizeof(trailer);
+    m_closed = true;
+    m_os.flush();
+    return bool(m_os);
+}
+
+//======================================================================
+ClusterStore::~ClusterStore()
+{
+    close();
+}
+
+//======================================================================
+bool
+ClusterStore::open(const std::string& filename)
+{
+    close();
+    int fd = ::open(filename.c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+    struct stat st;
+    if (fstat(fd, &st) != 0 ||
+        size_t(st.st_size) < kHeaderSize + sizeof(Trailer)) {
+        ::close(fd);
+        return false;
+    }
+    void* data = mmap(nullptr, size_t(st.st_size), PROT_READ, MAP_SHARED, fd, 0);
+    // The mapping stays valid after the file is closed
+    ::close(fd);
+    if (data == MAP_FAILED)
+        return false;
+    m_data = static_cast<const uint8_t*>(data);
+    m_size = size_t(st.st_size);
+
+    Trailer trailer;
+    std::memcpy(&trailer, m_data + m_size - sizeof(Trailer), sizeof(Trailer));
+    uint32_t version;
+    std::memcpy(&version, m_data + sizeof(kStoreMagic), sizeof(version));
+    if (std::memcmp(m_data, kStoreMagic, sizeof(kStoreMagic)) != 0 ||
+        std::memcmp(trailer.magic, kStoreMagic, sizeof(kStoreMagic)) != 0 ||
+        version != kStoreVersion || trailer.footer_offset % 8 != 0 ||
+        trailer.n_blocks > m_size / sizeof(ClusterStoreBlock) ||
+        trailer.footer_offset +
+                trailer.n_blocks * sizeof(ClusterStoreBlock) !=
+            m_size - sizeof(Trailer)) {
+        close();
+        return false;
+    }
+    m_blocks =
+        reinterpret_cast<const ClusterStoreBlock*>(m_data + trailer.footer_offset);
+    m_n_blocks = trailer.n_blocks;
+    m_n_clusters = trailer.n_clusters;
+    if (!validate()) {
+        close();
+        return false;
+    }
+    return true;
+}
+
+//======================================================================
+bool
+ClusterStore::validate() const
+{
+    uint64_t n_clusters = 0;
+    uint64_t footer_offset = reinterpret_cast<const uint8_t*>(m_blocks) - m_data;
+    for (size_t b = 0; b < m_n_blocks; ++b) {
+        const ClusterStoreBlock& block = m_blocks[b];
+        if (block.offset % 8 != 0 || block.offset < kHeaderSize ||
+            block.offset > footer_offset)
+            return false;
+        BlockLayout layout(block.n_clusters, block.n_hits);
+        if (layout.size > footer_offset - block.offset)
+            return false;
+        // The hit offsets must stay inside the hit columns
+        const uint32_t* offsets =
+            column<uint32_t>(m_data + block.offset, layout.hit_offset);
+        if (offsets[0] != 0 || offsets[block.n_clusters] != block.n_hits ||
+            !std::is_sorted(offsets, offsets + block.n_clusters + 1))
+            return false;
+        n_clusters += block.n_clusters;
+    }
+    return n_clusters == m_n_clusters;
+}
+
+//======================================================================
+void
+ClusterStore::close()
+{
+    if (m_data)
+        munmap(const_cast<uint8_t*>(m_data), m_size);
+    m_data = nullptr;
+    m_size = 0;
+    m_blocks = nullptr;
+    m_n_blocks = 0;
+    m_n_clusters = 0;
+}
+
+//======================================================================
+void
+ClusterStore::query(const ClusterQuery& query,
+                    std::vector<ClusterView>& out,
+                    QueryStats* stats) const
+{
+    QueryStats local;
+    // A cluster needs a hit in the channel range to match at all
+    const size_t min_hits = std::max<size_t>(query.min_hits, 1);
+    for (size_t b = 0; b < m_n_blocks; ++b) {
+        const ClusterStoreBlock& block = m_blocks[b];
+        // The zone map check: skip the block without touching it if
+        // none of its clusters can match
+        if (block.max_time < query.t0 || block.min_time > query.t1 ||
+            block.max_chan < query.chan_lo || block.min_chan > query.chan_hi ||
+            block.max_hits < query.min_hits) {
+            ++local.blocks_skipped;
+            continue;
+        }
+        ++local.blocks_scanned;
+        local.clusters_scanned += block.n_clusters;
+
+        const uint8_t* data = m_data + block.offset;
+        BlockLayout layout(block.n_clusters, block.n_hits);
+        auto earliest = column<int64_t>(data, layout.earliest_time);
+        auto latest = column<int64_t>(data, layout.latest_time);
+        auto min_chan = column<int32_t>(data, layout.min_chan);
+        auto max_chan = column<int32_t>(data, layout.max_chan);
+        auto offsets = column<uint32_t>(data, layout.hit_offset);
+        auto hit_chan = column<int32_t>(data, layout.hit_chan);
+        for (size_t i = 0; i < block.n_clusters; ++i) {
+            size_t n_hits = offsets[i + 1] - offsets[i];
+            if (latest[i] < query.t0 || earliest[i] > query.t1 ||
+                max_chan[i] < query.chan_lo || min_chan[i] > query.chan_hi ||
+                n_hits < query.min_hits)
+                continue;
+            // If the cluster sticks out of the channel range, only the
+            // hits inside it count. Stop as soon as there are enough
+            if (min_chan[i] < query.chan_lo || max_chan[i] > query.chan_hi) {
+                size_t n_in_range = 0;
+                uint32_t h = offsets[i];
+                for (; h < offsets[i + 1] && n_in_range < min_hits; ++h) {
+                    if (hit_chan[h] >= query.chan_lo &&
+                        hit_chan[h] <= query.chan_hi)
+                        ++n_in_range;
+                }
+                local.hits_scanned += h - offsets[i];
+                if (n_in_range < min_hits)
+                    continue;
+            }
+            ClusterView view;
+            view.index = column<int32_t>(data, layout.index)[i];
+            view.n_hits = n_hits;
+            view.earliest_time = earliest[i];
+            view.latest_time = latest[i];
+            view.min_chan = min_chan[i];
+            view.max_chan = max_chan[i];
+            view.total_charge = column<double>(data, layout.total_charge)[i];
+            view.hit_time = column<int64_t>(data, layout.hit_time) + offsets[i];
+            view.hit_chan = hit_chan + offsets[i];
+            view.hit_charge =
+                column<float>(data, layout.hit_charge) + offsets[i];
+            out.push_back(view);
+        }
+    }
+    if (stats)
+        *stats = local;
+}
+
+}
+
+// Local Variables:
+// mode: c++
+// c-basic-offset: 4
+// c-file-style: "linux"
+// End:
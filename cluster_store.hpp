@@ -0,0 +1,205 @@
+#pragma once
+
+#include "Point.hpp"
+#include "cluster_stream.hpp"
+#include "dbscan.hpp"
+
+#include <cstdint>
+#include <iosfwd>
+#include <limits>
+#include <string>
+#include <vector>
+
+namespace dbscan {
+//======================================================================
+//
+// A columnar file of completed clusters, for repeated offline queries
+// like "the clusters between t0 and t1 with at least N hits on
+// channels X to Y" without re-running the clustering
+//
+// The clusters are grouped into blocks, in the order they're written,
+// which for IncrementalDBSCAN's output is roughly time order. Each
+// block is a set of columns, each an array with one entry per
+// cluster: the index, the earliest and latest times, the lowest and
+// highest channels and the total charge. After those come each
+// cluster's offset into the hit columns, which also gives its number
+// of hits, and the hit columns themselves: time, channel and charge,
+// with each cluster's hits in time order. The columns are 8-byte
+// aligned, so they can be used in place from a memory-mapped file
+//
+// A footer at the end of the file has a zone map for each block: the
+// ranges of time, channel and number of hits of its clusters. A query
+// skips any block whose ranges can't match, and reads the summary
+// columns of the rest. It only reads a cluster's hit channels when it
+// has to count the hits in the query's channel range, so a narrow
+// query touches a small part of the file. The file is in host byte
+// order, and only integer tick times are supported
+
+//======================================================================
+//
+// The zone map of a block of the store, as kept in the footer: where
+// it is and the ranges of its clusters
+struct ClusterStoreBlock
+{
+    uint64_t offset;
+    uint32_t n_clusters;
+    uint32_t n_hits;
+    // The earliest and latest hit times of any cluster in the block
+    int64_t min_time;
+    int64_t max_time;
+    int32_t min_chan;
+    int32_t max_chan;
+    // The smallest and largest numbers of hits in a cluster
+    uint32_t min_hits;
+    uint32_t max_hits;
+};
+
+//======================================================================
+class ClusterStoreWriter
+{
+public:
+    // Write to `os`, which should be opened in binary mode, starting a
+    // new block every `block_clusters` clusters
+    explicit ClusterStoreWriter(std::ostream& os,
+                                size_t block_clusters = 4096);
+
+    // Writes out the last block and the footer. Call close() instead
+    // to find out whether that worked
+    ~ClusterStoreWriter();
+
+    ClusterStoreWriter(const ClusterStoreWriter&) = delete;
+    ClusterStoreWriter& operator=(const ClusterStoreWriter&) = delete;
+
+    void write(const Cluster<tick_t>& cluster);
+    // A cluster read back from a cluster stream, to convert a stream
+    // to a store
+    void write(const StoredCluster& cluster);
+
+    // Write out the last block and the footer. Nothing more can be
+    // written after this. Returns false if writing failed
+    bool close();
+
+    uint64_t n_clusters() const { return m_n_clusters; }
+    uint64_t bytes() const { return m_offset; }
+
+private:
+    // Add a cluster with the `n` time-ordered hits at `hits`
+    void append(int index, const Point* hits, size_t n);
+    void write_block();
+
+    std::ostream& m_os;
+    size_t m_block_clusters;
+    bool m_closed{ false };
+    uint64_t m_offset{ 0 };
+    uint64_t m_n_clusters{ 0 };
+    std::vector<ClusterStoreBlock> m_blocks;
+
+    // The columns of the current block
+    std::vector<int32_t> m_index;
+    std::vector<int64_t> m_earliest_time;
+    std::vector<int64_t> m_latest_time;
+    std::vector<int32_t> m_min_chan;
+    std::vector<int32_t> m_max_chan;
+    std::vector<double> m_total_charge;
+    // Where each cluster's hits start in the hit columns, plus the
+    // end of the last one
+    std::vector<uint32_t> m_hit_offset;
+    std::vector<int64_t> m_hit_time;
+    std::vector<int32_t> m_hit_chan;
+    std::vector<float> m_hit_charge;
+
+    std::vector<Point> m_points;
+};
+
+//======================================================================
+//
+// The clusters to find: those whose time range overlaps [t0, t1], and
+// that have at least `min_hits` hits on channels chan_lo to chan_hi
+// (at least one, if `min_hits` is 0)
+struct ClusterQuery
+{
+    int64_t t0{ std::numeric_limits<int64_t>::lowest() };
+    int64_t t1{ std::numeric_limits<int64_t>::max() };
+    int chan_lo{ std::numeric_limits<int>::lowest() };
+    int chan_hi{ std::numeric_limits<int>::max() };
+    size_t min_hits{ 0 };
+};
+
+//======================================================================
+//
+// A cluster in a ClusterStore. The pointers are into the mapped file,
+// so they're only valid while the store is open
+struct ClusterView
+{
+    int index;
+    size_t n_hits;
+    int64_t earliest_time;
+    int64_t latest_time;
+    int min_chan;
+    int max_chan;
+    double total_charge;
+    // The hits, in time order
+    const int64_t* hit_time;
+    const int32_t* hit_chan;
+    const float* hit_charge;
+};
+
+//======================================================================
+//
+// How much of the store a query looked at
+struct QueryStats
+{
+    size_t blocks_scanned{ 0 };
+    size_t blocks_skipped{ 0 };
+    size_t clusters_scanned{ 0 };
+    // The hit channels read to count the hits in the channel range,
+    // for clusters that straddle its ends
+    size_t hits_scanned{ 0 };
+};
+
+//======================================================================
+//
+// A cluster store file, memory-mapped for querying
+class ClusterStore
+{
+public:
+    ClusterStore() = default;
+    ~ClusterStore();
+
+    ClusterStore(const ClusterStore&) = delete;
+    ClusterStore& operator=(const ClusterStore&) = delete;
+
+    // Map the file `filename`. Returns false if it can't be opened or
+    // isn't a valid store
+    bool open(const std::string& filename);
+    void close();
+
+    size_t n_blocks() const { return m_n_blocks; }
+    uint64_t n_clusters() const { return m_n_clusters; }
+    const ClusterStoreBlock& block(size_t i) const { return m_blocks[i]; }
+
+    // Append the clusters that match `query` to `out`, in the order
+    // they were written. If `stats` isn't null, fill it in
+    void query(const ClusterQuery& query,
+               std::vector<ClusterView>& out,
+               QueryStats* stats = nullptr) const;
+
+private:
+    // Check that the block index is consistent with the file size
+    bool validate() const;
+
+    const uint8_t* m_data{ nullptr };
+    size_t m_size{ 0 };
+    // The zone maps, in the footer
+    const ClusterStoreBlock* m_blocks{ nullptr };
+    size_t m_n_blocks{ 0 };
+    uint64_t m_n_clusters{ 0 };
+};
+
+}
+
+// Local Variables:
+// mode: c++
+// c-basic-offset: 4
+// c-file-style: "linux"
+// End:
@@ -0,0 +1,365 @@
+#include "cluster_stream.hpp"
+#include "lz_compress.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <istream>
+#include <ostream>
+
+namespace dbscan {
+
+namespace {
+
+const char kStreamMagic[8] = { 'I', 'D', 'B', 'C', 'L', 'U', 'S', '\0' };
+const uint32_t kStreamVersion = 1;
+// "BLK1", at the start of each block header, to catch a stream that's
+// lost its place
+const uint32_t kBlockMagic = 0x314b4c42;
+// A limit on the block sizes that the reader will believe, so a
+// corrupt header can't make it allocate gigabytes
+const uint32_t kMaxBlockSize = 1u << 28;
+
+enum Compression : uint8_t
+{
+    kNone = 0,
+    kLZ = 1
+};
+
+// Cluster flags
+const uint64_t kHasCharge = 1;
+
+template<class V>
+void
+write_value(std::ostream& os, const V& v)
+{
+    os.write(reinterpret_cast<const char*>(&v), sizeof(V));
+}
+
+template<class V>
+bool
+read_value(std::istream& is, V& v)
+{
+    is.read(reinterpret_cast<char*>(&v), sizeof(V));
+    return bool(is);
+}
+
+//======================================================================
+//
+// LEB128 varints, and zigzag coding for the signed values, so that
+// small negative numbers are small too
+void
+put_varint(std::vector<uint8_t>& out, uint64_t v)
+{
+    while (v >= 0x80) {
+        out.push_back(uint8_t(v | 0x80));
+        v >>= 7;
+    }
+    out.push_back(uint8_t(v));
+}
+
+void
+put_signed(std::vector<uint8_t>& out, int64_t v)
+{
+    put_varint(out, (uint64_t(v) << 1) ^ uint64_t(v >> 63));
+}
+
+bool
+get_varint(const std::vector<uint8_t>& in, size_t& pos, uint64_t& v)
+{
+    v = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        if (pos == in.size())
+            return false;
+        uint8_t b = in[pos++];
+        v |= uint64_t(b & 0x7f) << shift;
+        if (!(b & 0x80))
+            return true;
+    }
+    return false;
+}
+
+bool
+get_signed(const std::vector<uint8_t>& in, size_t& pos, int64_t& v)
+{
+    uint64_t u;
+    if (!get_varint(in, pos, u))
+        return false;
+    v = int64_t(u >> 1) ^ -int64_t(u & 1);
+    return true;
+}
+
+//======================================================================
+//
+// FNV-1a, to catch corrupt blocks
+uint32_t
+checksum(const uint8_t* p, size_t n)
+{
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < n; ++i) {
+        h = (h ^ p[i]) * 16777619u;
+    }
+    return h;
+}
+
+}
+
+//======================================================================
+ClusterStreamWriter::ClusterStreamWriter(std::ostream& os,
+                                         bool compress,
+                                         size_t block_size)
+    : m_os(os)
+    , m_compress(compress)
+    , m_block_size(block_size)
+{
+    m_os.write(kStreamMagic, sizeof(kStreamMagic));
+    write_value(m_os, kStreamVersion);
+    m_raw_bytes = m_stored_bytes = sizeof(kStreamMagic) + sizeof(uint32_t);
+    m_block.reserve(m_block_size + m_block_size / 4);
+}
+
+//======================================================================
+ClusterStreamWriter::~ClusterStreamWriter()
+{
+    flush();
+}
+
+//======================================================================
+void
+ClusterStreamWriter::write(const Cluster<tick_t>& cluster)
+{
+    if (cluster.hits.size() == 0)
+        return;
+
+    // Completed clusters are already sorted, but others might not be
+    m_sorted.assign(cluster.hits.begin(), cluster.hits.end());
+    if (!cluster.hits.is_sorted()) {
+        std::sort(m_sorted.begin(),
+                  m_sorted.end(),
+                  [](const Hit<tick_t>* a, const Hit<tick_t>* b) {
+                      return a->time < b->time ||
+                             (a->time == b->time && a < b);
+                  });
+        m_sorted.erase(std::unique(m_sorted.begin(), m_sorted.end()),
+                       m_sorted.end());
+    }
+
+    uint64_t flags = 0;
+    for (auto h : m_sorted) {
+        if (h->charge != 1) {
+            flags |= kHasCharge;
+            break;
+        }
+    }
+
+    tick_t first_time = m_sorted.front()->time;
+    tick_t last_time = m_sorted.back()->time;
+    if (m_block_clusters == 0) {
+        m_prev_index = 0;
+        m_prev_time = 0;
+        m_block_min_time = first_time;
+        m_block_max_time = last_time;
+    } else {
+        m_block_min_time = std::min(m_block_min_time, first_time);
+        m_block_max_time = std::max(m_block_max_time, last_time);
+    }
+
+    put_varint(m_block, flags);
+    put_signed(m_block, int64_t(cluster.index) - m_prev_index);
+    put_varint(m_block, m_sorted.size());
+    put_signed(m_block, first_time - m_prev_time);
+    put_signed(m_block, m_sorted.front()->chan);
+    for (size_t i = 1; i < m_sorted.size(); ++i) {
+        put_varint(m_block, uint64_t(m_sorted[i]->time - m_sorted[i - 1]->time));
+        put_signed(m_block, int64_t(m_sorted[i]->chan) - m_sorted[i - 1]->chan);
+    }
+    if (flags & kHasCharge) {
+        size_t pos = m_block.size();
+        m_block.resize(pos + m_sorted.size() * sizeof(float));
+        for (auto h : m_sorted) {
+            std::memcpy(&m_block[pos], &h->charge, sizeof(float));
+            pos += sizeof(float);
+        }
+    }
+
+    m_prev_index = cluster.index;
+    m_prev_time = first_time;
+    ++m_block_clusters;
+    ++m_n_clusters;
+    m_n_hits += m_sorted.size();
+
+    if (m_block.size() >= m_block_size)
+        flush();
+}
+
+//======================================================================
+bool
+ClusterStreamWriter::flush()
+{
+    if (m_block_clusters != 0) {
+        const uint8_t* stored = m_block.data();
+        uint32_t stored_size = uint32_t(m_block.size());
+        uint8_t compression = kNone;
+        if (m_compress) {
+            m_compressed.clear();
+            lz_compress(m_block.data(), m_block.size(), m_compressed);
+            // Keep the block raw if compressing didn't help
+            if (m_compressed.size() < m_block.size()) {
+                stored = m_compressed.data();
+                stored_size = uint32_t(m_compressed.size());
+                compression = kLZ;
+            }
+        }
+
+        write_value(m_os, kBlockMagic);
+        write_value(m_os, m_block_clusters);
+        write_value(m_os, uint32_t(m_block.size()));
+        write_value(m_os, stored_size);
+        write_value(m_os, compression);
+        write_value(m_os, m_block_min_time);
+        write_value(m_os, m_block_max_time);
+        write_value(m_os, checksum(m_block.data(), m_block.size()));
+        m_os.write(reinterpret_cast<const char*>(stored), stored_size);
+
+        const size_t header_size = 4 * sizeof(uint32_t) + sizeof(uint8_t) +
+                                   2 * sizeof(tick_t) + sizeof(uint32_t);
+        m_raw_bytes += header_size + m_block.size();
+        m_stored_bytes += header_size + stored_size;
+        m_block.clear();
+        m_block_clusters = 0;
+    }
+    m_os.flush();
+    return bool(m_os);
+}
+
+//======================================================================
+ClusterStreamReader::ClusterStreamReader(std::istream& is)
+    : m_is(is)
+{
+    char magic[sizeof(kStreamMagic)];
+    uint32_t version;
+    m_is.read(magic, sizeof(magic));
+    if (!m_is || std::memcmp(magic, kStreamMagic, sizeof(magic)) != 0 ||
+        !read_value(m_is, version) || version != kStreamVersion) {
+        m_error = true;
+    }
+}
+
+//======================================================================
+bool
+ClusterStreamReader::read_block()
+{
+    uint32_t magic;
+    if (!read_value(m_is, magic)) {
+        // A clean end of the stream is only at a block boundary
+        if (m_is.gcount() != 0)
+            m_error = true;
+        return false;
+    }
+    uint32_t n_clusters, raw_size, stored_size, sum;
+    uint8_t compression;
+    tick_t min_time, max_time;
+    if (magic != kBlockMagic || !read_value(m_is, n_clusters) ||
+        !read_value(m_is, raw_size) || !read_value(m_is, stored_size) ||
+        !read_value(m_is, compression) || !read_value(m_is, min_time) ||
+        !read_value(m_is, max_time) || !read_value(m_is, sum) ||
+        n_clusters == 0 || raw_size > kMaxBlockSize ||
+        stored_size > kMaxBlockSize) {
+        m_error = true;
+        return false;
+    }
+
+    m_raw.resize(raw_size);
+    if (compression == kNone) {
+        m_is.read(reinterpret_cast<char*>(m_raw.data()), raw_size);
+        if (!m_is || stored_size != raw_size) {
+            m_error = true;
+            return false;
+        }
+    } else if (compression == kLZ) {
+        m_stored.resize(stored_size);
+        m_is.read(reinterpret_cast<char*>(m_stored.data()), stored_size);
+        if (!m_is ||
+            !lz_decompress(
+              m_stored.data(), stored_size, m_raw.data(), raw_size)) {
+            m_error = true;
+            return false;
+        }
+    } else {
+        m_error = true;
+        return false;
+    }
+    if (checksum(m_raw.data(), m_raw.size()) != sum) {
+        m_error = true;
+        return false;
+    }
+
+    m_pos = 0;
+    m_block_clusters_left = n_clusters;
+    m_prev_index = 0;
+    m_prev_time = 0;
+    return true;
+}
+
+//======================================================================
+bool
+ClusterStreamReader::read(StoredCluster& cluster)
+{
+    if (m_error)
+        return false;
+    if (m_block_clusters_left == 0 && !read_block())
+        return false;
+
+    uint64_t flags, n_hits;
+    int64_t index_delta, time, chan;
+    if (!get_varint(m_raw, m_pos, flags) ||
+        !get_signed(m_raw, m_pos, index_delta) ||
+        !get_varint(m_raw, m_pos, n_hits) ||
+        !get_signed(m_raw, m_pos, time) || !get_signed(m_raw, m_pos, chan) ||
+        n_hits == 0 || n_hits > m_raw.size() - m_pos + 1) {
+        m_error = true;
+        return false;
+    }
+    time += m_prev_time;
+    cluster.index = int(m_prev_index + index_delta);
+    cluster.hits.resize(n_hits);
+    cluster.hits[0] = Point{ int(chan), time };
+    for (size_t i = 1; i < n_hits; ++i) {
+        uint64_t dt;
+        int64_t dc;
+        if (!get_varint(m_raw, m_pos, dt) || !get_signed(m_raw, m_pos, dc)) {
+            m_error = true;
+            return false;
+        }
+        time += int64_t(dt);
+        chan += dc;
+        cluster.hits[i] = Point{ int(chan), time };
+    }
+    if (flags & kHasCharge) {
+        if (m_raw.size() - m_pos < n_hits * sizeof(float)) {
+            m_error = true;
+            return false;
+        }
+        for (auto& p : cluster.hits) {
+            std::memcpy(&p.charge, &m_raw[m_pos], sizeof(float));
+            m_pos += sizeof(float);
+        }
+    }
+
+    m_prev_index = cluster.index;
+    m_prev_time = cluster.hits[0].time;
+    --m_block_clusters_left;
+    // Every byte of the block should have been used by its clusters
+    if (m_block_clusters_left == 0 && m_pos != m_raw.size()) {
+        m_error = true;
+        return false;
+    }
+    return true;
+}
+
+}
+
+// Local Variables:
+// mode: c++
+// c-basic-offset: 4
+// c-file-style: "linux"
+// End:
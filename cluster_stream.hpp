@@ -0,0 +1,133 @@
+#pragma once
+
+#include "Point.hpp"
+#include "dbscan.hpp"
+
+#include <cstdint>
+#include <iosfwd>
+#include <vector>
+
+namespace dbscan {
+//======================================================================
+//
+// A compact binary stream of completed clusters, for archiving them.
+// The stream is a header followed by independent blocks, each of which
+// holds a number of whole clusters. Within a cluster, the hits are in
+// time order, and stored as the first hit followed by the differences
+// in time (never negative) and channel (zigzag-coded) from one hit to
+// the next, all as LEB128 varints. Clusters are close together in
+// channel and time, so most hits take two or three bytes. The charges,
+// if any hit in a cluster has a charge other than 1, follow as raw
+// floats
+//
+// Each block has a header with its cluster count, its raw and stored
+// sizes, the range of hit times in it, and a checksum of the raw
+// bytes. If compression is on, and it helps, the block is stored
+// compressed with lz_compress(). Numbers in the headers are in host
+// byte order, as in IncrementalDBSCAN::save_state()
+//
+// Only integer tick times are supported, since the deltas have to be
+// exact
+
+//======================================================================
+//
+// A cluster read back from a stream
+struct StoredCluster
+{
+    int index{ -1 };
+    // In time order. Times are in ticks
+    std::vector<Point> hits;
+};
+
+//======================================================================
+class ClusterStreamWriter
+{
+public:
+    // Write to `os`, starting a new block once the current one's raw
+    // size reaches `block_size`
+    explicit ClusterStreamWriter(std::ostream& os,
+                                 bool compress = true,
+                                 size_t block_size = 64 * 1024);
+
+    // Writes out the last block. Call close() instead to find out
+    // whether that worked
+    ~ClusterStreamWriter();
+
+    ClusterStreamWriter(const ClusterStreamWriter&) = delete;
+    ClusterStreamWriter& operator=(const ClusterStreamWriter&) = delete;
+
+    void write(const Cluster<tick_t>& cluster);
+
+    // Write out the current block, even if it's not full. Returns
+    // false if writing failed
+    bool flush();
+
+    // The same, at the end of the stream
+    bool close() { return flush(); }
+
+    uint64_t n_clusters() const { return m_n_clusters; }
+    uint64_t n_hits() const { return m_n_hits; }
+    // The bytes written so far, before and after compression,
+    // including headers
+    uint64_t raw_bytes() const { return m_raw_bytes; }
+    uint64_t stored_bytes() const { return m_stored_bytes; }
+
+private:
+    std::ostream& m_os;
+    bool m_compress;
+    size_t m_block_size;
+    // The raw bytes of the current block, and what's needed for its
+    // header
+    std::vector<uint8_t> m_block;
+    uint32_t m_block_clusters{ 0 };
+    tick_t m_block_min_time{ 0 };
+    tick_t m_block_max_time{ 0 };
+    // The previous cluster in the block, which the next is coded
+    // relative to
+    int m_prev_index{ 0 };
+    tick_t m_prev_time{ 0 };
+    std::vector<uint8_t> m_compressed;
+    std::vector<const Hit<tick_t>*> m_sorted;
+    uint64_t m_n_clusters{ 0 };
+    uint64_t m_n_hits{ 0 };
+    uint64_t m_raw_bytes{ 0 };
+    uint64_t m_stored_bytes{ 0 };
+};
+
+//======================================================================
+class ClusterStreamReader
+{
+public:
+    // Read from `is`, starting with the stream header. If the header
+    // is wrong, error() is true and read() returns false
+    explicit ClusterStreamReader(std::istream& is);
+
+    // Read the next cluster into `cluster`. Returns false at the end
+    // of the stream, or if it's malformed, in which case error() is
+    // true
+    bool read(StoredCluster& cluster);
+
+    bool error() const { return m_error; }
+
+private:
+    // Read the next block into m_raw. Returns false at the end of the
+    // stream or on an error
+    bool read_block();
+
+    std::istream& m_is;
+    bool m_error{ false };
+    std::vector<uint8_t> m_raw;
+    std::vector<uint8_t> m_stored;
+    size_t m_pos{ 0 };
+    uint32_t m_block_clusters_left{ 0 };
+    int m_prev_index{ 0 };
+    tick_t m_prev_time{ 0 };
+};
+
+}
+
+// Local Variables:
+// mode: c++
+// c-basic-offset: 4
+// c-file-style: "linux"
+// End:
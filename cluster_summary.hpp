@@ -0,0 +1,134 @@
+#pragma once
+
+#include "Hit.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <limits>
+
+namespace dbscan {
+//======================================================================
+//
+// Fixed-size aggregates of a cluster, for consumers that don't need
+// the hits themselves. Time is in the units of the hits' time type
+// and the spatial coordinate is the channel number, so the moments
+// mix the two scales
+template<class T>
+struct ClusterSummary
+{
+    // The index of the cluster
+    int index{ -1 };
+    size_t n_hits{ 0 };
+    // The number of core points, as of when the summary was made
+    size_t n_core{ 0 };
+    T earliest_time{ 0 };
+    T latest_time{ 0 };
+    int min_chan{ 0 };
+    int max_chan{ 0 };
+    // The sum of the hits' charges
+    double total_charge{ 0 };
+    // The centroid
+    double mean_time{ 0 };
+    double mean_chan{ 0 };
+    // The covariance matrix of (time, channel)
+    double var_time{ 0 };
+    double var_chan{ 0 };
+    double cov_time_chan{ 0 };
+    // The principal axes of the covariance: (axis_time, axis_chan) is
+    // a unit vector along the major axis, and major_var and minor_var
+    // are the variances along the major and minor axes. Tracks have
+    // minor_var much less than major_var; showers don't
+    double axis_time{ 1 };
+    double axis_chan{ 0 };
+    double major_var{ 0 };
+    double minor_var{ 0 };
+};
+
+//======================================================================
+//
+// Running sums over the hits of a cluster, from which a ClusterSummary
+// can be made at any time. Times are taken relative to the first hit
+// added, so the sums keep their precision when the absolute times are
+// large
+template<class T>
+class ClusterMoments
+{
+public:
+    void add(const Hit<T>& h)
+    {
+        if (m_n == 0) {
+            m_time0 = h.time;
+            m_min_chan = m_max_chan = h.chan;
+        }
+        ++m_n;
+        double t = double(h.time - m_time0);
+        double c = h.chan;
+        m_sum_t += t;
+        m_sum_c += c;
+        m_sum_tt += t * t;
+        m_sum_cc += c * c;
+        m_sum_tc += t * c;
+        m_sum_charge += h.charge;
+        m_min_chan = std::min(m_min_chan, h.chan);
+        m_max_chan = std::max(m_max_chan, h.chan);
+    }
+
+    void clear() { *this = ClusterMoments(); }
+
+    size_t size() const { return m_n; }
+    int min_chan() const { return m_min_chan; }
+    int max_chan() const { return m_max_chan; }
+    double total_charge() const { return m_sum_charge; }
+
+    // Fill in the hit count, channel range, total charge, centroid,
+    // covariance and principal axes of `summary`
+    void fill(ClusterSummary<T>& summary) const
+    {
+        summary.n_hits = m_n;
+        summary.total_charge = m_sum_charge;
+        if (m_n == 0)
+            return;
+        summary.min_chan = m_min_chan;
+        summary.max_chan = m_max_chan;
+
+        double n = m_n;
+        double mean_t = m_sum_t / n;
+        double mean_c = m_sum_c / n;
+        summary.mean_time = double(m_time0) + mean_t;
+        summary.mean_chan = mean_c;
+        // Rounding can make these slightly negative for a single hit
+        double a = std::max(0.0, m_sum_tt / n - mean_t * mean_t);
+        double c = std::max(0.0, m_sum_cc / n - mean_c * mean_c);
+        double b = m_sum_tc / n - mean_t * mean_c;
+        summary.var_time = a;
+        summary.var_chan = c;
+        summary.cov_time_chan = b;
+
+        // Eigen-decomposition of the symmetric 2x2 matrix [[a, b], [b, c]]
+        double half_trace = (a + c) / 2;
+        double r = std::hypot((a - c) / 2, b);
+        summary.major_var = half_trace + r;
+        summary.minor_var = std::max(0.0, half_trace - r);
+        double angle = std::atan2(2 * b, a - c) / 2;
+        summary.axis_time = std::cos(angle);
+        summary.axis_chan = std::sin(angle);
+    }
+
+private:
+    size_t m_n{ 0 };
+    T m_time0{ 0 };
+    int m_min_chan{ 0 };
+    int m_max_chan{ 0 };
+    double m_sum_t{ 0 }, m_sum_c{ 0 };
+    double m_sum_tt{ 0 }, m_sum_cc{ 0 }, m_sum_tc{ 0 };
+    double m_sum_charge{ 0 };
+};
+
+}
+
+// Local Variables:
+// mode: c++
+// c-basic-offset: 4
+// c-file-style: "linux"
+// End:
@@ -0,0 +1,120 @@
+#pragma once
+
+#include <cassert>
+#include <cstddef>
+
+namespace dbscan {
+//======================================================================
+//
+// Core-point criteria for IncrementalDBSCAN. A criterion provides:
+//
+//   is_core(h)          True if hit h has enough neighbours to be a
+//                       core point
+//
+//   just_became_core(h, n)
+//                       True if h became a core point when it gained
+//                       its most recent neighbour, n
+//
+//   threshold()         The quantity a core point's neighbourhood
+//                       (including the hit itself) must reach: minPts,
+//                       or the minimum total charge
+//
+// As with the metric policies, the functions are inline, so the core
+// checks are specialised for each criterion at compile time
+
+//======================================================================
+//
+// The usual criterion, with minPts set at run time
+struct MinPts
+{
+    MinPts(unsigned int minPts_)
+        : minPts(minPts_)
+    {}
+
+    template<class H>
+    bool is_core(const H& h) const
+    {
+        return h.neighbours.size() + 1 >= minPts;
+    }
+
+    template<class H>
+    bool just_became_core(const H& h, const H&) const
+    {
+        return h.neighbours.size() + 1 == minPts;
+    }
+
+    double threshold() const { return minPts; }
+
+    size_t minPts;
+};
+
+//======================================================================
+//
+// The same, with minPts fixed at compile time as `N`
+template<unsigned int N>
+struct FixedMinPts
+{
+    FixedMinPts() {}
+
+    // For interchangeability with MinPts. `minPts_` must be N
+    FixedMinPts(unsigned int minPts_)
+    {
+        assert(minPts_ == N);
+        (void)minPts_;
+    }
+
+    template<class H>
+    bool is_core(const H& h) const
+    {
+        return h.neighbours.size() + 1 >= N;
+    }
+
+    template<class H>
+    bool just_became_core(const H& h, const H&) const
+    {
+        return h.neighbours.size() + 1 == N;
+    }
+
+    static constexpr double threshold() { return N; }
+};
+
+//======================================================================
+//
+// Weighted DBSCAN: a hit is a core point if the total charge of its
+// neighbourhood, including itself, is at least `min_charge`. With
+// every charge 1, this is the same as MinPts(min_charge). Charges
+// must be non-negative, so that adding a neighbour can't stop a hit
+// being core
+struct MinCharge
+{
+    MinCharge(double min_charge_)
+        : min_charge(min_charge_)
+    {}
+
+    template<class H>
+    bool is_core(const H& h) const
+    {
+        return double(h.charge) + h.neighbour_charge >= min_charge;
+    }
+
+    template<class H>
+    bool just_became_core(const H& h, const H& newest) const
+    {
+        // The neighbourhood's charge before `newest` was added
+        double before =
+            double(h.charge) + h.neighbour_charge - double(newest.charge);
+        return is_core(h) && before < min_charge;
+    }
+
+    double threshold() const { return min_charge; }
+
+    double min_charge;
+};
+
+}
+
+// Local Variables:
+// mode: c++
+// c-basic-offset: 4
+// c-file-style: "linux"
+// End:
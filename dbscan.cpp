@@ -1,48 +1,186 @@
 #include "dbscan.hpp"
+#include "dbscan_factory.hpp"
 #include "Hit.hpp"
+#include "perf_counters.hpp"
 
+#include <algorithm>
 #include <cassert>
+#include <cstdlib>
+#include <cstring>
+#include <istream>
 #include <limits>
+#include <ostream>
+#include <type_traits>
+#include <unordered_map>
 
 namespace dbscan {
 
+namespace {
+
+// Identifies save_state() snapshots, and their format version
+const char kStateMagic[8] = { 'I', 'D', 'B', 'S', 'C', 'A', 'N', 0 };
+const uint32_t kStateVersion = 4;
+
+//======================================================================
+template<class V>
+void
+write_value(std::ostream& os, const V& v)
+{
+    os.write(reinterpret_cast<const char*>(&v), sizeof(V));
+}
+
+template<class V>
+bool
+read_value(std::istream& is, V& v)
+{
+    is.read(reinterpret_cast<char*>(&v), sizeof(V));
+    return bool(is);
+}
+
 //======================================================================
+//
+// Find the neighbours of hit q among the time-sorted `hits`, looking
+// only at those within `window` of it in time
+template<class T, class Metric, class Core>
 int
-neighbours_sorted(const std::vector<Hit*>& hits, Hit& q, float eps, int minPts)
+neighbours_within(const RingBuffer<Hit<T>*>& hits,
+                  Hit<T>& q,
+                  T window,
+                  const Metric& metric,
+                  const Core& core)
 {
     int n = 0;
     // Loop over the hits starting from the latest hit, since we will
     // ~always be adding a hit at recent times
-    for (auto hit_it = hits.rbegin(); hit_it != hits.rend(); ++hit_it) {
-        if ((*hit_it)->time > q.time + eps)
+    for (size_t i = hits.size(); i-- > 0;) {
+        Hit<T>* hit = hits[i];
+        if (hit->time > q.time + window)
             continue;
-        if ((*hit_it)->time < q.time - eps)
+        if (hit->time < q.time - window)
             break;
 
-        if (q.add_potential_neighbour(*hit_it, eps, minPts))
+        if (q.add_potential_neighbour(hit, metric, core))
             ++n;
     }
     return n;
 }
 
+}
+
+//======================================================================
+template<class T, class Metric, class Core>
+int
+neighbours_sorted(const RingBuffer<Hit<T>*>& hits,
+                  Hit<T>& q,
+                  const Metric& metric,
+                  const Core& core)
+{
+    // Hits further away in time than the metric's window can't be
+    // neighbours, whatever their channel
+    return neighbours_within(hits, q, T(metric.time_window()), metric, core);
+}
+
+namespace {
+
+//======================================================================
+//
+// The channels within the metric's channel window of hit q that are in
+// the table of `rings`. Returns false if there are none. Done in long
+// long, so that the window can't overflow
+template<class T, class Metric>
+bool
+channel_range(const ChannelRings<T>& rings,
+              const Hit<T>& q,
+              const Metric& metric,
+              int& lo,
+              int& hi)
+{
+    if (rings.empty())
+        return false;
+    const long long reach = (long long)metric.chan_window();
+    lo = int(std::max((long long)rings.first_channel(),
+                      (long long)q.chan - reach));
+    hi = int(std::min((long long)rings.last_channel(),
+                      (long long)q.chan + reach));
+    return lo <= hi;
+}
+
+}
+
+//======================================================================
+template<class T, class Metric, class Core>
+int
+neighbours_by_channel(const ChannelRings<T>& rings,
+                      Hit<T>& q,
+                      const Metric& metric,
+                      const Core& core)
+{
+    int lo, hi;
+    if (!channel_range(rings, q, metric, lo, hi))
+        return 0;
+    int n = 0;
+    // Each channel's hits are only searched as far in time as the
+    // metric allows at that channel's distance
+    for (int c = lo; c <= hi; ++c) {
+        n += neighbours_within(rings.channel(c),
+                               q,
+                               T(metric.time_window(std::abs(c - q.chan))),
+                               metric,
+                               core);
+    }
+    return n;
+}
+
 //======================================================================
+template<class T, class Metric, class Core>
+int
+neighbours_by_occupied_channel(const ChannelRings<T>& rings,
+                               const OccupancyBitmap<T>& occupancy,
+                               Hit<T>& q,
+                               const Metric& metric,
+                               const Core& core)
+{
+    int lo, hi;
+    if (!channel_range(rings, q, metric, lo, hi))
+        return 0;
+    int n = 0;
+    occupancy.for_each_occupied(
+        q.time, metric.time_window(), lo, hi, [&](int c) {
+            n += neighbours_within(
+                rings.channel(c),
+                q,
+                T(metric.time_window(std::abs(c - q.chan))),
+                metric,
+                core);
+        });
+    return n;
+}
+
+//======================================================================
+template<class T>
+template<class Metric, class Core>
 bool
-Cluster::maybe_add_new_hit(Hit* new_hit, float eps, int minPts)
+Cluster<T>::maybe_add_new_hit(Hit<T>* new_hit,
+                              const Metric& metric,
+                              const Core& core)
 {
     // Should we add this hit?
     bool do_add = false;
 
-    // Hits earlier than new_hit time minus `eps` can't possibly be
-    // neighbours, so start the search there in the sorted list of hits in this
-    // cluster
-    auto begin_it = std::lower_bound(
-        hits.begin(), hits.end(), new_hit->time - eps, time_comp_lower);
+    // Hits earlier than new_hit time minus the metric's time window
+    // can't possibly be neighbours, so start the search there in the
+    // sorted list of hits in this cluster
+    sort_hits();
+    auto begin_it = std::lower_bound(hits.begin(),
+                                     hits.end(),
+                                     new_hit->time - metric.time_window(),
+                                     time_comp_lower<T>);
 
     for (auto it = begin_it; it != hits.end(); ++it) {
-        Hit* h = *it;
-        if (h->add_potential_neighbour(new_hit, eps, minPts)) {
+        Hit<T>* h = *it;
+        if (h->add_potential_neighbour(new_hit, metric, core)) {
             do_add = true;
-            if (h->neighbours.size() + 1 >= minPts) {
+            if (core.is_core(*h)) {
                 h->connectedness = Connectedness::kCore;
             } else {
                 h->connectedness = Connectedness::kEdge;
@@ -58,11 +196,14 @@ Cluster::maybe_add_new_hit(Hit* new_hit, float eps, int minPts)
 }
 
 //======================================================================
+template<class T>
 void
-Cluster::add_hit(Hit* h)
+Cluster<T>::add_hit(Hit<T>* h)
 {
-    hits.insert(h);
+    if (hits.insert(h))
+        moments.add(*h);
     h->cluster = index;
+    earliest_time = std::min(earliest_time, h->time);
     latest_time = std::max(latest_time, h->time);
     if (h->connectedness == Connectedness::kCore &&
         (!latest_core_point || h->time > latest_core_point->time)) {
@@ -71,34 +212,68 @@ Cluster::add_hit(Hit* h)
 }
 
 //======================================================================
+template<class T>
 void
-Cluster::steal_hits(Cluster& other)
+Cluster<T>::steal_hits(Cluster& other)
 {
-    // TODO: it might be faster to do some sort of explicit "merge" of the hits,
-    // eg:
-    //
-    // this->hits.insert(other hits); // Inserts at end
-    // std::inplace_merge(...)
-    //
-    // This might save some reallocations of the vector
-    for (auto h : other.hits) {
+    // Our hits are in append mode, so this just appends the other
+    // cluster's hits, and the merge happens when we're sorted. They
+    // have to leave the other cluster's set before they can go in ours
+    for (auto h : other.hits.release()) {
         assert(h);
         add_hit(h);
     }
-    other.hits.clear();
+    other.moments.clear();
     other.completeness = Completeness::kComplete;
 }
 
 //======================================================================
+template<class T>
+void
+Cluster<T>::sort_hits()
+{
+    hits.sort();
+}
+
+//======================================================================
+template<class T>
 void
-IncrementalDBSCAN::cluster_reachable(Hit* seed_hit, Cluster& cluster)
+Cluster<T>::recompute_moments()
+{
+    moments.clear();
+    for (auto h : hits) {
+        moments.add(*h);
+    }
+}
+
+//======================================================================
+template<class T>
+ClusterSummary<T>
+Cluster<T>::summary() const
+{
+    ClusterSummary<T> ret;
+    ret.index = index;
+    ret.earliest_time = earliest_time;
+    ret.latest_time = latest_time;
+    moments.fill(ret);
+    for (auto h : hits) {
+        if (h->connectedness == Connectedness::kCore)
+            ++ret.n_core;
+    }
+    return ret;
+}
+
+//======================================================================
+template<class T, class Metric, class Core>
+void
+IncrementalDBSCAN<T, Metric, Core>::cluster_reachable(Hit<T>* seed_hit, Cluster<T>& cluster)
 {
     // Loop over all neighbours (and the neighbours of core points, and so on)
-    std::vector<Hit*> seedSet(seed_hit->neighbours.begin(),
+    std::vector<Hit<T>*> seedSet(seed_hit->neighbours.begin(),
                               seed_hit->neighbours.end());
 
     while (!seedSet.empty()) {
-        Hit* q = seedSet.back();
+        Hit<T>* q = seedSet.back();
         seedSet.pop_back();
         // Change noise to a border point
         if (q->connectedness == Connectedness::kNoise) {
@@ -112,7 +287,7 @@ IncrementalDBSCAN::cluster_reachable(Hit* seed_hit, Cluster& cluster)
         cluster.add_hit(q);
 
         // If q is a core point, add its neighbours to the search list
-        if (q->neighbours.size() + 1 >= m_minPts) {
+        if (m_core.is_core(*q)) {
             q->connectedness = Connectedness::kCore;
             seedSet.insert(
                 seedSet.end(), q->neighbours.begin(), q->neighbours.end());
@@ -121,184 +296,709 @@ IncrementalDBSCAN::cluster_reachable(Hit* seed_hit, Cluster& cluster)
 }
 
 //======================================================================
+template<class T, class Metric, class Core>
 void
-IncrementalDBSCAN::add_point(float time, float channel, std::vector<Cluster>* completed_clusters)
+IncrementalDBSCAN<T, Metric, Core>::add_point_with_charge(
+  T time,
+  int channel,
+  float charge,
+  std::vector<Cluster<T>>* completed_clusters,
+  std::vector<ClusterSummary<T>>* completed_summaries)
 {
-    Hit& new_hit=m_hit_pool[m_pool_end];
-    new_hit.reset(time, channel);
+    Hit<T>& new_hit=m_hit_pool[m_pool_end];
+    new_hit.reset(time, channel, charge);
     ++m_pool_end;
     if(m_pool_end==m_hit_pool.size()) m_pool_end=0;
-    add_hit(&new_hit, completed_clusters);
+    add_hit(&new_hit, completed_clusters, completed_summaries);
 }
     
 //======================================================================
+template<class T, class Metric, class Core>
 void
-IncrementalDBSCAN::add_hit(Hit* new_hit, std::vector<Cluster>* completed_clusters)
+IncrementalDBSCAN<T, Metric, Core>::add_hit(Hit<T>* new_hit,
+                                            std::vector<Cluster<T>>* completed_clusters,
+                                            std::vector<ClusterSummary<T>>* completed_summaries)
 {
-    // TODO: this should be a member variable, not a static, in case
-    // there are multiple IncrementalDBSCAN instances
-    static int next_cluster_index = 0;
+    if (m_phase_counters)
+        m_phase_counters->start();
 
     m_hits.push_back(new_hit);
+    index_hit(new_hit);
     m_latest_time = new_hit->time;
-
-    // All the clusters that this hit neighboured. If there are
-    // multiple clusters neighbouring this hit, we'll merge them at
-    // the end
-    std::set<int> clusters_neighbouring_hit;
+    m_touched.clear();
+
+    if (m_prefilter) {
+        bool isolated = m_isolation.is_isolated(new_hit->time,
+                                                new_hit->chan,
+                                                m_metric.time_window(),
+                                                int(m_metric.chan_window()));
+        m_isolation.add(new_hit->time, new_hit->chan);
+        // A hit with no neighbours can't join a cluster, or make any
+        // other hit core. Unless it's core on its own, it's noise, and
+        // there's nothing to do except complete and trim
+        if (isolated && !m_core.is_core(*new_hit)) {
+            ++m_n_prefiltered;
+            if (m_phase_counters)
+                m_phase_counters->mark(Phase::kNeighbourSearch);
+            complete_clusters(false, completed_clusters, completed_summaries);
+            if (m_phase_counters)
+                m_phase_counters->mark(Phase::kCompletion);
+            trim_hits();
+            if (m_phase_counters)
+                m_phase_counters->mark(Phase::kTrim);
+            return;
+        }
+    }
 
     // Find all the hit's neighbours
-    neighbours_sorted(m_hits, *new_hit, m_eps, m_minPts);
-
-    for (auto neighbour : new_hit->neighbours) {
-        if (neighbour->cluster != kUndefined && neighbour->cluster != kNoise &&
-            neighbour->neighbours.size() + 1 >= m_minPts) {
-            // This neighbour is a core point in a cluster. Add the cluster to the list of
-            // clusters that will contain this hit
-            clusters_neighbouring_hit.insert(neighbour->cluster);
-        }
+    switch (m_index) {
+        case NeighbourIndex::kTimeOrdered:
+            neighbours_sorted(m_hits, *new_hit, m_metric, m_core);
+            break;
+        case NeighbourIndex::kPerChannel:
+            neighbours_by_channel(m_channel_rings, *new_hit, m_metric, m_core);
+            break;
+        case NeighbourIndex::kPerChannelOccupancy:
+            neighbours_by_occupied_channel(
+                m_channel_rings, m_occupancy, *new_hit, m_metric, m_core);
+            break;
+    }
+    if (m_phase_counters)
+        m_phase_counters->mark(Phase::kNeighbourSearch);
+
+    // Only the hits whose core status new_hit changed can connect
+    // clusters: new_hit itself, if it's core, and the neighbours it
+    // just made core. A hit that was already core is already in a
+    // cluster with everything it reaches
+    m_new_cores.clear();
+    if (m_core.is_core(*new_hit))
+        m_new_cores.push_back(new_hit);
+    for (auto q : new_hit->neighbours) {
+        if (m_core.just_became_core(*q, *new_hit))
+            m_new_cores.push_back(q);
     }
 
-    if (clusters_neighbouring_hit.empty()) {
-        // This hit didn't match any existing cluster. See if we can
-        // make a new cluster out of it. Otherwise mark it as noise
+    for (auto u : m_new_cores) {
+        u->connectedness = Connectedness::kCore;
+
+        // The clusters of u's core neighbours are all connected
+        // through u now. There's rarely more than one, so a vector
+        // beats a set here
+        m_linked_clusters.clear();
+        for (auto q : u->neighbours) {
+            if (q->cluster != kUndefined && q->cluster != kNoise &&
+                m_core.is_core(*q) &&
+                std::find(m_linked_clusters.begin(),
+                          m_linked_clusters.end(),
+                          q->cluster) == m_linked_clusters.end())
+                m_linked_clusters.push_back(q->cluster);
+        }
 
-        if (new_hit->neighbours.size() + 1 >= m_minPts) {
-            // std::cout << "New cluster starting at hit time " << new_hit->time << " with " << new_hit->neighbours.size() << " neighbours" << std::endl;
-            new_hit->connectedness = Connectedness::kCore;
+        if (m_linked_clusters.empty()) {
+            // No core neighbours in a cluster, so start a new cluster
+            // at u and walk out from there
             auto new_it = m_clusters.emplace_hint(
-                m_clusters.end(), next_cluster_index, next_cluster_index);
-            Cluster& new_cluster = new_it->second;
+                m_clusters.end(), m_next_cluster_index, m_next_cluster_index);
+            Cluster<T>& new_cluster = new_it->second;
             new_cluster.completeness = Completeness::kIncomplete;
-            new_cluster.add_hit(new_hit);
-            next_cluster_index++;
-            cluster_reachable(new_hit, new_cluster);
-        }
-        else{
-            // std::cout << "New hit time " << new_hit->time << " with " << new_hit->neighbours.size() << " neighbours is noise" << std::endl;
+            new_cluster.add_hit(u);
+            m_next_cluster_index++;
+            cluster_reachable(u, new_cluster);
+            if (m_callback)
+                m_touched.push_back(new_cluster.index);
+            continue;
         }
-    } else {
-        // This hit neighboured at least one cluster. Add the hit and
-        // its noise neighbours to the first cluster in the list, then
-        // merge the rest of the clusters into it
-
-        auto index_it = clusters_neighbouring_hit.begin();
 
-        auto it = m_clusters.find(*index_it);
+        // Add u and its unclustered neighbours to the first cluster,
+        // then merge the rest of the clusters into it. A neighbour
+        // that's core but not yet in a cluster is one of m_new_cores,
+        // and gets its own turn
+        auto it = m_clusters.find(*std::min_element(m_linked_clusters.begin(),
+                                                    m_linked_clusters.end()));
         assert(it != m_clusters.end());
-        Cluster& cluster = it->second;
-        // std::cout << "Adding hit time " << new_hit->time << " with " << new_hit->neighbours.size() << " neighbours to existing cluster" << std::endl;
-        cluster.add_hit(new_hit);
-
-        // TODO: this seems wrong: we're adding this hit's neighbours
-        // to the cluster even if this hit isn't a core point, but if
-        // I wrap the whole thing in "if(new_hit is core)" then the
-        // results differ from classic DBSCAN
-        for (auto q : new_hit->neighbours) {
-            if (q->cluster == kUndefined || q->cluster == kNoise) {
-                // std::cout << "  Adding hit time " << q->time << " to existing cluster" << std::endl;
-                cluster.add_hit(q);
-            }
-            // If the neighbouring hit q has exactly m_minPts
-            // neighbours, it must have become a core point by the
-            // addition of new_hit. Add q's neighbours to the cluster
-            if(q->neighbours.size() + 1 == m_minPts){
-                for (auto r : q->neighbours) {
-                    cluster.add_hit(r);
-                }
-            }
-        }
-
-
-        ++index_it;
-
-        for (; index_it != clusters_neighbouring_hit.end(); ++index_it) {
-
-            auto other_it = m_clusters.find(*index_it);
+        Cluster<T>& cluster = it->second;
+        if (m_callback)
+            m_touched.push_back(cluster.index);
+        for (int index : m_linked_clusters) {
+            if (index == cluster.index)
+                continue;
+            auto other_it = m_clusters.find(index);
             assert(other_it != m_clusters.end());
-            Cluster& other_cluster = other_it->second;
+            Cluster<T>& other_cluster = other_it->second;
+            if (m_callback && other_cluster.crossed)
+                m_callback(ClusterEvent::kMerged, other_cluster, cluster.index);
             cluster.steal_hits(other_cluster);
         }
+        cluster.add_hit(u);
+        for (auto q : u->neighbours) {
+            if (q->cluster == kUndefined || q->cluster == kNoise)
+                cluster.add_hit(q);
+        }
     }
 
-    // Last case: new_hit and its neighbour are both noise, but the
-    // addition of new_hit makes the neighbour a core point. So we
-    // start a new cluster at the neighbour, and walk out from there
-    for (auto& neighbour : new_hit->neighbours) {
-        if(neighbour->neighbours.size() + 1 >= m_minPts){
-            // std::cout << "new_hit's neighbour at " << neighbour->time << " has " << neighbour->neighbours.size() << " neighbours, so is core" << std::endl;
-            if(neighbour->cluster==kNoise || neighbour->cluster==kUndefined){
-                if(new_hit->cluster==kNoise || new_hit->cluster==kUndefined){
-                    auto new_it = m_clusters.emplace_hint(
-                                                          m_clusters.end(), next_cluster_index, next_cluster_index);
-                    Cluster& new_cluster = new_it->second;
-                    new_cluster.completeness = Completeness::kIncomplete;
-                    new_cluster.add_hit(neighbour);
-                    next_cluster_index++;
-                    cluster_reachable(neighbour, new_cluster);
-                }
+    // If new_hit isn't core, it's a border point of the first cluster
+    // with a core neighbour, or noise. It doesn't connect anything
+    if (new_hit->cluster == kUndefined || new_hit->cluster == kNoise) {
+        for (auto q : new_hit->neighbours) {
+            if (q->cluster != kUndefined && q->cluster != kNoise &&
+                m_core.is_core(*q)) {
+                auto it = m_clusters.find(q->cluster);
+                assert(it != m_clusters.end());
+                it->second.add_hit(new_hit);
+                if (m_callback)
+                    m_touched.push_back(it->second.index);
+                break;
             }
         }
-        else {
-            // std::cout << "new_hit's neighbour at " << neighbour->time << " has " << neighbour->neighbours.size() << " neighbours, so is NOT core" << std::endl;
-        }
     }
 
+    if (m_callback)
+        notify_touched();
+    if (m_phase_counters)
+        m_phase_counters->mark(Phase::kClusterUpdate);
+
+    complete_clusters(false, completed_clusters, completed_summaries);
+    if (m_phase_counters)
+        m_phase_counters->mark(Phase::kCompletion);
+    trim_hits();
+    if (m_phase_counters)
+        m_phase_counters->mark(Phase::kTrim);
+}
+
+//======================================================================
+template<class T, class Metric, class Core>
+void
+IncrementalDBSCAN<T, Metric, Core>::advance_time(T time,
+                                                 std::vector<Cluster<T>>* completed_clusters,
+                                                 std::vector<ClusterSummary<T>>* completed_summaries)
+{
+    if (time > m_latest_time)
+        m_latest_time = time;
+    complete_clusters(false, completed_clusters, completed_summaries);
+    trim_hits();
+}
+
+//======================================================================
+template<class T, class Metric, class Core>
+void
+IncrementalDBSCAN<T, Metric, Core>::flush(std::vector<Cluster<T>>* completed_clusters,
+                                          std::vector<ClusterSummary<T>>* completed_summaries)
+{
+    complete_clusters(true, completed_clusters, completed_summaries);
+    m_hits.clear();
+    m_channel_rings.clear();
+    m_occupancy.clear();
+    m_isolation.clear();
+}
 
+//======================================================================
+template<class T, class Metric, class Core>
+void
+IncrementalDBSCAN<T, Metric, Core>::complete_clusters(bool all,
+                                                      std::vector<Cluster<T>>* completed_clusters,
+                                                      std::vector<ClusterSummary<T>>* completed_summaries)
+{
     // Delete any completed clusters from the list. Put them in the
-    // `completed_clusters` vector, if that vector was passed
+    // `completed_clusters` vector, if that vector was passed. We also
+    // find the earliest hit in the remaining clusters while we're
+    // here, for trim_hits()
+    m_earliest_cluster_time = std::numeric_limits<T>::max();
     auto clust_it = m_clusters.begin();
     while (clust_it != m_clusters.end()) {
-        Cluster& cluster = clust_it->second;
+        Cluster<T>& cluster = clust_it->second;
 
-        if (cluster.latest_time < m_latest_time - m_eps) {
+        // A new hit can make a neighbour core, whose own neighbours
+        // then join its cluster, so a cluster can still be merged
+        // until it's two time windows behind the latest hit
+        if (all || cluster.latest_time <
+                       m_latest_time - 2 * m_metric.time_window()) {
             cluster.completeness = Completeness::kComplete;
         }
 
         if (cluster.completeness == Completeness::kComplete) {
-            if(completed_clusters){
-                // TODO: room for std::move here?
-                //
-                // Clusters that got merged into another cluster had
-                // their hits cleared, and were set kComplete, by
-                // steal_hits
-                if(cluster.hits.size()!=0){
+            // Clusters that got merged into another cluster had
+            // their hits cleared, and were set kComplete, by
+            // steal_hits
+            if(cluster.hits.size()!=0){
+                bool notify = m_callback && cluster.crossed;
+                if(completed_clusters || completed_summaries || notify){
+                    cluster.sort_hits();
+                }
+                if(notify){
+                    m_callback(ClusterEvent::kCompleted, cluster, kUndefined);
+                }
+                if(completed_summaries){
+                    completed_summaries->push_back(cluster.summary());
+                }
+                if(completed_clusters){
+                    // TODO: room for std::move here?
                     completed_clusters->push_back(cluster);
                 }
             }
             clust_it = m_clusters.erase(clust_it);
             continue;
         } else {
+            m_earliest_cluster_time =
+                std::min(m_earliest_cluster_time, cluster.earliest_time);
             ++clust_it;
         }
     }
 }
 
+//======================================================================
+template<class T, class Metric, class Core>
 void
-IncrementalDBSCAN::trim_hits()
+IncrementalDBSCAN<T, Metric, Core>::set_prefilter(bool prefilter)
+{
+    // The filter isn't kept up to date while it's off, so catch it up
+    if (prefilter && !m_prefilter)
+        rebuild_indices();
+    m_prefilter = prefilter;
+}
+
+//======================================================================
+template<class T, class Metric, class Core>
+void
+IncrementalDBSCAN<T, Metric, Core>::rebuild_indices()
+{
+    // Hits trimmed from the window are too early to be neighbours of
+    // any new hit, so they don't need to be in either index
+    m_isolation.clear();
+    m_channel_rings.clear();
+    m_occupancy.clear();
+    for (size_t i = 0; i < m_hits.size(); ++i) {
+        m_isolation.add(m_hits[i]->time, m_hits[i]->chan);
+        index_hit(m_hits[i]);
+    }
+}
+
+//======================================================================
+template<class T, class Metric, class Core>
+void
+IncrementalDBSCAN<T, Metric, Core>::index_hit(Hit<T>* h)
+{
+    if (m_index == NeighbourIndex::kTimeOrdered)
+        return;
+    m_channel_rings.push_back(h);
+    if (m_index == NeighbourIndex::kPerChannelOccupancy)
+        m_occupancy.add(h->time, h->chan);
+}
+
+//======================================================================
+template<class T, class Metric, class Core>
+bool
+IncrementalDBSCAN<T, Metric, Core>::crosses_thresholds(
+    const Cluster<T>& cluster) const
 {
-    // Find the earliest time of a hit in any cluster in the list (active or
-    // not)
-    float earliest_time = std::numeric_limits<float>::max();
+    const EarlyEmissionThresholds<T>& t = m_thresholds;
+    const ClusterMoments<T>& m = cluster.moments;
+    return (t.min_hits && m.size() >= t.min_hits) ||
+           (t.min_time_extent &&
+            cluster.latest_time - cluster.earliest_time >=
+                t.min_time_extent) ||
+           (t.min_chan_extent &&
+            m.max_chan() - m.min_chan() >= t.min_chan_extent) ||
+           (t.min_charge && m.total_charge() >= t.min_charge);
+}
 
-    for (auto& cluster : m_clusters) {
-        earliest_time =
-            std::min(earliest_time, (*cluster.second.hits.begin())->time);
+//======================================================================
+template<class T, class Metric, class Core>
+void
+IncrementalDBSCAN<T, Metric, Core>::notify_touched()
+{
+    std::sort(m_touched.begin(), m_touched.end());
+    m_touched.erase(std::unique(m_touched.begin(), m_touched.end()),
+                    m_touched.end());
+    for (int index : m_touched) {
+        auto it = m_clusters.find(index);
+        // Clusters that were merged away have no hits left
+        if (it == m_clusters.end() || it->second.hits.size() == 0)
+            continue;
+        Cluster<T>& cluster = it->second;
+        if (cluster.crossed) {
+            m_callback(ClusterEvent::kUpdated, cluster, kUndefined);
+        } else if (crosses_thresholds(cluster)) {
+            cluster.crossed = true;
+            m_callback(ClusterEvent::kCrossed, cluster, kUndefined);
+        }
     }
+}
 
-    // If there were no clusters, set the earliest_time to the latest time
-    // (otherwise it would still be FLOAT_MAX)
-    if (m_clusters.empty()) {
-        earliest_time = m_latest_time;
+//======================================================================
+template<class T, class Metric, class Core>
+void
+IncrementalDBSCAN<T, Metric, Core>::trim_hits()
+{
+    // If there are no clusters, trim relative to the latest time
+    // instead (otherwise the earliest time would still be the maximum
+    // value of T)
+    T earliest_time =
+        m_clusters.empty() ? m_latest_time : m_earliest_cluster_time;
+    T trim_time = earliest_time - m_trim_margin;
+
+    // The hits are in time order, so this only ever looks at the hits
+    // it removes, plus one
+    while (!m_hits.empty() && m_hits.front()->time < trim_time) {
+        // Each channel's ring is in the same order as the window, so
+        // this is the earliest hit on its channel too
+        if (m_index != NeighbourIndex::kTimeOrdered)
+            m_channel_rings.pop_front(m_hits.front());
+        m_hits.pop_front();
     }
-    auto last_it = std::lower_bound(m_hits.begin(),
-                                    m_hits.end(),
-                                    earliest_time - 10 * m_eps,
-                                    time_comp_lower);
+}
 
-    m_hits.erase(m_hits.begin(), last_it);
+//======================================================================
+template<class T, class Metric, class Core>
+std::vector<Hit<T>*>
+IncrementalDBSCAN<T, Metric, Core>::get_hits() const
+{
+    std::vector<Hit<T>*> ret;
+    ret.reserve(m_hits.size());
+    for (size_t i = 0; i < m_hits.size(); ++i) {
+        ret.push_back(m_hits[i]);
+    }
+    return ret;
 }
 
+//======================================================================
+template<class T, class Metric, class Core>
+MemoryUsage
+IncrementalDBSCAN<T, Metric, Core>::memory_usage() const
+{
+    MemoryUsage usage;
+    usage.hit_pool = m_hit_pool.capacity() * sizeof(Hit<T>);
+    for (auto const& h : m_hit_pool) {
+        usage.neighbour_lists += h.neighbours.hits.capacity() * sizeof(Hit<T>*);
+    }
+    usage.hit_window = m_hits.capacity() * sizeof(Hit<T>*);
+    usage.channel_indices = m_channel_rings.memory_bytes() +
+                            m_occupancy.memory_bytes() +
+                            m_isolation.memory_bytes();
+    // A red-black tree node is the value plus a colour and three
+    // pointers
+    const size_t node_size =
+        sizeof(typename std::map<int, Cluster<T>>::value_type) +
+        4 * sizeof(void*);
+    usage.clusters = m_clusters.size() * node_size;
+    for (auto const& entry : m_clusters) {
+        usage.cluster_hits +=
+            entry.second.hits.hits.capacity() * sizeof(Hit<T>*);
+    }
+
+    auto peak = [](size_t& p, size_t v) { p = std::max(p, v); };
+    peak(m_peak_memory.hit_pool, usage.hit_pool);
+    peak(m_peak_memory.neighbour_lists, usage.neighbour_lists);
+    peak(m_peak_memory.hit_window, usage.hit_window);
+    peak(m_peak_memory.channel_indices, usage.channel_indices);
+    peak(m_peak_memory.clusters, usage.clusters);
+    peak(m_peak_memory.cluster_hits, usage.cluster_hits);
+    peak(m_peak_total_memory, usage.total());
+    return usage;
+}
+
+//======================================================================
+template<class T, class Metric, class Core>
+bool
+IncrementalDBSCAN<T, Metric, Core>::save_state(std::ostream& os) const
+{
+    // Hit pointers are written as indices into a table of hits: the
+    // hits in the window, plus any trimmed hits that they still list
+    // as neighbours. The trimmed hits' own neighbour lists are cut
+    // down to the hits in the table, which is harmless since they're
+    // too far back to be looked at again. The table is in address
+    // order, and restore_state() lays the hits out in the same order,
+    // so that hit sets' tie-breaking on equal times is unchanged
+    std::vector<const Hit<T>*> table;
+    table.reserve(m_hits.size());
+    for (size_t i = 0; i < m_hits.size(); ++i) {
+        table.push_back(m_hits[i]);
+    }
+    for (size_t i = 0; i < m_hits.size(); ++i) {
+        for (auto h : m_hits[i]->neighbours) {
+            table.push_back(h);
+        }
+    }
+    std::sort(table.begin(), table.end());
+    table.erase(std::unique(table.begin(), table.end()), table.end());
+
+    std::unordered_map<const Hit<T>*, uint32_t> index;
+    index.reserve(table.size());
+    for (size_t i = 0; i < table.size(); ++i) {
+        index[table[i]] = i;
+    }
+
+    os.write(kStateMagic, sizeof(kStateMagic));
+    write_value(os, kStateVersion);
+    write_value(os, uint8_t(sizeof(T)));
+    write_value(os, uint8_t(std::is_integral<T>::value));
+    write_value(os, T(m_metric.time_window()));
+    write_value(os, T(m_metric.chan_window()));
+    write_value(os, double(m_core.threshold()));
+
+    write_value(os, m_trim_margin);
+    write_value(os, m_latest_time);
+    write_value(os, m_earliest_cluster_time);
+    write_value(os, int32_t(m_next_cluster_index));
+
+    write_value(os, uint64_t(table.size()));
+    for (auto h : table) {
+        write_value(os, h->time);
+        write_value(os, int32_t(h->chan));
+        write_value(os, h->charge);
+        write_value(os, h->neighbour_charge);
+        write_value(os, int32_t(h->cluster));
+        write_value(os, int32_t(h->stamp));
+        write_value(os, uint8_t(h->connectedness));
+    }
+    std::vector<uint32_t> neighbours;
+    for (auto h : table) {
+        neighbours.clear();
+        for (auto n : h->neighbours) {
+            auto it = index.find(n);
+            if (it != index.end())
+                neighbours.push_back(it->second);
+        }
+        write_value(os, uint32_t(neighbours.size()));
+        os.write(reinterpret_cast<const char*>(neighbours.data()),
+                 neighbours.size() * sizeof(uint32_t));
+    }
+
+    write_value(os, uint64_t(m_hits.size()));
+    for (size_t i = 0; i < m_hits.size(); ++i) {
+        write_value(os, index.at(m_hits[i]));
+    }
+
+    // Active clusters' hits are all in the window, since trim_hits()
+    // keeps everything after the earliest of them
+    write_value(os, uint64_t(m_clusters.size()));
+    for (auto const& kv : m_clusters) {
+        const Cluster<T>& cluster = kv.second;
+        write_value(os, int32_t(cluster.index));
+        write_value(os, uint8_t(cluster.completeness));
+        write_value(os, uint8_t(cluster.crossed));
+        write_value(os, cluster.earliest_time);
+        write_value(os, cluster.latest_time);
+        write_value(os,
+                    cluster.latest_core_point
+                        ? int64_t(index.at(cluster.latest_core_point))
+                        : int64_t(-1));
+        write_value(os, uint64_t(cluster.hits.size()));
+        for (auto h : cluster.hits) {
+            write_value(os, index.at(h));
+        }
+    }
+
+    return bool(os);
+}
+
+//======================================================================
+template<class T, class Metric, class Core>
+bool
+IncrementalDBSCAN<T, Metric, Core>::restore_state(std::istream& is)
+{
+    // Empty the instance, as if it had just been constructed with the
+    // same configuration
+    auto clear = [this]() {
+        m_hits.clear();
+        m_clusters.clear();
+        m_channel_rings.clear();
+        m_occupancy.clear();
+        m_isolation.clear();
+        m_pool_begin = m_pool_end = 0;
+        m_latest_time = 0;
+        m_earliest_cluster_time = std::numeric_limits<T>::max();
+        m_next_cluster_index = 0;
+        m_n_prefiltered = 0;
+        m_peak_memory = MemoryUsage();
+        m_peak_total_memory = 0;
+    };
+    auto fail = [&clear]() {
+        clear();
+        return false;
+    };
+    clear();
+
+    char magic[sizeof(kStateMagic)];
+    is.read(magic, sizeof(magic));
+    if (!is || std::memcmp(magic, kStateMagic, sizeof(magic)) != 0)
+        return fail();
+
+    uint32_t version;
+    uint8_t time_size, time_is_integral;
+    T time_window, chan_window;
+    double threshold;
+    if (!read_value(is, version) || version != kStateVersion ||
+        !read_value(is, time_size) || time_size != sizeof(T) ||
+        !read_value(is, time_is_integral) ||
+        time_is_integral != std::is_integral<T>::value ||
+        !read_value(is, time_window) ||
+        time_window != m_metric.time_window() ||
+        !read_value(is, chan_window) ||
+        chan_window != m_metric.chan_window() || !read_value(is, threshold) ||
+        threshold != m_core.threshold()) {
+        return fail();
+    }
+
+    // These only replace the instance's values once the whole snapshot
+    // has been read
+    T trim_margin, latest_time, earliest_cluster_time;
+    int32_t next_cluster_index;
+    if (!read_value(is, trim_margin) || !read_value(is, latest_time) ||
+        !read_value(is, earliest_cluster_time) ||
+        !read_value(is, next_cluster_index)) {
+        return fail();
+    }
+
+    uint64_t n_hits;
+    if (!read_value(is, n_hits) || n_hits >= m_hit_pool.size())
+        return fail();
+    // The hits go at the start of the pool, and new hits after them
+    for (size_t i = 0; i < n_hits; ++i) {
+        T time;
+        int32_t chan, cluster, stamp;
+        float charge;
+        double neighbour_charge;
+        uint8_t connectedness;
+        if (!read_value(is, time) || !read_value(is, chan) ||
+            !read_value(is, charge) || !read_value(is, neighbour_charge) ||
+            !read_value(is, cluster) || !read_value(is, stamp) ||
+            !read_value(is, connectedness)) {
+            return fail();
+        }
+        Hit<T>& h = m_hit_pool[i];
+        h.reset(time, chan, charge);
+        // Written rather than recomputed, since the neighbour lists of
+        // trimmed hits are incomplete
+        h.neighbour_charge = neighbour_charge;
+        h.cluster = cluster;
+        h.stamp = stamp;
+        h.connectedness = Connectedness(connectedness);
+    }
+    auto hit_at = [&](uint32_t i) -> Hit<T>* {
+        return i < n_hits ? &m_hit_pool[i] : nullptr;
+    };
+
+    std::vector<uint32_t> neighbours;
+    for (size_t i = 0; i < n_hits; ++i) {
+        uint32_t n;
+        if (!read_value(is, n) || n >= n_hits)
+            return fail();
+        neighbours.resize(n);
+        is.read(reinterpret_cast<char*>(neighbours.data()),
+                n * sizeof(uint32_t));
+        if (!is)
+            return fail();
+        // The neighbours were written in order, so each insert is an
+        // append
+        for (auto j : neighbours) {
+            Hit<T>* neighbour = hit_at(j);
+            if (!neighbour)
+                return fail();
+            m_hit_pool[i].neighbours.insert(neighbour);
+        }
+    }
+
+    uint64_t n_window;
+    if (!read_value(is, n_window) || n_window > n_hits)
+        return fail();
+    for (size_t i = 0; i < n_window; ++i) {
+        uint32_t j;
+        if (!read_value(is, j) || !hit_at(j))
+            return fail();
+        m_hits.push_back(hit_at(j));
+    }
+
+    uint64_t n_clusters;
+    if (!read_value(is, n_clusters))
+        return fail();
+    for (size_t i = 0; i < n_clusters; ++i) {
+        int32_t index;
+        uint8_t completeness, crossed;
+        T earliest_time, latest_time;
+        int64_t latest_core_point;
+        uint64_t n_cluster_hits;
+        if (!read_value(is, index) || !read_value(is, completeness) ||
+            !read_value(is, crossed) ||
+            !read_value(is, earliest_time) || !read_value(is, latest_time) ||
+            !read_value(is, latest_core_point) ||
+            !read_value(is, n_cluster_hits) || n_cluster_hits > n_hits) {
+            return fail();
+        }
+        Cluster<T>& cluster =
+            m_clusters.emplace_hint(m_clusters.end(), index, index)->second;
+        cluster.completeness = Completeness(completeness);
+        cluster.crossed = crossed;
+        cluster.earliest_time = earliest_time;
+        cluster.latest_time = latest_time;
+        cluster.latest_core_point =
+            latest_core_point >= 0 ? hit_at(latest_core_point) : nullptr;
+        // The hits already carry this cluster's stamp, so insert()
+        // would skip them. Fill in the array directly, and let sort()
+        // put it back in order when it's needed
+        cluster.hits.hits.reserve(n_cluster_hits);
+        for (size_t k = 0; k < n_cluster_hits; ++k) {
+            uint32_t j;
+            if (!read_value(is, j) || !hit_at(j))
+                return fail();
+            cluster.hits.hits.push_back(hit_at(j));
+        }
+        cluster.recompute_moments();
+    }
+
+    m_pool_end = n_hits;
+    set_trim_margin(trim_margin);
+    m_latest_time = latest_time;
+    m_earliest_cluster_time = earliest_cluster_time;
+    m_next_cluster_index = next_cluster_index;
+    rebuild_indices();
+    return true;
+}
+
+//======================================================================
+template struct Cluster<float>;
+template struct Cluster<tick_t>;
+
+// Instantiate everything that depends on the metric policy, for each
+// of the policies in metrics.hpp
+#define DBSCAN_INSTANTIATE_METRIC(T, M)                                    \
+    template int neighbours_sorted(                                        \
+        const RingBuffer<Hit<T>*>&, Hit<T>&, const M<T>&, const MinPts&);  \
+    template int neighbours_by_channel(                                    \
+        const ChannelRings<T>&, Hit<T>&, const M<T>&, const MinPts&);      \
+    template int neighbours_by_occupied_channel(const ChannelRings<T>&,    \
+                                                const OccupancyBitmap<T>&, \
+                                                Hit<T>&,                   \
+                                                const M<T>&,               \
+                                                const MinPts&);            \
+    template bool Cluster<T>::maybe_add_new_hit(                           \
+        Hit<T>*, const M<T>&, const MinPts&);                              \
+    template class IncrementalDBSCAN<T, M<T>>;                             \
+    template class IncrementalDBSCAN<T, M<T>, MinCharge>;
+
+#define DBSCAN_INSTANTIATE(T)                                              \
+    DBSCAN_INSTANTIATE_METRIC(T, EuclideanMetric)                          \
+    DBSCAN_INSTANTIATE_METRIC(T, ManhattanMetric)                          \
+    DBSCAN_INSTANTIATE_METRIC(T, ChebyshevMetric)                          \
+    DBSCAN_INSTANTIATE_METRIC(T, AnisotropicEuclideanMetric)               \
+    DBSCAN_INSTANTIATE_METRIC(T, AnisotropicBoxMetric)
+
+DBSCAN_INSTANTIATE(float)
+DBSCAN_INSTANTIATE(tick_t)
+
+// The configurations with eps and minPts fixed at compile time, for
+// make_incremental_dbscan()
+#define DBSCAN_INSTANTIATE_FIXED(EPS, MINPTS)                              \
+    template class IncrementalDBSCAN<tick_t,                               \
+                                     FixedEuclideanMetric<tick_t, EPS>,    \
+                                     FixedMinPts<MINPTS>>;
+
+DBSCAN_FIXED_CONFIGURATIONS(DBSCAN_INSTANTIATE_FIXED)
+
+#undef DBSCAN_INSTANTIATE_FIXED
+#undef DBSCAN_INSTANTIATE
+#undef DBSCAN_INSTANTIATE_METRIC
+
+
 }
 // Local Variables:
 // mode: c++
@@ -1,26 +1,139 @@
 #pragma once
 
 #include <vector>
+#include <functional>
 #include <map>
 #include <iostream>
 #include <algorithm> // For std::lower_bound
 #include <set>
 #include <list>
+#include <limits>
 
+#include "ChannelRings.hpp"
 #include "Hit.hpp"
+#include "OccupancyBitmap.hpp"
+#include "RingBuffer.hpp"
+#include "cluster_summary.hpp"
+#include "core_criteria.hpp"
+#include "isolation_filter.hpp"
+#include "metrics.hpp"
 
 namespace dbscan {
+
+class PhaseCounters;
+//======================================================================
+// Find the neighbours of hit q according to `metric`, assuming that
+// the hits vector is sorted by time. `core` decides which hits become
+// core points
+template<class T, class Metric, class Core>
+int
+neighbours_sorted(const RingBuffer<Hit<T>*>& hits,
+                  Hit<T>& q,
+                  const Metric& metric,
+                  const Core& core);
+
 //======================================================================
-// Find the eps-neighbours of hit q, assuming that the hits vector is sorted by
-// time
+// The same, searching only the channels within the metric's channel
+// window, each of which is in time order
+template<class T, class Metric, class Core>
 int
-neighbours_sorted(const std::vector<Hit*>& hits, Hit& q, float eps, int minPts);
+neighbours_by_channel(const ChannelRings<T>& rings,
+                      Hit<T>& q,
+                      const Metric& metric,
+                      const Core& core);
+
+//======================================================================
+// The same again, skipping the channels that `occupancy` says had no
+// hits in the time window, without looking at their rings
+template<class T, class Metric, class Core>
+int
+neighbours_by_occupied_channel(const ChannelRings<T>& rings,
+                               const OccupancyBitmap<T>& occupancy,
+                               Hit<T>& q,
+                               const Metric& metric,
+                               const Core& core);
+
+//======================================================================
+//
+// How IncrementalDBSCAN finds the neighbours of a new hit
+enum class NeighbourIndex
+{
+    // Scan back through all of the hits in the time window
+    kTimeOrdered,
+    // Scan back through the hits on each channel in the channel
+    // window. Better when there are many channels and a high rate
+    kPerChannel,
+    // As kPerChannel, but first look up which channels in the window
+    // have any recent hits in a bitmap of channel occupancy per time
+    // bin, and only scan those channels
+    kPerChannelOccupancy
+};
+
+//======================================================================
+//
+// Thresholds for early emission of open clusters (see
+// IncrementalDBSCAN::set_cluster_callback()). A cluster crosses the
+// thresholds when it reaches any one of those that are non-zero
+template<class T>
+struct EarlyEmissionThresholds
+{
+    size_t min_hits{ 0 };
+    // Latest minus earliest hit time
+    T min_time_extent{ 0 };
+    // Largest minus smallest channel
+    int min_chan_extent{ 0 };
+    double min_charge{ 0 };
+};
+
+//======================================================================
+//
+// The bytes used by IncrementalDBSCAN's data structures. They're
+// worked out from the capacities of the containers, since that's what
+// is allocated, not from the number of entries in use. The overhead
+// of the map's nodes is an estimate, and the allocator's own overhead
+// isn't included
+struct MemoryUsage
+{
+    // The Hit objects in the pool, which doesn't change size
+    size_t hit_pool{ 0 };
+    // The neighbour lists of the hits in the pool
+    size_t neighbour_lists{ 0 };
+    // The time-ordered window of hits
+    size_t hit_window{ 0 };
+    // The per-channel rings and occupancy bitmaps, and the
+    // prefilter's table
+    size_t channel_indices{ 0 };
+    // The active clusters' entries in the map of clusters
+    size_t clusters{ 0 };
+    // The active clusters' lists of hits
+    size_t cluster_hits{ 0 };
+
+    size_t total() const
+    {
+        return hit_pool + neighbour_lists + hit_window + channel_indices +
+               clusters + cluster_hits;
+    }
+};
+
+//======================================================================
+//
+// The events reported to IncrementalDBSCAN's cluster callback. Only
+// clusters that have crossed the early-emission thresholds get events
+enum class ClusterEvent
+{
+    kCrossed,   // An open cluster just crossed the thresholds
+    kUpdated,   // A cluster that had crossed gained hits
+    kMerged,    // A cluster that had crossed was merged into another
+    kCompleted  // A cluster that had crossed was completed
+};
 
 //======================================================================
+template<class T>
 struct Cluster
 {
     Cluster(int index_)
         : index{ index_ }
+        , hits{ HitSet<T>::Mode::kAppend, index_ }
     {}
     // The index of this cluster
     int index{ -1 };
@@ -28,71 +141,288 @@ struct Cluster
     // newly-arriving hit could be a neighbour of any hit in the
     // cluster
     Completeness completeness{ Completeness::kIncomplete };
-    // The latest time of any hit in the cluster
-    float latest_time{ 0 };
+    // The earliest time of any hit in the cluster
+    T earliest_time{ std::numeric_limits<T>::max() };
+    // The latest time of any hit in the cluster. Starts at the lowest
+    // value, not zero, so that clusters of hits at negative times
+    // (eg from an unsorted file, with times relative to its first
+    // line) can complete
+    T latest_time{ std::numeric_limits<T>::lowest() };
     // The latest (largest time) "core" point in the cluster
-    Hit* latest_core_point{ nullptr };
-    // The hits in this cluster
-    HitSet hits;
+    Hit<T>* latest_core_point{ nullptr };
+    // The hits in this cluster. They're appended as they're added,
+    // and only sorted by time when the cluster is completed, or when
+    // maybe_add_new_hit() needs them in order
+    HitSet<T> hits;
+    // Running sums over `hits`, for summary()
+    ClusterMoments<T> moments;
+    // True once the cluster has crossed the early-emission thresholds
+    bool crossed{ false };
 
     // Add hit if it's a neighbour of a hit already in the
     // cluster. Precondition: time of new_hit is >= the time of any
     // hit in the cluster. Returns true if the hit was added
-    bool maybe_add_new_hit(Hit* new_hit, float eps, int minPts);
+    template<class Metric, class Core>
+    bool maybe_add_new_hit(Hit<T>* new_hit,
+                           const Metric& metric,
+                           const Core& core);
 
     // Add the hit `h` to this cluster
-    void add_hit(Hit* h);
+    void add_hit(Hit<T>* h);
 
     // Steal all of the hits from cluster `other` and merge them into
     // this cluster
     void steal_hits(Cluster& other);
+
+    // Sort the hits by time
+    void sort_hits();
+
+    // Recompute the moments from scratch
+    void recompute_moments();
+
+    // The cluster's aggregates. The moments are kept up to date as
+    // hits are added, so only the core count needs a pass over the
+    // hits
+    ClusterSummary<T> summary() const;
 };
 
 //======================================================================
 //
 // Modified DBSCAN algorithm that takes one hit at a time, with the requirement
-// that the hits are passed in time order
+// that the hits are passed in time order. `T` is the time type of the
+// hits: `float`, or `tick_t` for exact integer ticks. `Metric` is the
+// distance-metric policy (see metrics.hpp), and `Core` the core-point
+// criterion (see core_criteria.hpp). A plain minPts converts to the
+// criterion, so `IncrementalDBSCAN<T>(eps, minPts)` does the usual
+// thing
+template<class T, class Metric = EuclideanMetric<T>, class Core = MinPts>
 class IncrementalDBSCAN
 {
 public:
-    IncrementalDBSCAN(float eps, unsigned int minPts, size_t pool_size=100000)
-        : m_eps(eps)
-        , m_minPts(minPts)
+    IncrementalDBSCAN(T eps,
+                      const Core& core,
+                      size_t pool_size = 100000,
+                      NeighbourIndex index = NeighbourIndex::kTimeOrdered)
+        : IncrementalDBSCAN(Metric(eps), core, pool_size, index)
+    {}
+
+    IncrementalDBSCAN(const Metric& metric,
+                      const Core& core,
+                      size_t pool_size = 100000,
+                      NeighbourIndex index = NeighbourIndex::kTimeOrdered)
+        : m_metric(metric)
+        , m_core(core)
+        , m_index(index)
+        , m_trim_margin(10 * metric.time_window())
         , m_pool_begin(0)
         , m_pool_end(0)
+        , m_occupancy(metric.time_window())
     {
         for(size_t i=0; i<pool_size; ++i){
             m_hit_pool.emplace_back(0,0);
+            // Pool hits are reused, so this is the only allocation
+            // most of their neighbour lists will ever need
+            m_hit_pool.back().neighbours.hits.reserve(10);
         }
     }
 
-    void add_point(float time, float channel, std::vector<Cluster>* completed_clusters=nullptr);
-    
+    void add_point(T time,
+                   int channel,
+                   std::vector<Cluster<T>>* completed_clusters = nullptr,
+                   std::vector<ClusterSummary<T>>* completed_summaries = nullptr)
+    {
+        add_point_with_charge(
+          time, channel, 1, completed_clusters, completed_summaries);
+    }
+
+    // The same, for a hit with charge `charge`. It has its own name so
+    // that add_point(time, channel, 0) or (..., nullptr) can't be read
+    // as a charge
+    void add_point_with_charge(
+      T time,
+      int channel,
+      float charge,
+      std::vector<Cluster<T>>* completed_clusters = nullptr,
+      std::vector<ClusterSummary<T>>* completed_summaries = nullptr);
+
     // Add a new hit. The hit time *must* be >= the time of all hits
-    // previously added
-    void add_hit(Hit* new_hit, std::vector<Cluster>* completed_clusters=nullptr);
+    // previously added. Hits that are too old to be needed any more
+    // are trimmed from the list of hits as we go. Clusters that are
+    // completed are appended to `completed_clusters`, and their
+    // summaries to `completed_summaries`, for whichever of them are
+    // given. Passing only `completed_summaries` saves copying the
+    // clusters' hits
+    void add_hit(Hit<T>* new_hit,
+                 std::vector<Cluster<T>>* completed_clusters = nullptr,
+                 std::vector<ClusterSummary<T>>* completed_summaries = nullptr);
+
+    // Declare that no hits earlier than `time` will be added from now
+    // on (eg, from an upstream heartbeat), and complete and trim as if
+    // a hit had arrived at that time, without adding one. Clusters
+    // can then be completed during quiet periods. Times earlier than
+    // the latest hit are ignored
+    void advance_time(T time,
+                      std::vector<Cluster<T>>* completed_clusters = nullptr,
+                      std::vector<ClusterSummary<T>>* completed_summaries = nullptr);
 
+    // Complete all of the open clusters, and drop all of the hits, as
+    // at the end of a run. More hits can be added afterwards, but they
+    // won't join any earlier cluster
+    void flush(std::vector<Cluster<T>>* completed_clusters = nullptr,
+               std::vector<ClusterSummary<T>>* completed_summaries = nullptr);
+
+    // Drop hits earlier than the trim margin before the earliest hit
+    // in any active cluster (or before the latest hit, if there are
+    // no active clusters). add_hit() does this itself, so there's no
+    // need to call it explicitly
     void trim_hits();
 
-    std::vector<Hit*> get_hits() const { return m_hits; }
+    // Set the margin used by trim_hits(). Defaults to 10 times the
+    // metric's time window. A hit that a new hit makes core brings in
+    // its own neighbours, up to two time windows back, so a smaller
+    // margin than that would drop hits that can still join a cluster.
+    // It's raised to two time windows
+    void set_trim_margin(T margin)
+    {
+        m_trim_margin = std::max(margin, T(2 * m_metric.time_window()));
+    }
+    T get_trim_margin() const { return m_trim_margin; }
+
+    // Turn the isolated-hit prefilter on or off (it's on by default).
+    // With the prefilter, a new hit with no earlier hit within the
+    // metric's time and channel windows skips the neighbour search and
+    // the cluster bookkeeping, and just goes into the hit window as
+    // noise, where later hits can still find it. The results are the
+    // same either way
+    void set_prefilter(bool prefilter);
+    bool get_prefilter() const { return m_prefilter; }
+
+    // The number of hits that took the prefilter's fast path
+    size_t n_prefiltered() const { return m_n_prefiltered; }
+
+    NeighbourIndex get_neighbour_index() const { return m_index; }
+
+    std::vector<Hit<T>*> get_hits() const;
+
+    std::map<int, Cluster<T>> get_clusters() const { return m_clusters; }
 
-    std::map<int, Cluster> get_clusters() const { return m_clusters; }
+    // The time of the latest hit added
+    T latest_time() const { return m_latest_time; }
+
+    // The memory in use now, by structure. This walks the hit pool and
+    // the active clusters, so it's for calling every so often (say,
+    // every 100k hits), not after every hit
+    MemoryUsage memory_usage() const;
+
+    // The largest value of each field of memory_usage(), and of its
+    // total, over the calls to memory_usage() so far. Only those calls
+    // update the peaks. The fields can peak at different times, so the
+    // total() of peak_memory_usage() can be more than the peak total
+    MemoryUsage peak_memory_usage() const { return m_peak_memory; }
+    size_t peak_total_memory() const { return m_peak_total_memory; }
+
+    // Accumulate hardware counter totals for each phase of add_hit()
+    // into `counters`, which must outlive this instance or be unset
+    // first. Pass null to stop. Only add_hit() is counted, not
+    // advance_time() or flush()
+    void set_phase_counters(PhaseCounters* counters)
+    {
+        m_phase_counters = counters;
+    }
+
+    // Called as callback(event, cluster, other). For kMerged, `other`
+    // is the index of the cluster it was merged into; otherwise it's
+    // kUndefined. The cluster's hits are only sorted for kCompleted
+    typedef std::function<void(ClusterEvent, const Cluster<T>&, int)>
+        ClusterCallback;
+
+    // Report open clusters as soon as they cross `thresholds`, without
+    // waiting for them to complete: `callback` gets kCrossed as soon
+    // as a cluster crosses, then kUpdated whenever it gains hits, and
+    // kMerged or kCompleted at the end. Pass an empty callback to stop
+    void set_cluster_callback(ClusterCallback callback,
+                              const EarlyEmissionThresholds<T>& thresholds)
+    {
+        m_callback = callback;
+        m_thresholds = thresholds;
+    }
+
+    // Write the live state (the hit window with the hits' neighbour
+    // lists, the active clusters and the cluster numbering) to `os` as
+    // a compact binary snapshot. Returns false if writing failed
+    bool save_state(std::ostream& os) const;
+
+    // Replace the state with a snapshot written by save_state(), by an
+    // instance with the same time type, metric and core criterion. The
+    // restored hits go into the hit pool, which must be bigger than
+    // the snapshot. The prefilter count and the memory peaks start
+    // again from zero. Returns false, and leaves the instance empty, if
+    // the snapshot is malformed or doesn't match
+    bool restore_state(std::istream& is);
 
 private:
     //======================================================================
     //
     // Starting from `seed_hit`, find all the reachable hits and add them
     // to `cluster`
-    void cluster_reachable(Hit* seed_hit, Cluster& cluster);
+    void cluster_reachable(Hit<T>* seed_hit, Cluster<T>& cluster);
+
+    // Move completed clusters out of the list of active clusters, into
+    // the output vectors if they're given. If `all` is true, complete
+    // every cluster; otherwise just those that no new hit can join
+    void complete_clusters(bool all,
+                           std::vector<Cluster<T>>* completed_clusters,
+                           std::vector<ClusterSummary<T>>* completed_summaries);
+
+    // Add `h` to the per-channel indices that are in use
+    void index_hit(Hit<T>* h);
+
+    // Refill the isolation filter, and the per-channel indices if
+    // they're in use, from the hits in the window
+    void rebuild_indices();
+
+    // Does `cluster` reach any of the early-emission thresholds?
+    bool crosses_thresholds(const Cluster<T>& cluster) const;
+
+    // Send kCrossed and kUpdated events for the clusters in m_touched
+    void notify_touched();
 
-    float m_eps;
-    float m_minPts;
-    std::vector<Hit> m_hit_pool;
+    Metric m_metric;
+    Core m_core;
+    NeighbourIndex m_index;
+    T m_trim_margin;
+    std::vector<Hit<T>> m_hit_pool;
     size_t m_pool_begin, m_pool_end;
-    std::vector<Hit*> m_hits; // All the hits we've seen so far, in time order
-    float m_latest_time{ 0 }; // The latest time of a hit in the vector of hits
-    std::map<int, Cluster>
+    RingBuffer<Hit<T>*> m_hits; // All the (untrimmed) hits we've seen so far, in time order
+    // The same hits, by channel, for NeighbourIndex::kPerChannel and
+    // kPerChannelOccupancy
+    ChannelRings<T> m_channel_rings;
+    // The recently-occupied channels, for kPerChannelOccupancy
+    OccupancyBitmap<T> m_occupancy;
+    T m_latest_time{ 0 }; // The latest time of a hit in the vector of hits
+    // The earliest time of a hit in any active cluster, as of the
+    // last pass over the clusters in add_hit()
+    T m_earliest_cluster_time{ std::numeric_limits<T>::max() };
+    // The index of the next new cluster
+    int m_next_cluster_index{ 0 };
+    bool m_prefilter{ true };
+    IsolationFilter<T> m_isolation;
+    size_t m_n_prefiltered{ 0 };
+    ClusterCallback m_callback;
+    EarlyEmissionThresholds<T> m_thresholds;
+    // The clusters that gained hits in the current call to add_hit(),
+    // if there's a callback
+    std::vector<int> m_touched;
+    // The hits that became core points in the current call to
+    // add_hit(), and the clusters each one connects
+    std::vector<Hit<T>*> m_new_cores;
+    std::vector<int> m_linked_clusters;
+    std::map<int, Cluster<T>>
         m_clusters; // All of the currently-active (ie, kIncomplete) clusters
+    // Updated by memory_usage()
+    mutable MemoryUsage m_peak_memory;
+    mutable size_t m_peak_total_memory{ 0 };
+    PhaseCounters* m_phase_counters{ nullptr };
 };
 
 }
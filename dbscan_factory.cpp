@@ -0,0 +1,137 @@
+#include "dbscan_factory.hpp"
+
+namespace dbscan {
+
+namespace {
+
+//======================================================================
+template<class Metric, class Core>
+class StreamingDBSCANImpl : public StreamingDBSCAN
+{
+public:
+    StreamingDBSCANImpl(const Metric& metric,
+                        const Core& core,
+                        size_t pool_size,
+                        bool specialised)
+        : m_dbscan(metric, core, pool_size)
+        , m_specialised(specialised)
+    {}
+
+    void add_point(tick_t time,
+                   int channel,
+                   std::vector<Cluster<tick_t>>* completed_clusters) override
+    {
+        m_dbscan.add_point(time, channel, completed_clusters);
+    }
+
+    void add_points(const tick_t* times,
+                    const int* channels,
+                    size_t n,
+                    std::vector<Cluster<tick_t>>* completed_clusters) override
+    {
+        for (size_t i = 0; i < n; ++i) {
+            m_dbscan.add_point(times[i], channels[i], completed_clusters);
+        }
+    }
+
+    void add_hits(Hit<tick_t>* hits,
+                  size_t n,
+                  std::vector<Cluster<tick_t>>* completed_clusters) override
+    {
+        for (size_t i = 0; i < n; ++i) {
+            m_dbscan.add_hit(&hits[i], completed_clusters);
+        }
+    }
+
+    void advance_time(tick_t time,
+                      std::vector<Cluster<tick_t>>* completed_clusters) override
+    {
+        m_dbscan.advance_time(time, completed_clusters);
+    }
+
+    void flush(std::vector<Cluster<tick_t>>* completed_clusters) override
+    {
+        m_dbscan.flush(completed_clusters);
+    }
+
+    void set_trim_margin(tick_t margin) override
+    {
+        m_dbscan.set_trim_margin(margin);
+    }
+
+    bool save_state(std::ostream& os) const override
+    {
+        return m_dbscan.save_state(os);
+    }
+
+    bool restore_state(std::istream& is) override
+    {
+        return m_dbscan.restore_state(is);
+    }
+
+    MemoryUsage memory_usage() const override
+    {
+        return m_dbscan.memory_usage();
+    }
+
+    MemoryUsage peak_memory_usage() const override
+    {
+        return m_dbscan.peak_memory_usage();
+    }
+
+    bool is_specialised() const override { return m_specialised; }
+
+private:
+    IncrementalDBSCAN<tick_t, Metric, Core> m_dbscan;
+    bool m_specialised;
+};
+
+}
+
+//======================================================================
+std::unique_ptr<StreamingDBSCAN>
+make_incremental_dbscan(tick_t eps,
+                        unsigned int minPts,
+                        size_t pool_size,
+                        bool allow_specialised)
+{
+    if (allow_specialised) {
+#define DBSCAN_MAKE_FIXED(EPS, MINPTS)                                     \
+    if (eps == EPS && minPts == MINPTS) {                                  \
+        return std::make_unique<                                           \
+            StreamingDBSCANImpl<FixedEuclideanMetric<tick_t, EPS>,         \
+                                FixedMinPts<MINPTS>>>(                     \
+            FixedEuclideanMetric<tick_t, EPS>(),                           \
+            FixedMinPts<MINPTS>(),                                         \
+            pool_size,                                                     \
+            true);                                                         \
+    }
+
+        DBSCAN_FIXED_CONFIGURATIONS(DBSCAN_MAKE_FIXED)
+
+#undef DBSCAN_MAKE_FIXED
+    }
+
+    return std::make_unique<
+        StreamingDBSCANImpl<EuclideanMetric<tick_t>, MinPts>>(
+        EuclideanMetric<tick_t>(eps), MinPts(minPts), pool_size, false);
+}
+
+//======================================================================
+std::unique_ptr<StreamingDBSCAN>
+make_weighted_incremental_dbscan(tick_t eps,
+                                 double min_charge,
+                                 size_t pool_size)
+{
+    return std::make_unique<
+        StreamingDBSCANImpl<EuclideanMetric<tick_t>, MinCharge>>(
+        EuclideanMetric<tick_t>(eps), MinCharge(min_charge), pool_size, false);
+}
+
+}
+
+// Local Variables:
+// mode: c++
+// c-basic-offset: 4
+// c-file-style: "linux"
+// End:
@@ -0,0 +1,109 @@
+#pragma once
+
+#include "dbscan.hpp"
+
+#include <iosfwd>
+#include <memory>
+#include <vector>
+
+namespace dbscan {
+//======================================================================
+//
+// The (eps, minPts) pairs, with eps in ticks and the Euclidean metric,
+// for which IncrementalDBSCAN is compiled with both of them fixed at
+// compile time. `X(eps, minPts)` is expanded for each pair
+#define DBSCAN_FIXED_CONFIGURATIONS(X)                                     \
+    X(5, 2)                                                                \
+    X(5, 3)                                                                \
+    X(5, 4)                                                                \
+    X(5, 5)                                                                \
+    X(10, 2)                                                               \
+    X(10, 3)                                                               \
+    X(10, 4)                                                               \
+    X(10, 5)                                                               \
+    X(20, 2)                                                               \
+    X(20, 3)                                                               \
+    X(20, 4)                                                               \
+    X(20, 5)
+
+//======================================================================
+//
+// An IncrementalDBSCAN in integer ticks with the Euclidean metric,
+// behind a virtual interface, so that the specialisation can be
+// picked at run time
+class StreamingDBSCAN
+{
+public:
+    virtual ~StreamingDBSCAN() {}
+
+    virtual void add_point(
+        tick_t time,
+        int channel,
+        std::vector<Cluster<tick_t>>* completed_clusters = nullptr) = 0;
+
+    // Add `n` hits, with times `times[i]` and channels `channels[i]`,
+    // in time order. Costs one virtual call for all of them
+    virtual void add_points(
+        const tick_t* times,
+        const int* channels,
+        size_t n,
+        std::vector<Cluster<tick_t>>* completed_clusters = nullptr) = 0;
+
+    // Add the `n` hits in the array `hits`, which are owned by the
+    // caller, in time order. As with IncrementalDBSCAN::add_hit(), the
+    // hits must stay valid until they've been trimmed and any cluster
+    // containing them has been completed
+    virtual void add_hits(
+        Hit<tick_t>* hits,
+        size_t n,
+        std::vector<Cluster<tick_t>>* completed_clusters = nullptr) = 0;
+
+    // See IncrementalDBSCAN::advance_time() and flush()
+    virtual void advance_time(
+        tick_t time,
+        std::vector<Cluster<tick_t>>* completed_clusters = nullptr) = 0;
+    virtual void flush(
+        std::vector<Cluster<tick_t>>* completed_clusters = nullptr) = 0;
+
+    virtual void set_trim_margin(tick_t margin) = 0;
+
+    // See IncrementalDBSCAN::save_state() and restore_state()
+    virtual bool save_state(std::ostream& os) const = 0;
+    virtual bool restore_state(std::istream& is) = 0;
+
+    // See IncrementalDBSCAN::memory_usage() and peak_memory_usage()
+    virtual MemoryUsage memory_usage() const = 0;
+    virtual MemoryUsage peak_memory_usage() const = 0;
+
+    // True if eps and minPts are compile-time constants in this
+    // instance
+    virtual bool is_specialised() const = 0;
+};
+
+//======================================================================
+//
+// Make an IncrementalDBSCAN for `eps` and `minPts`. If they're one of
+// DBSCAN_FIXED_CONFIGURATIONS, and `allow_specialised` is true, the
+// result has them fixed at compile time. Otherwise it's the general
+// version
+std::unique_ptr<StreamingDBSCAN>
+make_incremental_dbscan(tick_t eps,
+                        unsigned int minPts,
+                        size_t pool_size = 100000,
+                        bool allow_specialised = true);
+
+// The same, for weighted DBSCAN: a hit is core if the total charge of
+// its neighbourhood, including itself, is at least `min_charge`. This
+// one is never specialised
+std::unique_ptr<StreamingDBSCAN>
+make_weighted_incremental_dbscan(tick_t eps,
+                                 double min_charge,
+                                 size_t pool_size = 100000);
+
+}
+
+// Local Variables:
+// mode: c++
+// c-basic-offset: 4
+// c-file-style: "linux"
+// End:
@@ -0,0 +1,288 @@
+#include "dbscan_grid.hpp"
+
+#include "Hit.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <functional>
+#include <thread>
+#include <type_traits>
+#include <unordered_map>
+
+namespace dbscan {
+
+namespace {
+
+//======================================================================
+//
+// floor(x / width), as an integer
+template<class T>
+int64_t
+cell_index(T x, T width)
+{
+    if constexpr (std::is_integral<T>::value) {
+        int64_t q = x / width;
+        if (x % width != 0 && ((x < 0) != (width < 0)))
+            --q;
+        return q;
+    } else {
+        return int64_t(std::floor(x / width));
+    }
+}
+
+//======================================================================
+//
+// A uniform grid over (time, channel), storing the indices of the hits
+// in each cell. Cells are `time_width` by `chan_width`, so all of a
+// hit's neighbours are in its own cell or one of the eight around it
+template<class T>
+class HitGrid
+{
+public:
+    HitGrid(const std::vector<Hit<T>*>& hits, T time_width, T chan_width)
+        : m_time_width(time_width)
+        , m_chan_width(chan_width)
+    {
+        std::vector<CellKey> keys;
+        keys.reserve(hits.size());
+        for (auto const& h : hits) {
+            keys.push_back(key(*h));
+        }
+
+        // Group the hit indices by cell, then record where each
+        // cell's run starts
+        m_order.resize(hits.size());
+        for (size_t i = 0; i < hits.size(); ++i) {
+            m_order[i] = i;
+        }
+        std::sort(m_order.begin(), m_order.end(), [&](uint32_t a, uint32_t b) {
+            return keys[a] < keys[b];
+        });
+
+        m_cells.reserve(hits.size());
+        size_t run_start = 0;
+        for (size_t i = 1; i <= m_order.size(); ++i) {
+            if (i == m_order.size() ||
+                keys[m_order[i]] != keys[m_order[run_start]]) {
+                m_cells[keys[m_order[run_start]]] = { uint32_t(run_start),
+                                                      uint32_t(i) };
+                run_start = i;
+            }
+        }
+    }
+
+    // Call f(j) for the index j of every hit in the 3x3 block of cells
+    // around `q`, including q itself
+    template<class F>
+    void for_each_candidate(const Hit<T>& q, F&& f) const
+    {
+        CellKey centre = key(q);
+        for (int64_t dt = -1; dt <= 1; ++dt) {
+            for (int64_t dc = -1; dc <= 1; ++dc) {
+                auto it = m_cells.find({ centre.t + dt, centre.c + dc });
+                if (it == m_cells.end())
+                    continue;
+                for (uint32_t k = it->second.first; k < it->second.second;
+                     ++k) {
+                    f(m_order[k]);
+                }
+            }
+        }
+    }
+
+private:
+    struct CellKey
+    {
+        int64_t t, c;
+        bool operator==(const CellKey& o) const { return t == o.t && c == o.c; }
+        bool operator!=(const CellKey& o) const { return !(*this == o); }
+        bool operator<(const CellKey& o) const
+        {
+            return t < o.t || (t == o.t && c < o.c);
+        }
+    };
+
+    struct CellKeyHash
+    {
+        size_t operator()(const CellKey& k) const
+        {
+            return std::hash<int64_t>()(k.t * 0x9e3779b97f4a7c15ULL ^ k.c);
+        }
+    };
+
+    CellKey key(const Hit<T>& h) const
+    {
+        return { cell_index(h.time, m_time_width),
+                 cell_index(T(h.chan), m_chan_width) };
+    }
+
+    T m_time_width, m_chan_width;
+    // Hit indices, grouped by cell
+    std::vector<uint32_t> m_order;
+    // The [begin, end) range in m_order of each non-empty cell
+    std::unordered_map<CellKey, std::pair<uint32_t, uint32_t>, CellKeyHash>
+        m_cells;
+};
+
+//======================================================================
+//
+// The body of dbscan_grid() and dbscan_grid_weighted(). A hit is core
+// if the sum of `weight(h)` over its neighbourhood, including itself,
+// is at least `threshold`
+template<class T, class Metric, class Weight>
+std::vector<Cluster<T>>
+grid_dbscan(std::vector<Hit<T>*>& hits,
+            const Metric& metric,
+            Weight weight,
+            double threshold,
+            unsigned int nthreads)
+{
+    std::vector<Cluster<T>> ret;
+
+    HitGrid<T> grid(hits, metric.time_window(), metric.chan_window());
+
+    // Find all the neighbourhood weights up front. Like dbscan_orig, a
+    // hit counts as its own neighbour. This is the expensive part, and
+    // each hit is independent, so split it across threads
+    std::vector<double> counts(hits.size());
+    auto count_range = [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i) {
+            const Hit<T>& q = *hits[i];
+            double n = 0;
+            grid.for_each_candidate(q, [&](uint32_t j) {
+                if (metric.is_neighbour(q, *hits[j]))
+                    n += weight(*hits[j]);
+            });
+            counts[i] = n;
+        }
+    };
+
+    if (nthreads == 0)
+        nthreads = std::max(1u, std::thread::hardware_concurrency());
+    std::vector<std::thread> threads;
+    size_t chunk = (hits.size() + nthreads - 1) / nthreads;
+    for (size_t begin = 0; begin < hits.size(); begin += chunk) {
+        threads.emplace_back(
+            count_range, begin, std::min(begin + chunk, hits.size()));
+    }
+    for (auto& t : threads) {
+        t.join();
+    }
+
+    auto neighbours_of = [&](uint32_t i, std::vector<uint32_t>& out) {
+        const Hit<T>& q = *hits[i];
+        grid.for_each_candidate(q, [&](uint32_t j) {
+            if (metric.is_neighbour(q, *hits[j]))
+                out.push_back(j);
+        });
+    };
+
+    // From here on, this is dbscan_orig, with hit indices instead of
+    // pointers
+    int clusterIndex = -1; // The index of the current cluster
+    std::vector<uint32_t> seedSet;
+
+    for (uint32_t i = 0; i < hits.size(); ++i) {
+        Hit<T>* p = hits[i];
+        if (p->cluster != kUndefined)
+            continue; // We already did this one
+
+        if (counts[i] < threshold) {
+            // Not enough neighbours to be a core point. Classify as noise (but
+            // we might reclassify later)
+            p->cluster = kNoise;
+            continue;
+        }
+        clusterIndex++;
+        ret.emplace_back(clusterIndex);
+        Cluster<T>& current_cluster = ret.back();
+
+        // Assign this core point to the current cluster
+        current_cluster.add_hit(p);
+        // Seed set is all the neighbours of p except for p
+        seedSet.clear();
+        neighbours_of(i, seedSet);
+        seedSet.erase(std::remove(seedSet.begin(), seedSet.end(), i),
+                      seedSet.end());
+
+        // Loop over all neighbours (and the neighbours of core points, and so
+        // on)
+        while (!seedSet.empty()) {
+            uint32_t j = seedSet.back();
+            seedSet.pop_back();
+            Hit<T>* q = hits[j];
+            // Change noise to a border point
+            if (q->cluster == kNoise)
+                current_cluster.add_hit(q);
+            if (q->cluster != kUndefined)
+                continue;
+            current_cluster.add_hit(q);
+            // If q is a core point, add its neighbours to the search list
+            if (counts[j] >= threshold)
+                neighbours_of(j, seedSet);
+        }
+    }
+
+    for (auto& cluster : ret) {
+        cluster.sort_hits();
+    }
+    return ret;
+}
+
+}
+
+//======================================================================
+template<class T, class Metric>
+std::vector<Cluster<T>>
+dbscan_grid(std::vector<Hit<T>*>& hits,
+            const Metric& metric,
+            unsigned int minPts,
+            unsigned int nthreads)
+{
+    return grid_dbscan(
+        hits, metric, [](const Hit<T>&) { return 1.0; }, minPts, nthreads);
+}
+
+//======================================================================
+template<class T, class Metric>
+std::vector<Cluster<T>>
+dbscan_grid_weighted(std::vector<Hit<T>*>& hits,
+                     const Metric& metric,
+                     double min_charge,
+                     unsigned int nthreads)
+{
+    return grid_dbscan(
+        hits,
+        metric,
+        [](const Hit<T>& h) { return double(h.charge); },
+        min_charge,
+        nthreads);
+}
+
+#define DBSCAN_GRID_INSTANTIATE_METRIC(T, M)                              \
+    template std::vector<Cluster<T>> dbscan_grid(                         \
+        std::vector<Hit<T>*>&, const M<T>&, unsigned int, unsigned int);   \
+    template std::vector<Cluster<T>> dbscan_grid_weighted(                \
+        std::vector<Hit<T>*>&, const M<T>&, double, unsigned int);
+
+#define DBSCAN_GRID_INSTANTIATE(T)                                        \
+    DBSCAN_GRID_INSTANTIATE_METRIC(T, EuclideanMetric)                    \
+    DBSCAN_GRID_INSTANTIATE_METRIC(T, ManhattanMetric)                    \
+    DBSCAN_GRID_INSTANTIATE_METRIC(T, ChebyshevMetric)                    \
+    DBSCAN_GRID_INSTANTIATE_METRIC(T, AnisotropicEuclideanMetric)          \
+    DBSCAN_GRID_INSTANTIATE_METRIC(T, AnisotropicBoxMetric)
+
+DBSCAN_GRID_INSTANTIATE(float)
+DBSCAN_GRID_INSTANTIATE(tick_t)
+
+#undef DBSCAN_GRID_INSTANTIATE
+#undef DBSCAN_GRID_INSTANTIATE_METRIC
+
+}
+
+// Local Variables:
+// mode: c++
+// c-basic-offset: 4
+// c-file-style: "linux"
+// End:
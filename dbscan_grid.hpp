@@ -0,0 +1,46 @@
+#pragma once
+
+#include "dbscan.hpp"
+
+#include <vector>
+
+namespace dbscan {
+
+//======================================================================
+//
+// Batch DBSCAN with the same semantics as dbscan_orig, for validating
+// IncrementalDBSCAN on large inputs. Instead of scanning every hit for
+// each neighbour query, the hits are binned in a uniform grid with
+// cells the size of the metric's time and channel windows, so only the
+// 3x3 block of cells around a hit needs to be searched. The neighbour
+// counts (which decide which hits are core) are found in parallel over
+// `nthreads` threads (0 means one per hardware thread); the cluster
+// expansion itself is serial, visiting hits in the same order as
+// dbscan_orig so that cluster numbering and border-hit assignment
+// are identical
+template<class T, class Metric>
+std::vector<Cluster<T>>
+dbscan_grid(std::vector<Hit<T>*>& hits,
+            const Metric& metric,
+            unsigned int minPts,
+            unsigned int nthreads = 0);
+
+//======================================================================
+//
+// The same, for weighted DBSCAN: a hit is core if the total charge of
+// its neighbourhood, including itself, is at least `min_charge` (like
+// IncrementalDBSCAN with the MinCharge criterion)
+template<class T, class Metric>
+std::vector<Cluster<T>>
+dbscan_grid_weighted(std::vector<Hit<T>*>& hits,
+                     const Metric& metric,
+                     double min_charge,
+                     unsigned int nthreads = 0);
+
+}
+
+// Local Variables:
+// mode: c++
+// c-basic-offset: 4
+// c-file-style: "linux"
+// End:
@@ -5,22 +5,26 @@
 #include <cassert>
 
 namespace dbscan {
-std::vector<Hit*>
-neighbours(const std::vector<Hit*>& hits, const Hit& q, float eps)
+template<class T, class Metric>
+std::vector<Hit<T>*>
+neighbours(const std::vector<Hit<T>*>& hits, const Hit<T>& q, const Metric& metric)
 {
-    std::vector<Hit*> ret;
+    std::vector<Hit<T>*> ret;
     for (auto const& hit : hits) {
-        if (euclidean_distance(*hit, q) < eps) {
+        // Use the same neighbour test as IncrementalDBSCAN, so that
+        // the results are exactly comparable
+        if (metric.is_neighbour(*hit, q)) {
             ret.push_back(hit);
         }
     }
     return ret;
 }
-    
-std::vector<Cluster>
-dbscan_orig(std::vector<Hit*>& hits, float eps, unsigned int minPts)
+
+template<class T, class Metric>
+std::vector<Cluster<T>>
+dbscan_orig(std::vector<Hit<T>*>& hits, const Metric& metric, unsigned int minPts)
 {
-    std::vector<Cluster> ret;
+    std::vector<Cluster<T>> ret;
 
     int clusterIndex = -1; // The index of the current cluster
 
@@ -28,7 +32,7 @@ dbscan_orig(std::vector<Hit*>& hits, float eps, unsigned int minPts)
         if (p->cluster != kUndefined)
             continue; // We already did this one
 
-        std::vector<Hit*> nbr = neighbours(hits, *p, eps);
+        std::vector<Hit<T>*> nbr = neighbours(hits, *p, metric);
 
         if (nbr.size() < minPts) {
             // Not enough neighbours to be a core point. Classify as noise (but
@@ -38,13 +42,13 @@ dbscan_orig(std::vector<Hit*>& hits, float eps, unsigned int minPts)
         }
         clusterIndex++;
         ret.emplace_back(clusterIndex);
-        Cluster& current_cluster = ret.back();
+        Cluster<T>& current_cluster = ret.back();
 
         // Assign this core point to the current cluster
         p->cluster = clusterIndex;
         current_cluster.add_hit(p);
         // Seed set is all the neighbours of p except for p
-        std::vector<Hit*> seedSet;
+        std::vector<Hit<T>*> seedSet;
         for (auto const& n : nbr) {
             if (n != p) {
                 seedSet.push_back(n);
@@ -59,23 +63,50 @@ dbscan_orig(std::vector<Hit*>& hits, float eps, unsigned int minPts)
         // Loop over all neighbours (and the neighbours of core points, and so
         // on)
         while (!seedSet.empty()) {
-            Hit* q = seedSet.back();
+            Hit<T>* q = seedSet.back();
             seedSet.pop_back();
-            // Change noise to a border point
-            if (q->cluster == kNoise)
+            // Change noise to a border point. It has to go in the
+            // cluster's list of hits too, not just get relabelled
+            if (q->cluster == kNoise) {
                 q->cluster = clusterIndex;
+                current_cluster.add_hit(q);
+            }
             if (q->cluster != kUndefined)
                 continue;
             q->cluster = clusterIndex;
             current_cluster.add_hit(q);
             // Neighbours of q
-            std::vector<Hit*> nbrq = neighbours(hits, *q, eps);
+            std::vector<Hit<T>*> nbrq = neighbours(hits, *q, metric);
             // If q is a core point, add its neighbours to the search list
             if (nbrq.size() >= minPts)
                 seedSet.insert(seedSet.end(), nbrq.begin(), nbrq.end());
         }
     }
+    // The clusters' hits are appended in the order we found them, so
+    // put them in time order to match IncrementalDBSCAN's output
+    for (auto& cluster : ret) {
+        cluster.sort_hits();
+    }
     return ret;
 }
 
+#define DBSCAN_ORIG_INSTANTIATE_METRIC(T, M)                              \
+    template std::vector<Hit<T>*> neighbours(                             \
+        const std::vector<Hit<T>*>&, const Hit<T>&, const M<T>&);         \
+    template std::vector<Cluster<T>> dbscan_orig(                         \
+        std::vector<Hit<T>*>&, const M<T>&, unsigned int);
+
+#define DBSCAN_ORIG_INSTANTIATE(T)                                        \
+    DBSCAN_ORIG_INSTANTIATE_METRIC(T, EuclideanMetric)                    \
+    DBSCAN_ORIG_INSTANTIATE_METRIC(T, ManhattanMetric)                    \
+    DBSCAN_ORIG_INSTANTIATE_METRIC(T, ChebyshevMetric)                    \
+    DBSCAN_ORIG_INSTANTIATE_METRIC(T, AnisotropicEuclideanMetric)          \
+    DBSCAN_ORIG_INSTANTIATE_METRIC(T, AnisotropicBoxMetric)
+
+DBSCAN_ORIG_INSTANTIATE(float)
+DBSCAN_ORIG_INSTANTIATE(tick_t)
+
+#undef DBSCAN_ORIG_INSTANTIATE
+#undef DBSCAN_ORIG_INSTANTIATE_METRIC
+
 }
@@ -6,18 +6,20 @@
 
 namespace dbscan {
 
-class Hit;
 //======================================================================
 //
-// Find all of the eps-neighbours of hit `q` in `hits`
-std::vector<Hit*>
-neighbours(const std::vector<Hit*>& hits, const Hit& q, float eps);
+// Find all of the neighbours of hit `q` in `hits` according to
+// `metric` (see metrics.hpp)
+template<class T, class Metric>
+std::vector<Hit<T>*>
+neighbours(const std::vector<Hit<T>*>& hits, const Hit<T>& q, const Metric& metric);
 
 //======================================================================
 //
 // The original DBSCAN algorithm, transcribed from Wikipedia. Makes no
 // assumptions on the sorting or otherwise of the input hits vector
-std::vector<Cluster>
-dbscan_orig(std::vector<Hit*>& hits, float eps, unsigned int minPts);
+template<class T, class Metric>
+std::vector<Cluster<T>>
+dbscan_orig(std::vector<Hit<T>*>& hits, const Metric& metric, unsigned int minPts);
 
 }
@@ -0,0 +1,475 @@
+#include "Hit.hpp"
+#include "Point.hpp"
+#include "read_hits.hpp"
+
+#include "dbscan.hpp"
+#include "dbscan_grid.hpp"
+#include "cluster_compare.hpp"
+#include "HitArena.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <iostream>
+#include <mutex>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "CLI11.hpp"
+
+// Differential tester: runs IncrementalDBSCAN and the batch
+// dbscan_grid side by side over a grid of parameters, on chunks of a
+// hit file and/or synthetic scenarios, and shrinks any divergence down
+// to a small set of hits that reproduces it
+
+using dbscan::tick_t;
+
+//======================================================================
+//
+// A set of hits to test on: a chunk of the input file, or a synthetic
+// scenario. The points are sorted by time
+struct Dataset
+{
+    std::string name;
+    std::vector<Point> points;
+};
+
+//======================================================================
+//
+// One comparison to run, and its outcome
+struct Job
+{
+    Job(const Dataset* _dataset,
+        const std::string& _metric,
+        tick_t _eps,
+        int _minPts,
+        float _min_charge = 0)
+        : dataset(_dataset)
+        , metric(_metric)
+        , eps(_eps)
+        , minPts(_minPts)
+        , min_charge(_min_charge)
+    {
+    }
+
+    // The core criterion, for printing
+    std::string core_option() const
+    {
+        std::ostringstream os;
+        if (min_charge > 0)
+            os << "--min-charge " << min_charge;
+        else
+            os << "-m " << minPts;
+        return os.str();
+    }
+
+    const Dataset* dataset;
+    std::string metric;
+    tick_t eps;
+    int minPts;
+    // If nonzero, compare weighted DBSCAN with this minimum
+    // neighbourhood charge instead of minPts
+    float min_charge;
+
+    bool identical{ true };
+    size_t n_clusters{ 0 };
+    double adjusted_rand_index{ 1 };
+    size_t n_unmatched{ 0 };
+    // The file holding the shrunk reproducer, and how many hits it has
+    std::string repro_filename;
+    size_t repro_size{ 0 };
+};
+
+//======================================================================
+void
+sort_points(std::vector<Point>& points)
+{
+    // Single-threaded, since this runs on the worker threads
+    sort_points_by_time(points, 1);
+}
+
+//======================================================================
+//
+// Generate `nhits` hits (roughly) of the synthetic scenario `kind`:
+//
+//   noise       Uniformly scattered isolated hits
+//   tracks      Straight lines of hits on consecutive channels
+//   showers     Dense Gaussian blobs
+//   coincident  Groups of hits at identical times on neighbouring
+//               channels, including exact duplicates
+//   mixed       All of the above, overlaid
+//   charged     The mixed scenario, with charges spread over two
+//               orders of magnitude, for testing weighted DBSCAN
+std::vector<Point>
+make_scenario(const std::string& kind, size_t nhits, uint64_t seed)
+{
+    std::mt19937_64 rng(seed);
+    std::uniform_int_distribution<int> chan_dist(0, 2000);
+    std::vector<Point> points;
+    int64_t t = 0;
+
+    auto uniform = [&](int a, int b) {
+        return std::uniform_int_distribution<int>(a, b)(rng);
+    };
+
+    if (kind == "noise") {
+        while (points.size() < nhits) {
+            t += uniform(0, 4);
+            points.push_back({ chan_dist(rng), t });
+        }
+    } else if (kind == "tracks") {
+        while (points.size() < nhits) {
+            t += uniform(0, 40);
+            int chan = chan_dist(rng);
+            int64_t track_t = t;
+            int length = uniform(3, 60);
+            for (int i = 0; i < length; ++i) {
+                points.push_back({ chan + i, track_t });
+                track_t += uniform(0, 4);
+            }
+        }
+    } else if (kind == "showers") {
+        std::normal_distribution<double> spread(0, 1);
+        while (points.size() < nhits) {
+            t += uniform(50, 500);
+            int chan = chan_dist(rng);
+            int size = uniform(10, 400);
+            for (int i = 0; i < size; ++i) {
+                points.push_back({ chan + int(5 * spread(rng)),
+                                   t + std::abs(int64_t(20 * spread(rng))) });
+            }
+        }
+    } else if (kind == "coincident") {
+        while (points.size() < nhits) {
+            t += uniform(0, 20);
+            int chan = chan_dist(rng);
+            int size = uniform(1, 6);
+            for (int i = 0; i < size; ++i) {
+                points.push_back({ chan + uniform(0, 3), t });
+            }
+        }
+    } else if (kind == "mixed") {
+        for (const char* k : { "noise", "tracks", "showers", "coincident" }) {
+            auto sub = make_scenario(k, nhits / 4, rng());
+            points.insert(points.end(), sub.begin(), sub.end());
+        }
+    } else if (kind == "charged") {
+        points = make_scenario("mixed", nhits, rng());
+        std::exponential_distribution<float> charge_dist(0.2);
+        for (auto& p : points) {
+            p.charge = std::min(1 + std::round(charge_dist(rng)), 100.f);
+        }
+    }
+
+    sort_points(points);
+    return points;
+}
+
+//======================================================================
+//
+// Cluster `points` with both algorithms and compare the results. If
+// `min_charge` is nonzero, run weighted DBSCAN with it instead of
+// minPts
+template<class Metric>
+dbscan::ClusterComparison<tick_t>
+compare_with(const std::vector<Point>& points,
+             const Metric& metric,
+             int minPts,
+             float min_charge)
+{
+    dbscan::HitArena<tick_t> arena;
+    auto hits = arena.make_hits(points);
+    std::vector<dbscan::Cluster<tick_t>> clusters;
+
+    // Make the pool big enough that none of the hits in the completed
+    // clusters get reused. The clusters point into the pool, so compare
+    // them before it goes away
+    if (min_charge > 0) {
+        auto reference =
+            dbscan::dbscan_grid_weighted(hits, metric, min_charge, 1);
+        dbscan::IncrementalDBSCAN<tick_t, Metric, dbscan::MinCharge> dbscanner(
+            metric, dbscan::MinCharge(min_charge), points.size() + 1);
+        for (auto const& p : points) {
+            dbscanner.add_point_with_charge(
+                p.time, p.chan, p.charge, &clusters, nullptr);
+        }
+        dbscanner.flush(&clusters);
+        return dbscan::compare_clusters(reference, clusters);
+    }
+
+    auto reference = dbscan::dbscan_grid(hits, metric, minPts, 1);
+    dbscan::IncrementalDBSCAN<tick_t, Metric> dbscanner(
+        metric, minPts, points.size() + 1);
+    for (auto const& p : points) {
+        dbscanner.add_point(p.time, p.chan, &clusters);
+    }
+    dbscanner.flush(&clusters);
+    return dbscan::compare_clusters(reference, clusters);
+}
+
+//======================================================================
+dbscan::ClusterComparison<tick_t>
+compare(const std::vector<Point>& points, const Job& job)
+{
+    const tick_t eps = job.eps;
+    const int minPts = job.minPts;
+    const float q = job.min_charge;
+    if (job.metric == "manhattan")
+        return compare_with(
+            points, dbscan::ManhattanMetric<tick_t>(eps), minPts, q);
+    if (job.metric == "chebyshev")
+        return compare_with(
+            points, dbscan::ChebyshevMetric<tick_t>(eps), minPts, q);
+    if (job.metric == "ellipse")
+        return compare_with(
+            points, dbscan::AnisotropicEuclideanMetric<tick_t>(eps), minPts, q);
+    if (job.metric == "box")
+        return compare_with(
+            points, dbscan::AnisotropicBoxMetric<tick_t>(eps), minPts, q);
+    return compare_with(
+        points, dbscan::EuclideanMetric<tick_t>(eps), minPts, q);
+}
+
+//======================================================================
+//
+// Find a small subset of `points` on which the algorithms still
+// disagree. First cut down to a time window around the first
+// mismatched cluster, then repeatedly try removing contiguous chunks
+// (a simplified delta debugging), using at most `max_tests` runs
+std::vector<Point>
+shrink(std::vector<Point> points,
+       const dbscan::ClusterComparison<tick_t>& comparison,
+       const Job& job,
+       size_t max_tests)
+{
+    auto diverges = [&](const std::vector<Point>& p) {
+        return !compare(p, job).identical;
+    };
+    size_t tests = 0;
+
+    if (!comparison.mismatches.empty()) {
+        tick_t t0 = comparison.mismatches.front().first_time;
+        for (tick_t width = 4 * job.eps; tests < max_tests; width *= 4) {
+            std::vector<Point> window;
+            for (auto const& p : points) {
+                if (p.time >= t0 - width && p.time <= t0 + width)
+                    window.push_back(p);
+            }
+            if (window.size() == points.size())
+                break;
+            ++tests;
+            if (diverges(window)) {
+                points.swap(window);
+                break;
+            }
+        }
+    }
+
+    size_t n = 2;
+    while (points.size() >= 2 && tests < max_tests) {
+        size_t chunk = (points.size() + n - 1) / n;
+        bool reduced = false;
+        for (size_t begin = 0; begin < points.size() && tests < max_tests;
+             begin += chunk) {
+            std::vector<Point> candidate(points.begin(), points.begin() + begin);
+            candidate.insert(
+                candidate.end(),
+                points.begin() + std::min(begin + chunk, points.size()),
+                points.end());
+            ++tests;
+            if (diverges(candidate)) {
+                points.swap(candidate);
+                n = std::max<size_t>(n - 1, 2);
+                reduced = true;
+                break;
+            }
+        }
+        if (!reduced) {
+            if (n >= points.size())
+                break;
+            n = std::min(points.size(), 2 * n);
+        }
+    }
+    return points;
+}
+
+//======================================================================
+int
+main(int argc, char** argv)
+{
+    CLI::App cliapp{ "Compare incremental and batch DBSCAN over many "
+                     "datasets and parameters" };
+
+    std::string filename;
+    cliapp.add_option("-f,--file", filename, "Input file of hits");
+    int nhits = -1;
+    cliapp.add_option(
+        "-n,--nhits", nhits, "Maximum number of hits to read from file");
+    size_t chunk_size = 20000;
+    cliapp.add_option(
+        "-c,--chunk", chunk_size, "Number of hits in each chunk of the file");
+    std::vector<std::string> scenarios;
+    cliapp
+        .add_option("--synthetic",
+                    scenarios,
+                    "Synthetic scenarios to test: noise, tracks, showers, "
+                    "coincident, mixed, charged")
+        ->delimiter(',')
+        ->check(CLI::IsMember({ "noise",
+                                "tracks",
+                                "showers",
+                                "coincident",
+                                "mixed",
+                                "charged" }));
+    size_t synthetic_hits = 20000;
+    cliapp.add_option("--synthetic-hits",
+                      synthetic_hits,
+                      "Number of hits in each synthetic scenario");
+    uint64_t seed = 1;
+    cliapp.add_option("--seed", seed, "Random seed for synthetic scenarios");
+    std::vector<tick_t> eps_list{ 5, 10 };
+    cliapp.add_option("-d,--distance", eps_list, "Distance thresholds to test")
+        ->delimiter(',');
+    std::vector<int> minpts_list{ 2, 3, 5 };
+    cliapp.add_option("-m,--minpts", minpts_list, "minPts values to test")
+        ->delimiter(',');
+    std::vector<float> min_charge_list;
+    cliapp
+        .add_option("--min-charge",
+                    min_charge_list,
+                    "Minimum neighbourhood charges to test weighted DBSCAN "
+                    "with, as well as the minPts values")
+        ->delimiter(',');
+    std::vector<std::string> metrics{ "euclidean" };
+    cliapp
+        .add_option("--metric",
+                    metrics,
+                    "Distance metrics to test: euclidean, manhattan, "
+                    "chebyshev, ellipse, box")
+        ->delimiter(',')
+        ->check(CLI::IsMember(
+            { "euclidean", "manhattan", "chebyshev", "ellipse", "box" }));
+    unsigned int nthreads = 0;
+    cliapp.add_option("-j,--threads",
+                      nthreads,
+                      "Number of threads (default: one per hardware thread)");
+    std::string repro_prefix = "difftest-repro";
+    cliapp.add_option("--repro-prefix",
+                      repro_prefix,
+                      "Filename prefix for the reproducing hit sets");
+    size_t max_shrink_tests = 500;
+    cliapp.add_option("--max-shrink-tests",
+                      max_shrink_tests,
+                      "Maximum number of runs used to shrink each divergence");
+
+    CLI11_PARSE(cliapp, argc, argv);
+
+    std::vector<Dataset> datasets;
+    if (filename != "") {
+        auto points = get_points(filename, nhits, 0);
+        sort_points(points);
+        for (size_t begin = 0; begin < points.size(); begin += chunk_size) {
+            size_t end = std::min(begin + chunk_size, points.size());
+            std::ostringstream name;
+            name << filename << "[" << begin << ":" << end << "]";
+            datasets.push_back(
+                { name.str(),
+                  std::vector<Point>(points.begin() + begin,
+                                     points.begin() + end) });
+        }
+    }
+    for (size_t i = 0; i < scenarios.size(); ++i) {
+        datasets.push_back({ scenarios[i],
+                             make_scenario(scenarios[i], synthetic_hits, seed + i) });
+    }
+    if (datasets.empty()) {
+        std::cerr << "Nothing to test: give an input file and/or synthetic "
+                     "scenarios"
+                  << std::endl;
+        return 1;
+    }
+
+    std::vector<Job> jobs;
+    for (auto const& dataset : datasets) {
+        for (auto const& metric : metrics) {
+            for (auto eps : eps_list) {
+                for (auto minPts : minpts_list) {
+                    jobs.emplace_back(&dataset, metric, eps, minPts);
+                }
+                for (auto min_charge : min_charge_list) {
+                    jobs.emplace_back(&dataset, metric, eps, 0, min_charge);
+                }
+            }
+        }
+    }
+
+    std::cout << "Running " << jobs.size() << " comparisons" << std::endl;
+
+    std::atomic<size_t> next_job{ 0 };
+    std::atomic<size_t> n_failed{ 0 };
+    std::mutex output_mutex;
+    auto worker = [&]() {
+        for (size_t i = next_job++; i < jobs.size(); i = next_job++) {
+            Job& job = jobs[i];
+            const auto& points = job.dataset->points;
+            auto comparison = compare(points, job);
+            job.identical = comparison.identical;
+            job.n_clusters = comparison.n_clusters1;
+            job.adjusted_rand_index = comparison.adjusted_rand_index;
+            job.n_unmatched = comparison.n_unmatched1 + comparison.n_unmatched2;
+
+            if (!job.identical) {
+                size_t n = ++n_failed;
+                auto repro = shrink(points, comparison, job, max_shrink_tests);
+                std::ostringstream name;
+                name << repro_prefix << "-" << n << ".txt";
+                job.repro_filename = name.str();
+                job.repro_size = repro.size();
+                write_points(job.repro_filename, repro);
+            }
+
+            std::lock_guard<std::mutex> lock(output_mutex);
+            std::cout << (job.identical ? "  ok    " : "  FAIL  ")
+                      << job.dataset->name << " metric=" << job.metric
+                      << " eps=" << job.eps << " " << job.core_option()
+                      << std::endl;
+        }
+    };
+
+    if (nthreads == 0)
+        nthreads = std::max(1u, std::thread::hardware_concurrency());
+    std::vector<std::thread> threads;
+    for (unsigned int i = 0; i < nthreads; ++i) {
+        threads.emplace_back(worker);
+    }
+    for (auto& t : threads) {
+        t.join();
+    }
+
+    std::cout << std::endl
+              << (jobs.size() - n_failed) << " of " << jobs.size()
+              << " comparisons identical" << std::endl;
+    for (auto const& job : jobs) {
+        if (job.identical)
+            continue;
+        std::cout << job.dataset->name << " metric=" << job.metric
+                  << " eps=" << job.eps << " " << job.core_option() << ": "
+                  << job.n_unmatched << " unmatched clusters, ARI="
+                  << job.adjusted_rand_index << std::endl
+                  << "  reproduce with " << job.repro_size << " hits: "
+                  << "run_dbscan -t -f " << job.repro_filename
+                  << " --metric " << job.metric << " -d " << job.eps
+                  << " " << job.core_option() << std::endl;
+    }
+
+    return n_failed ? 1 : 0;
+}
+
+// Local Variables:
+// mode: c++
+// c-basic-offset: 4
+// c-file-style: "linux"
+// End:
@@ -12,8 +12,9 @@
 #include <map>
 
 namespace dbscan {
+template<class T>
 TCanvas*
-draw_clusters(const std::vector<Cluster>& clusters, const std::vector<Point>& points)
+draw_clusters(const std::vector<Cluster<T>>& clusters, const std::vector<Point>& points)
 {
     TCanvas* c = new TCanvas;
     
@@ -89,6 +90,11 @@ draw_clusters(const std::vector<Cluster>& clusters, const std::vector<Point>& po
     return c;
 }
 
+template TCanvas*
+draw_clusters(const std::vector<Cluster<float>>&, const std::vector<Point>&);
+template TCanvas*
+draw_clusters(const std::vector<Cluster<tick_t>>&, const std::vector<Point>&);
+
 }
 // Local Variables:
 // mode: c++
@@ -8,12 +8,12 @@
 class TCanvas;
 
 namespace dbscan {
-class Hit;
 
 // Draw the clusters in the list. Return the TCanvas in
 // which they're drawn
+template<class T>
 TCanvas*
-draw_clusters(const std::vector<Cluster>& clusters, const std::vector<Point>& points);
+draw_clusters(const std::vector<Cluster<T>>& clusters, const std::vector<Point>& points);
 
 }
 // Local Variables:
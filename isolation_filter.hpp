@@ -0,0 +1,170 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <limits>
+#include <unordered_map>
+#include <vector>
+
+namespace dbscan {
+//======================================================================
+//
+// The time of the latest hit on each channel, for a cheap test of
+// whether a new hit can have any neighbours at all. Hits arrive in time
+// order, so if the latest hit on a channel is too early to be a
+// neighbour, every hit on that channel is. Most hits in real data are
+// isolated noise, and this rejects them in a few array lookups instead
+// of a scan over all the hits in the time window
+//
+// The table covers the range of channels seen so far, and grows at
+// either end as needed, so channel numbers can be negative. It grows by
+// at least its own size at a time, so growing downwards is amortised
+// constant time too. It never spans more than kMaxChannels channels:
+// the hits on channels outside that (eg a corrupt channel number) go
+// in a hash map instead, which is slower but only as big as the number
+// of such channels
+template<class T>
+class IsolationFilter
+{
+public:
+    // The most channels the dense table spans
+    static constexpr long long kMaxChannels = 1 << 20;
+
+    // Record a hit at `time` on channel `chan`. Times must be added in
+    // order
+    void add(T time, int chan)
+    {
+        if (m_last_time.empty()) {
+            m_first_chan = chan;
+            m_last_time.push_back(time);
+            return;
+        }
+        long long first = m_first_chan;
+        long long size = (long long)m_last_time.size();
+        if (chan < first) {
+            long long grow = std::max(first - chan, size);
+            grow = std::min({ grow,
+                              kMaxChannels - size,
+                              first - std::numeric_limits<int>::min() });
+            if (first - chan > grow) {
+                m_outliers[chan] = time;
+                return;
+            }
+            m_last_time.insert(m_last_time.begin(), size_t(grow), kNever);
+            m_first_chan = int(first - grow);
+            take_outliers();
+        } else if (chan - first >= size) {
+            if (chan - first >= kMaxChannels) {
+                m_outliers[chan] = time;
+                return;
+            }
+            m_last_time.resize(size_t(chan - first) + 1, kNever);
+            take_outliers();
+        }
+        m_last_time[size_t(chan - m_first_chan)] = time;
+    }
+
+    // True if no hit recorded so far is within `time_window` in time
+    // and `chan_window` in channel of (time, chan), so that a hit
+    // there can't have any neighbours. Both windows are inclusive, so
+    // the test is conservative for metrics with strict inequalities
+    bool is_isolated(T time, int chan, T time_window, int chan_window) const
+    {
+        if (m_last_time.empty())
+            return true;
+        // In long long so that the window can't overflow, and clamped
+        // to the channels in the table for the scan
+        long long first = m_first_chan;
+        long long last = first + (long long)m_last_time.size() - 1;
+        long long lo = std::max((long long)chan - chan_window,
+                                (long long)std::numeric_limits<int>::min());
+        long long hi = std::min((long long)chan + chan_window,
+                                (long long)std::numeric_limits<int>::max());
+        const T earliest = time - time_window;
+        const long long end = std::min(last, hi);
+        for (long long c = std::max(first, lo); c <= end; ++c) {
+            if (m_last_time[size_t(c - first)] >= earliest)
+                return false;
+        }
+        if (m_outliers.empty() || (lo >= first && hi <= last))
+            return true;
+        return outliers_isolated(lo, hi, earliest);
+    }
+
+    // The bytes allocated for the table and the hash map (roughly, for
+    // the map)
+    size_t memory_bytes() const
+    {
+        return m_last_time.capacity() * sizeof(T) +
+               m_outliers.bucket_count() * sizeof(void*) +
+               m_outliers.size() *
+                 (sizeof(std::pair<const int, T>) + 2 * sizeof(void*));
+    }
+
+    void clear()
+    {
+        m_last_time.clear();
+        m_outliers.clear();
+        m_first_chan = 0;
+    }
+
+private:
+    // is_isolated() for the channels in [lo, hi] outside the table.
+    // Look them up in the hash map, or the other way round if that's
+    // shorter
+    bool outliers_isolated(long long lo, long long hi, T earliest) const
+    {
+        if (hi - lo + 1 > (long long)m_outliers.size()) {
+            for (auto const& [c, t] : m_outliers) {
+                if (c >= lo && c <= hi && t >= earliest)
+                    return false;
+            }
+            return true;
+        }
+        long long first = m_first_chan;
+        long long last = first + (long long)m_last_time.size() - 1;
+        for (long long c = lo; c <= hi; ++c) {
+            if (c >= first && c <= last)
+                continue;
+            auto it = m_outliers.find(int(c));
+            if (it != m_outliers.end() && it->second >= earliest)
+                return false;
+        }
+        return true;
+    }
+
+    // Move any hash map entries that the table now covers into it
+    void take_outliers()
+    {
+        if (m_outliers.empty())
+            return;
+        long long first = m_first_chan;
+        long long last = first + (long long)m_last_time.size() - 1;
+        for (auto it = m_outliers.begin(); it != m_outliers.end();) {
+            if (it->first >= first && it->first <= last) {
+                m_last_time[size_t(it->first - first)] = it->second;
+                it = m_outliers.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+
+    // The time of a channel that hasn't had any hits
+    static constexpr T kNever = std::numeric_limits<T>::lowest();
+
+    // m_last_time[i] is the time of the latest hit on channel
+    // m_first_chan + i
+    std::vector<T> m_last_time;
+    int m_first_chan{ 0 };
+    // The time of the latest hit on each channel outside the table
+    std::unordered_map<int, T> m_outliers;
+};
+
+}
+
+// Local Variables:
+// mode: c++
+// c-basic-offset: 4
+// c-file-style: "linux"
+// End:
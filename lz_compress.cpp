@@ -0,0 +1,169 @@
+#include "lz_compress.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+namespace dbscan {
+
+namespace {
+
+const size_t kMinMatch = 4;
+const size_t kMaxOffset = 65535;
+const int kHashBits = 14;
+
+//======================================================================
+uint32_t
+read32(const uint8_t* p)
+{
+    uint32_t v;
+    std::memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+uint32_t
+hash32(uint32_t v)
+{
+    return (v * 2654435761u) >> (32 - kHashBits);
+}
+
+//======================================================================
+//
+// Write the part of a length that doesn't fit in its token nibble
+void
+write_length(size_t length, std::vector<uint8_t>& out)
+{
+    while (length >= 255) {
+        out.push_back(255);
+        length -= 255;
+    }
+    out.push_back(uint8_t(length));
+}
+
+//======================================================================
+//
+// Write a sequence: the literals [begin, end) of `in`, then a match of
+// `match_length` bytes at `offset` back, or no match if `match_length`
+// is zero (only for the last sequence)
+void
+write_sequence(const uint8_t* begin,
+               const uint8_t* end,
+               size_t offset,
+               size_t match_length,
+               std::vector<uint8_t>& out)
+{
+    size_t n_literals = end - begin;
+    size_t match_code = match_length ? match_length - kMinMatch : 0;
+    out.push_back(uint8_t((std::min<size_t>(n_literals, 15) << 4) |
+                          std::min<size_t>(match_code, 15)));
+    if (n_literals >= 15)
+        write_length(n_literals - 15, out);
+    out.insert(out.end(), begin, end);
+    if (match_length == 0)
+        return;
+    out.push_back(uint8_t(offset & 0xff));
+    out.push_back(uint8_t(offset >> 8));
+    if (match_code >= 15)
+        write_length(match_code - 15, out);
+}
+
+//======================================================================
+//
+// Read the rest of a length whose token nibble was 15. Returns false
+// if the input runs out
+bool
+read_length(const uint8_t*& ip, const uint8_t* end, size_t& length)
+{
+    uint8_t b;
+    do {
+        if (ip == end)
+            return false;
+        b = *ip++;
+        length += b;
+    } while (b == 255);
+    return true;
+}
+
+}
+
+//======================================================================
+void
+lz_compress(const uint8_t* in, size_t n, std::vector<uint8_t>& out)
+{
+    // Positions plus one of the latest four-byte prefix with each
+    // hash, so zero means none
+    std::vector<uint32_t> table(size_t(1) << kHashBits, 0);
+
+    size_t anchor = 0;
+    size_t i = 0;
+    while (i + kMinMatch <= n) {
+        uint32_t prefix = read32(in + i);
+        uint32_t& entry = table[hash32(prefix)];
+        size_t candidate = entry;
+        entry = uint32_t(i + 1);
+        if (candidate != 0 && i - (candidate - 1) <= kMaxOffset &&
+            read32(in + candidate - 1) == prefix) {
+            candidate -= 1;
+            size_t length = kMinMatch;
+            while (i + length < n && in[candidate + length] == in[i + length])
+                ++length;
+            write_sequence(in + anchor, in + i, i - candidate, length, out);
+            i += length;
+            anchor = i;
+        } else {
+            // Step further the longer we go without a match, so
+            // incompressible data goes through quickly
+            i += 1 + ((i - anchor) >> 6);
+        }
+    }
+    write_sequence(in + anchor, in + n, 0, 0, out);
+}
+
+//======================================================================
+bool
+lz_decompress(const uint8_t* in, size_t n, uint8_t* out, size_t out_size)
+{
+    const uint8_t* ip = in;
+    const uint8_t* const end = in + n;
+    size_t op = 0;
+    while (ip != end) {
+        uint8_t token = *ip++;
+        size_t n_literals = token >> 4;
+        if (n_literals == 15 && !read_length(ip, end, n_literals))
+            return false;
+        if (n_literals > size_t(end - ip) || n_literals > out_size - op)
+            return false;
+        std::memcpy(out + op, ip, n_literals);
+        ip += n_literals;
+        op += n_literals;
+
+        // The last sequence has no match
+        if (ip == end)
+            break;
+        if (end - ip < 2)
+            return false;
+        size_t offset = ip[0] | (size_t(ip[1]) << 8);
+        ip += 2;
+        size_t length = token & 15;
+        if (length == 15 && !read_length(ip, end, length))
+            return false;
+        length += kMinMatch;
+        if (offset == 0 || offset > op || length > out_size - op)
+            return false;
+        // The match can overlap the bytes it's producing, so copy a
+        // byte at a time
+        const uint8_t* match = out + op - offset;
+        for (size_t k = 0; k < length; ++k) {
+            out[op + k] = match[k];
+        }
+        op += length;
+    }
+    return op == out_size;
+}
+
+}
+
+// Local Variables:
+// mode: c++
+// c-basic-offset: 4
+// c-file-style: "linux"
+// End:
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace dbscan {
+//======================================================================
+//
+// A fast byte-oriented LZ77 compressor, in the style of LZ4: the
+// output is a series of sequences, each a token byte (literal count
+// and match length, four bits each), any extra length bytes, the
+// literals, and a two-byte offset back to the match. Matches are found
+// with a single hash table of four-byte prefixes, so compression is
+// one pass with no entropy coding. It's meant for data that's already
+// compact but repetitive, such as the varint-coded deltas of a cluster
+// stream
+
+// Append the compressed form of the `n` bytes at `in` to `out`
+void
+lz_compress(const uint8_t* in, size_t n, std::vector<uint8_t>& out);
+
+// Decompress the `n` bytes at `in`, which must decompress to exactly
+// `out_size` bytes, into `out`. Returns false if the input is
+// malformed or the size is wrong, without writing past `out_size`
+bool
+lz_decompress(const uint8_t* in, size_t n, uint8_t* out, size_t out_size);
+
+}
+
+// Local Variables:
+// mode: c++
+// c-basic-offset: 4
+// c-file-style: "linux"
+// End:
@@ -0,0 +1,286 @@
+#pragma once
+
+#include "Hit.hpp"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <limits>
+#include <type_traits>
+
+namespace dbscan {
+//======================================================================
+//
+// Distance-metric policies for IncrementalDBSCAN and dbscan_orig. A
+// policy provides:
+//
+//   time_type          The time type of the hits it compares
+//
+//   is_neighbour(p, q) True if hits p and q are eps-neighbours
+//
+//   time_window()      The largest time separation at which two hits
+//                      can possibly be neighbours. Used to bound the
+//                      search in the time-sorted hit list, to decide
+//                      when hits and clusters are complete, and to
+//                      set the margin kept by trim_hits
+//
+//   chan_window()      The same, for channel separation
+//
+//   time_window(dc)    The largest time separation at which two hits
+//                      `dc` channels apart can be neighbours, for dc
+//                      up to chan_window(). The per-channel neighbour
+//                      indices search each channel only this far.
+//                      For the Manhattan diamond it's eps - dc, and
+//                      for the Euclidean circle sqrt(eps^2 - dc^2).
+//                      The Chebyshev and box neighbourhoods are
+//                      rectangles, so it's time_window() whatever the
+//                      channel, and the ellipse keeps time_window()
+//                      too. The time-ordered index can't use it,
+//                      since it doesn't know a hit's channel until
+//                      it's looked at it
+//
+// The anisotropic policies have separate `eps_time` and `eps_chan`
+// thresholds, and their time window is `eps_time` alone. Channel pitch
+// and time ticks have very different physical scales, so with a
+// single eps the window is usually either much wider than needed or
+// the channel cut too loose
+//
+// All of the functions are inline, so the neighbour search is fully
+// specialised for each policy at compile time. FixedEuclideanMetric
+// goes further, and fixes eps itself at compile time
+
+//======================================================================
+//
+// The time half-width of a circle of radius `eps` at `dc` channels from
+// its centre. It's rounded so that it never cuts off a neighbour
+template<class T>
+inline T
+circle_time_window(T eps, int dc)
+{
+    double d2 = double(eps) * double(eps) - double(dc) * double(dc);
+    if (d2 <= 0)
+        return T(0);
+    double window = std::sqrt(d2);
+    if constexpr (std::is_integral<T>::value) {
+        // A neighbour's time separation is a whole number below window
+        return T(window);
+    } else {
+        T t = T(window);
+        return double(t) < window
+                 ? std::nextafter(t, std::numeric_limits<T>::max())
+                 : t;
+    }
+}
+
+//======================================================================
+//
+// The time half-width of a diamond of radius `eps` at `dc` channels
+// from its centre, rounded the same way
+template<class T>
+inline T
+diamond_time_window(T eps, int dc)
+{
+    double window = double(eps) - double(dc);
+    if (window <= 0)
+        return T(0);
+    if constexpr (std::is_integral<T>::value) {
+        return T(window);
+    } else {
+        T t = T(window);
+        return double(t) < window
+                 ? std::nextafter(t, std::numeric_limits<T>::max())
+                 : t;
+    }
+}
+
+//======================================================================
+template<class T>
+inline T
+chebyshev_distance(const Hit<T>& p, const Hit<T>& q)
+{
+    return std::max(abs_diff(p.time, q.time), T(std::abs(p.chan - q.chan)));
+}
+
+//======================================================================
+//
+// The usual DBSCAN neighbourhood: a circle of radius `eps`
+template<class T>
+struct EuclideanMetric
+{
+    typedef T time_type;
+
+    explicit EuclideanMetric(T eps_)
+        : eps(eps_)
+    {}
+
+    T time_window() const { return eps; }
+    T chan_window() const { return eps; }
+    T time_window(int dc) const { return circle_time_window(eps, dc); }
+
+    bool is_neighbour(const Hit<T>& p, const Hit<T>& q) const
+    {
+        return is_eps_neighbour(p, q, eps);
+    }
+
+    T eps;
+};
+
+//======================================================================
+//
+// EuclideanMetric with eps fixed at compile time as the ratio Num/Den,
+// so the window bounds and the squared-eps comparison are constants.
+// For integer times, eps must be a whole number of ticks
+template<class T, long Num, long Den = 1>
+struct FixedEuclideanMetric
+{
+    static_assert(Num > 0 && Den > 0, "eps must be positive");
+    static_assert(std::is_floating_point<T>::value || Num % Den == 0,
+                  "eps must be a whole number of ticks for integer times");
+
+    typedef T time_type;
+
+    static constexpr T eps = T(Num) / T(Den);
+
+    FixedEuclideanMetric() {}
+
+    // For interchangeability with EuclideanMetric. `eps_` must be eps
+    explicit FixedEuclideanMetric(T eps_)
+    {
+        assert(eps_ == eps);
+        (void)eps_;
+    }
+
+    static constexpr T time_window() { return eps; }
+    static constexpr T chan_window() { return eps; }
+    static T time_window(int dc) { return circle_time_window(eps, dc); }
+
+    bool is_neighbour(const Hit<T>& p, const Hit<T>& q) const
+    {
+        return is_eps_neighbour(p, q, eps);
+    }
+};
+
+//======================================================================
+//
+// A diamond of "radius" `eps`
+template<class T>
+struct ManhattanMetric
+{
+    typedef T time_type;
+
+    explicit ManhattanMetric(T eps_)
+        : eps(eps_)
+    {}
+
+    T time_window() const { return eps; }
+    T chan_window() const { return eps; }
+    T time_window(int dc) const { return diamond_time_window(eps, dc); }
+
+    bool is_neighbour(const Hit<T>& p, const Hit<T>& q) const
+    {
+        return manhattan_distance(p, q) < eps;
+    }
+
+    T eps;
+};
+
+//======================================================================
+//
+// A square of half-width `eps`. No multiplications needed
+template<class T>
+struct ChebyshevMetric
+{
+    typedef T time_type;
+
+    explicit ChebyshevMetric(T eps_)
+        : eps(eps_)
+    {}
+
+    T time_window() const { return eps; }
+    T chan_window() const { return eps; }
+    T time_window(int) const { return eps; }
+
+    bool is_neighbour(const Hit<T>& p, const Hit<T>& q) const
+    {
+        return chebyshev_distance(p, q) < eps;
+    }
+
+    T eps;
+};
+
+//======================================================================
+//
+// An ellipse with semi-axes `eps_time` and `eps_chan`, ie the
+// Euclidean distance after scaling time by 1/eps_time and channel by
+// 1/eps_chan. The comparison is done with both sides multiplied out
+// by eps_time^2*eps_chan^2, so integer times stay exact
+template<class T>
+struct AnisotropicEuclideanMetric
+{
+    typedef T time_type;
+
+    explicit AnisotropicEuclideanMetric(T eps)
+        : eps_time(eps)
+        , eps_chan(eps)
+    {}
+
+    AnisotropicEuclideanMetric(T eps_time_, T eps_chan_)
+        : eps_time(eps_time_)
+        , eps_chan(eps_chan_)
+    {}
+
+    T time_window() const { return eps_time; }
+    T chan_window() const { return eps_chan; }
+    T time_window(int) const { return eps_time; }
+
+    bool is_neighbour(const Hit<T>& p, const Hit<T>& q) const
+    {
+        T dt = abs_diff(p.time, q.time);
+        T dc = T(std::abs(p.chan - q.chan));
+        return dt < eps_time && dc < eps_chan &&
+               sqr(dt * eps_chan) + sqr(dc * eps_time) <
+                   sqr(eps_time * eps_chan);
+    }
+
+    T eps_time, eps_chan;
+};
+
+//======================================================================
+//
+// A rectangle with half-widths `eps_time` and `eps_chan`. The cheapest
+// anisotropic neighbourhood: two comparisons, no multiplications
+template<class T>
+struct AnisotropicBoxMetric
+{
+    typedef T time_type;
+
+    explicit AnisotropicBoxMetric(T eps)
+        : eps_time(eps)
+        , eps_chan(eps)
+    {}
+
+    AnisotropicBoxMetric(T eps_time_, T eps_chan_)
+        : eps_time(eps_time_)
+        , eps_chan(eps_chan_)
+    {}
+
+    T time_window() const { return eps_time; }
+    T chan_window() const { return eps_chan; }
+    T time_window(int) const { return eps_time; }
+
+    bool is_neighbour(const Hit<T>& p, const Hit<T>& q) const
+    {
+        return abs_diff(p.time, q.time) < eps_time &&
+               T(std::abs(p.chan - q.chan)) < eps_chan;
+    }
+
+    T eps_time, eps_chan;
+};
+
+}
+
+// Local Variables:
+// mode: c++
+// c-basic-offset: 4
+// c-file-style: "linux"
+// End:
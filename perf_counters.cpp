@@ -0,0 +1,228 @@
+#include "perf_counters.hpp"
+
+#include <cerrno>
+#include <cstring>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace dbscan {
+
+namespace {
+
+#ifdef __linux__
+//======================================================================
+//
+// The perf_event_attr type and config for each PerfCounters::Event
+struct EventConfig
+{
+    uint32_t type;
+    uint64_t config;
+};
+
+const EventConfig kEventConfigs[PerfCounters::kNEvents] = {
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+    { PERF_TYPE_HW_CACHE,
+      PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+          (PERF_COUNT_HW_CACHE_RESULT_MISS << 16) },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES }
+};
+
+int
+perf_event_open(perf_event_attr* attr, int group_fd)
+{
+    // This thread, on any CPU
+    return int(syscall(SYS_perf_event_open, attr, 0, -1, group_fd, 0));
+}
+#endif
+
+}
+
+//======================================================================
+const char*
+PerfCounters::event_name(int event)
+{
+    switch (event) {
+        case kCycles:
+            return "cycles";
+        case kInstructions:
+            return "instructions";
+        case kL1DMisses:
+            return "L1D misses";
+        case kLLCMisses:
+            return "LLC misses";
+        case kBranchMisses:
+            return "branch misses";
+    }
+    return "unknown";
+}
+
+//======================================================================
+PerfCounters::PerfCounters()
+{
+    m_fds.fill(-1);
+    m_index.fill(-1);
+#ifdef __linux__
+    for (int e = 0; e < kNEvents; ++e) {
+        perf_event_attr attr;
+        std::memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = kEventConfigs[e].type;
+        attr.config = kEventConfigs[e].config;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_GROUP |
+                           PERF_FORMAT_TOTAL_TIME_ENABLED |
+                           PERF_FORMAT_TOTAL_TIME_RUNNING;
+        // The first event that opens leads the group. It starts
+        // disabled, and the others follow it
+        attr.disabled = m_group_fd < 0 ? 1 : 0;
+        int fd = perf_event_open(&attr, m_group_fd);
+        if (fd < 0) {
+            if (m_error.empty())
+                m_error = std::string("perf_event_open failed for ") +
+                          event_name(e) + ": " + std::strerror(errno);
+            continue;
+        }
+        if (m_group_fd < 0)
+            m_group_fd = fd;
+        m_fds[e] = fd;
+        m_index[e] = int(m_n_open++);
+    }
+    if (m_group_fd < 0)
+        return;
+
+    ioctl(m_group_fd, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+    ioctl(m_group_fd, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+
+    // Check that the group can be read. It may well not have been
+    // scheduled on the PMU yet, so whether it runs at all is left to
+    // error(), after some work
+    Counts counts;
+    if (!read(counts)) {
+        m_error = "the counters opened, but couldn't be read";
+        for (int& fd : m_fds) {
+            if (fd >= 0)
+                close(fd);
+            fd = -1;
+        }
+        m_index.fill(-1);
+        m_group_fd = -1;
+        m_n_open = 0;
+        return;
+    }
+    // If every event opened, there's nothing to report
+    if (m_n_open == size_t(kNEvents))
+        m_error.clear();
+#else
+    m_error = "hardware counters are only supported on Linux";
+#endif
+}
+
+//======================================================================
+PerfCounters::~PerfCounters()
+{
+#ifdef __linux__
+    for (int fd : m_fds) {
+        if (fd >= 0)
+            close(fd);
+    }
+#endif
+}
+
+//======================================================================
+const std::string&
+PerfCounters::error() const
+{
+    static const std::string not_scheduled =
+        "the counters opened, but the PMU hasn't scheduled them, so the "
+        "counts are zero (too many events in the group, or in use by "
+        "something else?)";
+    if (available() && !m_scheduled)
+        return not_scheduled;
+    return m_error;
+}
+
+//======================================================================
+bool
+PerfCounters::read(Counts& counts) const
+{
+#ifdef __linux__
+    if (m_group_fd < 0)
+        return false;
+    // The number of events, the times enabled and running, then the
+    // counts
+    uint64_t buf[3 + kNEvents];
+    ssize_t want = ssize_t((3 + m_n_open) * sizeof(uint64_t));
+    if (::read(m_group_fd, buf, sizeof(buf)) != want || buf[0] != m_n_open)
+        return false;
+    if (buf[2] == 0) {
+        // Not scheduled yet, so nothing has been counted
+        counts.fill(0);
+        return true;
+    }
+    m_scheduled = true;
+    // If the group had to share the PMU with other events, it only
+    // counted for part of the time it was enabled. Scale the counts up
+    // to the whole time, as perf does
+    const double scale = buf[2] < buf[1] ? double(buf[1]) / buf[2] : 1;
+    for (int e = 0; e < kNEvents; ++e) {
+        counts[e] =
+            m_index[e] >= 0 ? uint64_t(buf[3 + m_index[e]] * scale) : 0;
+    }
+    return true;
+#else
+    (void)counts;
+    return false;
+#endif
+}
+
+//======================================================================
+const char*
+phase_name(Phase phase)
+{
+    switch (phase) {
+        case Phase::kNeighbourSearch:
+            return "neighbour search";
+        case Phase::kClusterUpdate:
+            return "cluster update";
+        case Phase::kCompletion:
+            return "completion";
+        case Phase::kTrim:
+            return "trim";
+    }
+    return "unknown";
+}
+
+//======================================================================
+void
+PhaseCounters::mark(Phase phase)
+{
+    if (!available())
+        return;
+    PerfCounters::Counts now;
+    if (!m_counters.read(now))
+        return;
+    auto& totals = m_totals[size_t(phase)];
+    for (size_t e = 0; e < now.size(); ++e) {
+        // Scaled counts are estimates, which can step back a little
+        if (now[e] > m_last[e])
+            totals[e] += now[e] - m_last[e];
+    }
+    ++m_n_marks[size_t(phase)];
+    m_last = now;
+}
+
+}
+
+// Local Variables:
+// mode: c++
+// c-basic-offset: 4
+// c-file-style: "linux"
+// End:
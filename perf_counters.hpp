@@ -0,0 +1,140 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+namespace dbscan {
+//======================================================================
+//
+// Hardware performance counters for the calling thread, read with
+// perf_event_open(2): cycles, instructions, L1 data cache read misses,
+// last-level cache misses and branch misses. Only user-space events
+// are counted, so this works with the default perf_event_paranoid
+// setting of 2
+//
+// Any of the events can be missing (eg in a VM, or on a CPU without
+// that event), and all of them are missing when perf_event_open() is
+// unavailable or not permitted, or on systems other than Linux. Then
+// available() or has_event() is false, and the missing counts read as
+// zero, so callers don't need to treat that as an error
+class PerfCounters
+{
+public:
+    enum Event
+    {
+        kCycles,
+        kInstructions,
+        kL1DMisses,
+        kLLCMisses,
+        kBranchMisses,
+        kNEvents
+    };
+
+    typedef std::array<uint64_t, kNEvents> Counts;
+
+    static const char* event_name(int event);
+
+    // Open and start the counters
+    PerfCounters();
+    ~PerfCounters();
+
+    PerfCounters(const PerfCounters&) = delete;
+    PerfCounters& operator=(const PerfCounters&) = delete;
+
+    // True if at least one of the events is being counted
+    bool available() const { return m_group_fd >= 0; }
+    bool has_event(int event) const { return m_index[event] >= 0; }
+    // Why some or all of the counters aren't available, if they
+    // aren't. That includes a group that opened, but hasn't counted
+    // for any of the time it's been enabled as of the last read(), eg
+    // because the PMU can't fit it. Check this after some work
+    const std::string& error() const;
+
+    // Read the counts since the counters were started. If the kernel
+    // multiplexed the counters with other events, the counts are
+    // scaled up by the time enabled over the time running, so they're
+    // estimates. If the group hasn't been scheduled yet, the counts
+    // are zero. Returns false, leaving `counts` alone, if they
+    // couldn't be read
+    bool read(Counts& counts) const;
+
+private:
+    // The group leader's file descriptor, or -1 if nothing is counted
+    int m_group_fd{ -1 };
+    std::array<int, kNEvents> m_fds;
+    // Each event's position in the group's read() output, or -1 if
+    // it's not being counted
+    std::array<int, kNEvents> m_index;
+    size_t m_n_open{ 0 };
+    // Whether any read() has seen the group running
+    mutable bool m_scheduled{ false };
+    std::string m_error;
+};
+
+//======================================================================
+//
+// The parts of IncrementalDBSCAN::add_hit() that PhaseCounters splits
+// the counts between
+enum class Phase
+{
+    // The prefilter check and the search for the new hit's neighbours
+    kNeighbourSearch,
+    // Adding the hit to clusters, starting new ones and merging
+    kClusterUpdate,
+    // The sweep for completed clusters
+    kCompletion,
+    // Dropping old hits from the window
+    kTrim
+};
+
+const size_t kNPhases = 4;
+
+const char* phase_name(Phase phase);
+
+//======================================================================
+//
+// Hardware counter totals for each phase of adding a hit. Call start()
+// at the start of a hit, then mark(phase) at the end of each phase,
+// which adds the counts since the previous start() or mark() to
+// `phase`. Each start() or mark() is a read() system call, so with
+// counters on, the clustering runs about ten times slower. The counts
+// only cover user-space work, but the calls do disturb the caches
+// somewhat. If the counters aren't available, start() and mark() do
+// nothing
+class PhaseCounters
+{
+public:
+    bool available() const { return m_counters.available(); }
+    const PerfCounters& counters() const { return m_counters; }
+
+    void start()
+    {
+        if (available())
+            m_counters.read(m_last);
+    }
+
+    void mark(Phase phase);
+
+    // The total counts for `phase`, and how many times it was marked
+    const PerfCounters::Counts& totals(Phase phase) const
+    {
+        return m_totals[size_t(phase)];
+    }
+    uint64_t n_marks(Phase phase) const { return m_n_marks[size_t(phase)]; }
+
+private:
+    PerfCounters m_counters;
+    PerfCounters::Counts m_last{};
+    std::array<PerfCounters::Counts, kNPhases> m_totals{};
+    std::array<uint64_t, kNPhases> m_n_marks{};
+};
+
+}
+
+// Local Variables:
+// mode: c++
+// c-basic-offset: 4
+// c-file-style: "linux"
+// End:
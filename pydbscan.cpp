@@ -0,0 +1,356 @@
+#include "Hit.hpp"
+#include "dbscan.hpp"
+#include "dbscan_factory.hpp"
+
+#include <pybind11/numpy.h>
+#include <pybind11/pybind11.h>
+#include <pybind11/stl.h>
+
+#include <algorithm>
+#include <limits>
+#include <memory>
+#include <optional>
+#include <stdexcept>
+#include <type_traits>
+#include <vector>
+
+// Python bindings for IncrementalDBSCAN, in integer ticks with the
+// Euclidean metric. Hits are passed in as numpy arrays of times,
+// channels and optionally charges, which are read in place when they
+// are contiguous int64 times, int32 or int64 channels and float32
+// charges, and completed clusters come back as numpy arrays in
+// compressed sparse row form
+
+namespace py = pybind11;
+
+using dbscan::Cluster;
+using dbscan::Hit;
+using dbscan::tick_t;
+
+typedef py::array_t<tick_t, py::array::c_style | py::array::forcecast>
+    TimeArray;
+typedef py::array_t<int, py::array::c_style | py::array::forcecast>
+    ChannelArray;
+// Channels in any other integer type are read as int64, and must fit
+// in an int
+typedef py::array_t<int64_t, py::array::c_style | py::array::forcecast>
+    WideChannelArray;
+typedef py::array_t<float, py::array::c_style | py::array::forcecast>
+    ChargeArray;
+
+namespace {
+
+//======================================================================
+//
+// Wraps the IncrementalDBSCAN from make_incremental_dbscan(), with our
+// own pool of hits so that each hit in a completed cluster can be
+// traced back to its position in the input
+class PyIncrementalDBSCAN
+{
+public:
+    // If `min_charge` is positive, it's weighted DBSCAN with that
+    // minimum neighbourhood charge instead of `min_pts`
+    PyIncrementalDBSCAN(tick_t eps,
+                        unsigned int min_pts,
+                        size_t pool_size,
+                        double min_charge)
+        : m_dbscan(min_charge > 0
+                     ? dbscan::make_weighted_incremental_dbscan(eps, min_charge, 0)
+                     : dbscan::make_incremental_dbscan(eps, min_pts, 0))
+        , m_pool_index(pool_size, -1)
+    {
+        if (pool_size == 0)
+            throw std::invalid_argument("pool_size must be positive");
+        m_pool.reserve(pool_size);
+        for (size_t i = 0; i < pool_size; ++i) {
+            m_pool.emplace_back(0, 0);
+            m_pool.back().neighbours.hits.reserve(10);
+        }
+    }
+
+    // Add the hits with times `times`, channels `channels` and
+    // charges `charges` (default 1), which must be in time order,
+    // following on from the hits in earlier calls. Return the clusters
+    // that were completed
+    py::dict add_points(const TimeArray& times,
+                        const py::array& channels,
+                        const std::optional<ChargeArray>& charges)
+    {
+        if (ChannelArray::check_(channels))
+            return add_points_as(
+                times, channels.cast<ChannelArray>(), charges);
+        return add_points_as(
+            times, WideChannelArray::ensure(channels), charges);
+    }
+
+    // Declare that no hits earlier than `time` will be added, and
+    // return the clusters that were completed as a result
+    py::dict advance_time(tick_t time)
+    {
+        ClusterArrays out;
+        {
+            py::gil_scoped_release release;
+            std::vector<Cluster<tick_t>> clusters;
+            m_dbscan->advance_time(time, &clusters);
+            m_latest_time = std::max(m_latest_time, time);
+            convert(clusters, out);
+        }
+        return to_arrays(out);
+    }
+
+    // Complete all of the clusters
+    py::dict flush()
+    {
+        ClusterArrays out;
+        {
+            py::gil_scoped_release release;
+            std::vector<Cluster<tick_t>> clusters;
+            m_dbscan->flush(&clusters);
+            convert(clusters, out);
+        }
+        return to_arrays(out);
+    }
+
+    bool is_specialised() const { return m_dbscan->is_specialised(); }
+
+    size_t n_added() const { return m_n_added; }
+
+private:
+    // Completed clusters, copied out of the pool: the hits of cluster
+    // k are at [offsets[k], offsets[k+1]) in `hit_index` (the position
+    // of the hit in the input), `time`, `channel` and `charge`
+    struct ClusterArrays
+    {
+        std::vector<int64_t> cluster_id;
+        std::vector<int64_t> offsets{ 0 };
+        std::vector<int64_t> hit_index;
+        std::vector<tick_t> time;
+        std::vector<int> channel;
+        std::vector<float> charge;
+    };
+
+    // add_points() with the channels in an array of `C`
+    template<class C>
+    py::dict add_points_as(
+        const TimeArray& times,
+        const py::array_t<C, py::array::c_style | py::array::forcecast>& channels,
+        const std::optional<ChargeArray>& charges)
+    {
+        if (!channels)
+            throw py::error_already_set();
+        if (times.ndim() != 1 || channels.ndim() != 1 ||
+            times.shape(0) != channels.shape(0)) {
+            throw std::invalid_argument(
+                "times and channels must be 1D arrays of the same length");
+        }
+        if (charges && (charges->ndim() != 1 ||
+                        charges->shape(0) != times.shape(0))) {
+            throw std::invalid_argument(
+                "charges must be a 1D array of the same length as times");
+        }
+        // Check the whole array before adding any of it, so a bad array
+        // leaves the state as it was
+        const tick_t* t = times.data();
+        const C* c = channels.data();
+        const float* q = charges ? charges->data() : nullptr;
+        size_t n = size_t(times.shape(0));
+        if ((n > 0 && t[0] < m_latest_time) || !std::is_sorted(t, t + n)) {
+            throw std::invalid_argument("hits must be added in time order");
+        }
+        if constexpr (!std::is_same<C, int>::value) {
+            auto [lo, hi] = std::minmax_element(c, c + n);
+            if (n > 0 && (*lo < std::numeric_limits<int>::min() ||
+                          *hi > std::numeric_limits<int>::max())) {
+                throw std::invalid_argument(
+                    "channels must fit in a 32-bit int");
+            }
+        }
+        // Negated, so that NaN fails too
+        if (q && !std::all_of(q, q + n, [](float x) { return x >= 0; })) {
+            throw std::invalid_argument("charges must not be negative");
+        }
+        ClusterArrays out;
+        {
+            py::gil_scoped_release release;
+            add(t, c, q, n, out);
+        }
+        return to_arrays(out);
+    }
+
+    // Add `n` hits, which must already be checked to be in time order.
+    // `charges` can be null, for charge 1
+    template<class C>
+    void add(const tick_t* times,
+             const C* channels,
+             const float* charges,
+             size_t n,
+             ClusterArrays& out)
+    {
+        // Pool hits are only overwritten once they're needed no more,
+        // assuming the pool is big enough. Go in short runs, so we're
+        // never resetting hits much sooner than add_point() would, and
+        // copy out each run's completed clusters before the next run
+        // can overwrite their hits
+        const size_t max_run = 1024;
+        std::vector<Cluster<tick_t>> clusters;
+        size_t i = 0;
+        while (i < n) {
+            size_t slot = m_n_added % m_pool.size();
+            size_t run =
+                std::min({ n - i, m_pool.size() - slot, max_run });
+            for (size_t j = 0; j < run; ++j) {
+                m_pool[slot + j].reset(times[i + j],
+                                       int(channels[i + j]),
+                                       charges ? charges[i + j] : 1.f);
+                m_pool_index[slot + j] = m_n_added + j;
+            }
+            m_latest_time = times[i + run - 1];
+            m_dbscan->add_hits(&m_pool[slot], run, &clusters);
+            convert(clusters, out);
+            clusters.clear();
+            m_n_added += run;
+            i += run;
+        }
+    }
+
+    // Append the hits of `clusters`, which must still be intact in the
+    // pool, to `out`
+    void convert(const std::vector<Cluster<tick_t>>& clusters,
+                 ClusterArrays& out) const
+    {
+        for (auto const& c : clusters) {
+            out.cluster_id.push_back(c.index);
+            for (auto const& h : c.hits) {
+                out.hit_index.push_back(m_pool_index[h - m_pool.data()]);
+                out.time.push_back(h->time);
+                out.channel.push_back(h->chan);
+                out.charge.push_back(h->charge);
+            }
+            out.offsets.push_back(int64_t(out.hit_index.size()));
+        }
+    }
+
+    // Convert `clusters` to numpy arrays
+    static py::dict to_arrays(const ClusterArrays& clusters)
+    {
+        auto to_array = [](const auto& v) {
+            typedef typename std::decay_t<decltype(v)>::value_type V;
+            py::array_t<V> a(v.size());
+            std::copy(v.begin(), v.end(), a.mutable_data());
+            return a;
+        };
+        py::dict ret;
+        ret["cluster_id"] = to_array(clusters.cluster_id);
+        ret["offsets"] = to_array(clusters.offsets);
+        ret["hit_index"] = to_array(clusters.hit_index);
+        ret["time"] = to_array(clusters.time);
+        ret["channel"] = to_array(clusters.channel);
+        ret["charge"] = to_array(clusters.charge);
+        return ret;
+    }
+
+    std::unique_ptr<dbscan::StreamingDBSCAN> m_dbscan;
+    std::vector<Hit<tick_t>> m_pool;
+    // The input position of the hit in each pool slot
+    std::vector<int64_t> m_pool_index;
+    size_t m_n_added{ 0 };
+    tick_t m_latest_time{ std::numeric_limits<tick_t>::min() };
+};
+
+//======================================================================
+//
+// Cluster a whole array of time-ordered hits in one go, and return the
+// cluster label of each hit, numbered from 0 in order of completion,
+// or -1 for noise
+py::array_t<int64_t>
+cluster_labels(const TimeArray& times,
+               const py::array& channels,
+               tick_t eps,
+               unsigned int min_pts,
+               const std::optional<ChargeArray>& charges,
+               double min_charge)
+{
+    // Big enough that no hit is overwritten before the end
+    PyIncrementalDBSCAN dbscanner(eps, min_pts, times.size() + 1, min_charge);
+    py::dict clusters = dbscanner.add_points(times, channels, charges);
+    py::dict last = dbscanner.flush();
+
+    py::array_t<int64_t> labels(times.size());
+    auto label_ptr = labels.mutable_data();
+    std::fill(label_ptr, label_ptr + times.size(), -1);
+
+    int64_t label = 0;
+    for (auto const& batch : { clusters, last }) {
+        auto offsets = batch["offsets"].cast<py::array_t<int64_t>>();
+        auto hit_index = batch["hit_index"].cast<py::array_t<int64_t>>();
+        auto offset_ptr = offsets.data();
+        auto index_ptr = hit_index.data();
+        for (py::ssize_t i = 0; i + 1 < offsets.size(); ++i, ++label) {
+            for (int64_t k = offset_ptr[i]; k < offset_ptr[i + 1]; ++k) {
+                label_ptr[index_ptr[k]] = label;
+            }
+        }
+    }
+    return labels;
+}
+
+}
+
+//======================================================================
+PYBIND11_MODULE(pydbscan, m)
+{
+    m.doc() = "Streaming DBSCAN clustering of time-ordered hits";
+
+    py::class_<PyIncrementalDBSCAN>(m, "IncrementalDBSCAN")
+        .def(py::init<tick_t, unsigned int, size_t, double>(),
+             py::arg("eps"),
+             py::arg("min_pts"),
+             py::arg("pool_size") = 100000,
+             py::arg("min_charge") = 0.,
+             "Times and eps are in integer ticks. Hits are kept in a pool "
+             "of pool_size, which must be large enough to hold every hit "
+             "in an active cluster. If min_charge is positive, a hit is "
+             "core if the total charge of its neighbourhood, including "
+             "itself, is at least min_charge, and min_pts is ignored")
+        .def("add_points",
+             &PyIncrementalDBSCAN::add_points,
+             py::arg("times"),
+             py::arg("channels"),
+             py::arg("charges") = py::none(),
+             "Add time-ordered hits, with optional non-negative charges "
+             "(default 1), and return the clusters that were completed, "
+             "as a dict of arrays: the hits of cluster k are at "
+             "[offsets[k], offsets[k+1]) in hit_index (the position of "
+             "the hit in the input), time, channel and charge")
+        .def("advance_time",
+             &PyIncrementalDBSCAN::advance_time,
+             py::arg("time"),
+             "Declare that no hits earlier than time will be added (eg, "
+             "on a heartbeat during a quiet period), and return the "
+             "clusters that were completed, as for add_points")
+        .def("flush",
+             &PyIncrementalDBSCAN::flush,
+             "Complete and return all of the remaining clusters. Hits "
+             "added afterwards don't join any earlier cluster")
+        .def_property_readonly("is_specialised",
+                               &PyIncrementalDBSCAN::is_specialised)
+        .def_property_readonly("n_added", &PyIncrementalDBSCAN::n_added);
+
+    m.def("cluster_labels",
+          &cluster_labels,
+          py::arg("times"),
+          py::arg("channels"),
+          py::arg("eps"),
+          py::arg("min_pts"),
+          py::arg("charges") = py::none(),
+          py::arg("min_charge") = 0.,
+          "Cluster time-ordered hits, and return the cluster label of "
+          "each hit, or -1 for noise. charges and min_charge are as for "
+          "IncrementalDBSCAN");
+}
+
+// Local Variables:
+// mode: c++
+// c-basic-offset: 4
+// c-file-style: "linux"
+// End:
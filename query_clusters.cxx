@@ -0,0 +1,151 @@
+#include "cluster_store.hpp"
+#include "cluster_stream.hpp"
+
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "CLI11.hpp"
+
+// Query a cluster store written by run_dbscan --write-store, or made
+// here from a cluster stream with --from-stream. Prints one line per
+// matching cluster: index, earliest and latest time, lowest and
+// highest channel, number of hits and total charge, and with --hits,
+// a line per hit after it. The zone-map statistics go to stderr
+
+//======================================================================
+//
+// Write the clusters in the cluster stream `stream_name` to a new store
+// `store_name`. Returns false on an error
+bool
+convert_stream(const std::string& stream_name, const std::string& store_name)
+{
+    std::ifstream fin(stream_name, std::ios::binary);
+    if (!fin) {
+        std::cerr << "Couldn't open " << stream_name << std::endl;
+        return false;
+    }
+    std::ofstream fout(store_name, std::ios::binary);
+    if (!fout) {
+        std::cerr << "Couldn't open " << store_name << std::endl;
+        return false;
+    }
+    dbscan::ClusterStreamReader reader(fin);
+    dbscan::ClusterStoreWriter writer(fout);
+    dbscan::StoredCluster cluster;
+    while (reader.read(cluster)) {
+        writer.write(cluster);
+    }
+    if (reader.error()) {
+        std::cerr << stream_name << " is not a valid cluster stream"
+                  << std::endl;
+        return false;
+    }
+    if (!writer.close()) {
+        std::cerr << "Couldn't write " << store_name << std::endl;
+        return false;
+    }
+    std::cerr << "Wrote " << writer.n_clusters() << " clusters from "
+              << stream_name << " to " << store_name << std::endl;
+    return true;
+}
+
+//======================================================================
+int
+main(int argc, char** argv)
+{
+    CLI::App cliapp{ "Query a cluster store" };
+
+    std::string filename;
+    cliapp.add_option("-f,--file", filename, "Cluster store file")
+        ->required();
+    std::string from_stream;
+    cliapp.add_option("--from-stream",
+                      from_stream,
+                      "First make the store from this cluster stream, as "
+                      "written by run_dbscan --write-clusters");
+    dbscan::ClusterQuery query;
+    cliapp.add_option(
+        "--t0", query.t0, "Only clusters with hits at or after this time");
+    cliapp.add_option(
+        "--t1", query.t1, "Only clusters with hits at or before this time");
+    cliapp.add_option("--chan-lo",
+                      query.chan_lo,
+                      "Only clusters with hits on or above this channel");
+    cliapp.add_option("--chan-hi",
+                      query.chan_hi,
+                      "Only clusters with hits on or below this channel");
+    cliapp.add_option("--min-hits",
+                      query.min_hits,
+                      "Only clusters with at least this many hits on channels "
+                      "--chan-lo to --chan-hi");
+    bool print_hits = false;
+    cliapp.add_flag("--hits", print_hits, "Print each cluster's hits");
+    bool count_only = false;
+    cliapp.add_flag(
+        "-c,--count", count_only, "Only print the number of matching clusters");
+    bool print_blocks = false;
+    cliapp.add_flag(
+        "--blocks", print_blocks, "Print the zone map of each block to stderr");
+
+    CLI11_PARSE(cliapp, argc, argv);
+
+    if (from_stream != "" && !convert_stream(from_stream, filename))
+        return 1;
+
+    dbscan::ClusterStore store;
+    if (!store.open(filename)) {
+        std::cerr << filename << " is not a valid cluster store" << std::endl;
+        return 1;
+    }
+    if (print_blocks) {
+        for (size_t b = 0; b < store.n_blocks(); ++b) {
+            const auto& block = store.block(b);
+            std::cerr << "Block " << b << ": " << block.n_clusters
+                      << " clusters, " << block.n_hits << " hits, time ["
+                      << block.min_time << ", " << block.max_time
+                      << "], channel [" << block.min_chan << ", "
+                      << block.max_chan << "], " << block.min_hits << " to "
+                      << block.max_hits << " hits per cluster" << std::endl;
+        }
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    std::vector<dbscan::ClusterView> clusters;
+    dbscan::QueryStats stats;
+    store.query(query, clusters, &stats);
+    double seconds = std::chrono::duration<double>(
+                         std::chrono::steady_clock::now() - start)
+                         .count();
+
+    if (count_only) {
+        std::cout << clusters.size() << std::endl;
+    } else {
+        for (auto const& c : clusters) {
+            std::cout << c.index << " " << c.earliest_time << " "
+                      << c.latest_time << " " << c.min_chan << " "
+                      << c.max_chan << " " << c.n_hits << " "
+                      << c.total_charge << "\n";
+            if (print_hits) {
+                for (size_t i = 0; i < c.n_hits; ++i) {
+                    std::cout << "  " << c.hit_time[i] << " " << c.hit_chan[i]
+                              << " " << c.hit_charge[i] << "\n";
+                }
+            }
+        }
+    }
+    std::cerr << clusters.size() << " of " << store.n_clusters()
+              << " clusters matched. Scanned " << stats.blocks_scanned
+              << " blocks and skipped " << stats.blocks_skipped << " of "
+              << store.n_blocks() << ", and read " << stats.hits_scanned
+              << " hits, in " << (seconds * 1e3) << "ms" << std::endl;
+    return 0;
+}
+
+// Local Variables:
+// mode: c++
+// c-basic-offset: 4
+// c-file-style: "linux"
+// End:
@@ -0,0 +1,197 @@
+#include "read_hits.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <thread>
+
+namespace {
+
+// Bits sorted on in each pass of the radix sort
+const int kRadixBits = 11;
+const size_t kRadixSize = size_t(1) << kRadixBits;
+
+// Below this many points, std::stable_sort is faster than setting up
+// the radix sort
+const size_t kMinRadixSortSize = 1 << 14;
+
+//======================================================================
+//
+// Run `f(begin, end, t)` for `nthreads` contiguous chunks of [0, n),
+// chunk t on its own thread
+template<class F>
+void
+for_each_chunk(size_t n, unsigned int nthreads, F&& f)
+{
+    size_t chunk = (n + nthreads - 1) / nthreads;
+    std::vector<std::thread> threads;
+    for (unsigned int t = 0; t < nthreads; ++t) {
+        size_t begin = std::min(n, t * chunk);
+        size_t end = std::min(n, begin + chunk);
+        threads.emplace_back(f, begin, end, t);
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+}
+
+}
+
+//======================================================================
+std::vector<Point>
+get_points(std::string name, int nhits, int nskip)
+{
+    std::vector<Point> points;
+
+    std::ifstream fin(name);
+    std::string line;
+    uint64_t timestamp, first_timestamp{ 0 };
+    bool have_first = false;
+    int channel;
+    float charge;
+    int i = 0;
+    while (std::getline(fin, line)) {
+        const char* begin = line.c_str();
+        char* end;
+        channel = std::strtol(begin, &end, 10);
+        if (end == begin)
+            break;
+        begin = end;
+        timestamp = std::strtoull(begin, &end, 10);
+        if (end == begin)
+            break;
+        begin = end;
+        charge = std::strtof(begin, &end);
+        if (end == begin)
+            charge = 1;
+
+        if (!have_first) {
+            first_timestamp = timestamp;
+            have_first = true;
+        }
+        if (i++ < nskip)
+            continue;
+        if (nhits > 0 && i > nskip + nhits)
+            break;
+
+        // Keep the times as integer ticks: converting to float here
+        // loses precision once we're a few hours into the data. The
+        // subtraction is signed in case the file isn't time-ordered
+        points.push_back(
+            { channel,
+              (int64_t(timestamp) - int64_t(first_timestamp)) / 100,
+              charge });
+    }
+
+    return points;
+}
+
+//======================================================================
+bool
+sort_points_by_time(std::vector<Point>& points, unsigned int nthreads)
+{
+    auto time_less = [](const Point& a, const Point& b) {
+        return a.time < b.time;
+    };
+    if (std::is_sorted(points.begin(), points.end(), time_less))
+        return false;
+    if (points.size() < kMinRadixSortSize) {
+        std::stable_sort(points.begin(), points.end(), time_less);
+        return true;
+    }
+
+    if (nthreads == 0)
+        nthreads = std::max(1u, std::thread::hardware_concurrency());
+    const size_t n = points.size();
+
+    // Sort on the times relative to the earliest, so the number of
+    // passes depends on the span of the times, not their magnitude
+    auto minmax = std::minmax_element(points.begin(), points.end(), time_less);
+    const int64_t min_time = minmax.first->time;
+    const uint64_t range = uint64_t(minmax.second->time - min_time);
+
+    std::vector<Point> buffer(n);
+    std::vector<Point>* from = &points;
+    std::vector<Point>* to = &buffer;
+    // counts[t * kRadixSize + d] is the number of points in thread t's
+    // chunk with digit d, and then where the first of them goes
+    std::vector<size_t> counts(nthreads * kRadixSize);
+
+    for (int shift = 0; shift < 64 && (range >> shift) != 0;
+         shift += kRadixBits) {
+        auto digit = [shift, min_time](const Point& p) {
+            return size_t(uint64_t(p.time - min_time) >> shift) &
+                   (kRadixSize - 1);
+        };
+
+        std::fill(counts.begin(), counts.end(), 0);
+        for_each_chunk(n, nthreads, [&](size_t begin, size_t end, unsigned t) {
+            size_t* c = &counts[t * kRadixSize];
+            for (size_t i = begin; i < end; ++i) {
+                ++c[digit((*from)[i])];
+            }
+        });
+
+        // Each digit's points go in thread order, so the sort is stable.
+        // If they all have the same digit, this pass wouldn't move them
+        size_t offset = 0;
+        bool one_digit = false;
+        for (size_t d = 0; d < kRadixSize; ++d) {
+            size_t digit_start = offset;
+            for (unsigned int t = 0; t < nthreads; ++t) {
+                size_t c = counts[t * kRadixSize + d];
+                counts[t * kRadixSize + d] = offset;
+                offset += c;
+            }
+            if (offset - digit_start == n)
+                one_digit = true;
+        }
+        if (one_digit)
+            continue;
+
+        for_each_chunk(n, nthreads, [&](size_t begin, size_t end, unsigned t) {
+            size_t* c = &counts[t * kRadixSize];
+            for (size_t i = begin; i < end; ++i) {
+                const Point& p = (*from)[i];
+                (*to)[c[digit(p)]++] = p;
+            }
+        });
+        std::swap(from, to);
+    }
+
+    if (from != &points)
+        points.swap(buffer);
+    return true;
+}
+
+//======================================================================
+bool
+write_points(std::string name, const std::vector<Point>& points)
+{
+    // Timestamps are unsigned, so write the times relative to the
+    // earliest one
+    int64_t min_time = 0;
+    bool have_charge = false;
+    for (size_t i = 0; i < points.size(); ++i) {
+        if (i == 0 || points[i].time < min_time)
+            min_time = points[i].time;
+        if (points[i].charge != 1)
+            have_charge = true;
+    }
+
+    std::ofstream fout(name);
+    for (auto const& p : points) {
+        fout << p.chan << " " << uint64_t(p.time - min_time) * 100;
+        if (have_charge)
+            fout << " " << p.charge;
+        fout << "\n";
+    }
+    return bool(fout);
+}
+
+// Local Variables:
+// mode: c++
+// c-basic-offset: 4
+// c-file-style: "linux"
+// End:
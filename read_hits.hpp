@@ -0,0 +1,43 @@
+#pragma once
+
+#include "Point.hpp"
+
+#include <string>
+#include <vector>
+
+//======================================================================
+//
+// Read hits from the text file `name`, which has one "channel
+// timestamp" pair per line, optionally followed by the hit's charge
+// (which is 1 if missing). Times are converted to ticks of 100
+// timestamp units since the first hit in the file. Skip the first
+// `nskip` hits and then read at most `nhits` (or all, if nhits <= 0).
+// Reading stops at the first line that doesn't start with a channel
+// and a timestamp
+std::vector<Point>
+get_points(std::string name, int nhits, int nskip);
+
+//======================================================================
+//
+// Sort `points` by time, stably, so hits with equal times keep their
+// order in the input (eg by channel). Uses a parallel LSD radix sort
+// on the integer times over `nthreads` threads (0 means one per
+// hardware thread), with only as many passes as the range of the
+// times needs. Returns false without touching the points if they were
+// already in time order, which is checked first
+bool
+sort_points_by_time(std::vector<Point>& points, unsigned int nthreads = 0);
+
+//======================================================================
+//
+// Write `points` to the text file `name` in the format read by
+// get_points(), so that reading it back gives the same times (up to a
+// constant offset). Charges are only written if any of them isn't 1
+bool
+write_points(std::string name, const std::vector<Point>& points);
+
+// Local Variables:
+// mode: c++
+// c-basic-offset: 4
+// c-file-style: "linux"
+// End:
@@ -1,19 +1,33 @@
 #include "Hit.hpp"
 #include "Point.hpp"
+#include "read_hits.hpp"
 
 #include "dbscan.hpp"
 #include "dbscan_orig.hpp"
+#include "dbscan_grid.hpp"
+#include "cluster_compare.hpp"
+#include "channel_filter.hpp"
+#include "cluster_stream.hpp"
+#include "cluster_store.hpp"
+#include "perf_counters.hpp"
+#include "HitArena.hpp"
+
+#ifdef HAVE_ROOT
 #include "draw_clusters.hpp"
 
-#include "TStopwatch.h"
 #include "TRint.h"
 #include "TCanvas.h"
+#endif
 
 #include <thread>
 #include <chrono>
 #include <fstream>
+#include <unordered_map>
 #include <string>
 #include <cassert>
+#include <cmath>
+#include <memory>
+#include <type_traits>
 
 #ifdef HAVE_PROFILER
 #include "gperftools/profiler.h"
@@ -22,189 +36,220 @@
 #include "CLI11.hpp"
 
 //======================================================================
-std::vector<Point>
-get_points(std::string name, int nhits, int nskip)
-{
-    std::vector<Point> points;
-
-    std::ifstream fin(name);
-    uint64_t timestamp, first_timestamp{ 0 };
-    int channel;
-    int i = 0;
-    while (fin >> channel >> timestamp) {
-        if (first_timestamp == 0)
-            first_timestamp = timestamp;
-        if (i++ < nskip)
-            continue;
-        if (nhits > 0 && i > nskip + nhits)
-            break;
-
-        points.push_back({channel, (timestamp - first_timestamp) / 100});
-    }
-
-    return points;
-}
-
-std::vector<dbscan::Hit*>
-points_to_hits(const std::vector<Point>& points)
+//
+// The command-line options
+struct Options
 {
-    std::vector<dbscan::Hit*> ret;
-    for(auto const& p: points){
-        ret.push_back(new dbscan::Hit(p.time, p.chan));
-    }
-    return ret;
-}
+    std::string filename;
+    int nhits{ -1 };
+    int nskip{ 0 };
+    bool test{ false };
+    bool plot{ false };
+    std::string profile_filename;
+    int minPts{ 2 };
+    // If positive, use weighted DBSCAN: a hit is core if the total
+    // charge of its neighbourhood is at least this, and minPts is
+    // ignored
+    float min_charge{ 0 };
+    std::string metric{ "euclidean" };
+    // Negative means use IncrementalDBSCAN's default
+    float trim_margin{ -1 };
+    // The batch DBSCAN to compare against in test mode
+    std::string reference{ "grid" };
+    // Threads for sorting the hits and for dbscan_grid. 0 means one
+    // per hardware thread
+    unsigned int nthreads{ 0 };
+    // Files to warm-start the clustering from, and to save its state
+    // to after the last input hit
+    std::string load_state;
+    std::string save_state;
+    // Only collect the completed clusters' summaries, not their hits
+    bool summaries_only{ false };
+    // Early-emission thresholds. All zero means no early emission
+    size_t early_hits{ 0 };
+    int early_chan_extent{ 0 };
+    double early_charge{ 0 };
+    // Send every hit through the full neighbour search
+    bool no_prefilter{ false };
+    // How to find neighbours: "time" for the global time-ordered scan,
+    // "channel" for per-channel rings, or "occupancy" for per-channel
+    // rings with occupancy bitmaps
+    std::string neighbour_index{ "time" };
+    // Hot-channel masking. A zero window means no rate-based masking
+    float hot_window{ 0 };
+    double hot_rate{ 0 };
+    // Negative means half of hot_rate
+    double hot_release{ -1 };
+    unsigned int hot_downsample{ 0 };
+    std::vector<int> mask_channels;
+    // File to write the completed clusters to as a cluster stream
+    std::string write_clusters;
+    bool no_compress{ false };
+    // File to write the completed clusters to as a columnar store, for
+    // querying with query_clusters
+    std::string write_store;
+    // Sample IncrementalDBSCAN's memory use every this many hits. Zero
+    // means never
+    int memory_interval{ 0 };
+    // Collect hardware counters for each phase of adding a hit
+    bool perf_counters{ false };
+};
 
 //======================================================================
-bool
-cluster_has_hit(const dbscan::Cluster& cluster, const dbscan::Hit* test_hit)
+//
+// Run the hot-channel filter over the time-ordered `points`, and
+// remove the points that it drops. The filter only looks at earlier
+// hits, so this is the same as running it in front of add_point()
+template<class T>
+void
+filter_channels(const Options& opts, std::vector<Point>& points)
 {
-    for(auto const& hit : cluster.hits){
-        if(hit->time == test_hit->time &&
-           hit->chan == test_hit->chan) {
-            return true;
-        }
-    }
-    return false;
+    dbscan::ChannelFilterConfig<T> config;
+    config.window = T(opts.hot_window);
+    config.mask_rate = opts.hot_rate;
+    config.unmask_rate =
+        opts.hot_release >= 0 ? opts.hot_release : opts.hot_rate / 2;
+    config.downsample = opts.hot_downsample;
+    config.static_mask = opts.mask_channels;
+    dbscan::ChannelFilter<T> filter(config);
+
+    auto start_time = std::chrono::steady_clock::now();
+    // Bring the masks up to the last hit, so that the count of masked
+    // channels below doesn't include ones that have since gone quiet
+    const T end_time = points.empty() ? T(0) : T(points.back().time);
+    points.erase(std::remove_if(points.begin(),
+                                points.end(),
+                                [&filter](const Point& p) {
+                                    return !filter.accept(T(p.time), p.chan);
+                                }),
+                 points.end());
+    filter.advance(end_time);
+    double filter_time = std::chrono::duration<double>(
+                             std::chrono::steady_clock::now() - start_time)
+                             .count();
+
+    const dbscan::ChannelFilterCounters& c = filter.counters();
+    std::cout << "Channel filter kept " << c.n_accepted << " hits, dropped "
+              << c.n_dropped_hot << " from hot channels and "
+              << c.n_dropped_static << " from masked channels, in "
+              << filter_time << "s. " << c.n_mask_events
+              << " hot-channel maskings, " << c.n_masked_now
+              << " channels still masked at the end" << std::endl;
 }
 
 //======================================================================
-void print_cluster_hits(const dbscan::Cluster& cluster)
+//
+// Print `usage` on one line, in MB
+void
+print_memory(const std::string& label, const dbscan::MemoryUsage& usage)
 {
-    for(auto const& hit : cluster.hits){
-        std::cout << std::hex << hit << std::dec << " " << hit->time << ", " << hit->chan << std::endl;
-    }
+    auto mb = [](size_t bytes) { return bytes / 1e6; };
+    std::cout << label << ": " << mb(usage.total()) << " MB (pool "
+              << mb(usage.hit_pool) << ", neighbour lists "
+              << mb(usage.neighbour_lists) << ", window "
+              << mb(usage.hit_window) << ", channel indices "
+              << mb(usage.channel_indices) << ", clusters "
+              << mb(usage.clusters) << ", cluster hits "
+              << mb(usage.cluster_hits) << ")" << std::endl;
 }
 
 //======================================================================
-bool
-compare_clusters(std::vector<dbscan::Cluster>& clusters1, std::vector<dbscan::Cluster>& clusters2)
+//
+// Print the hardware counts per hit for each phase in `counters`, and
+// the instructions per cycle
+void
+print_phase_counters(const dbscan::PhaseCounters& counters, size_t n_hits)
 {
-    bool ok=true;
-    
-    if(clusters1.size() != clusters2.size()){
-        std::cout << "clusters1 has " << clusters1.size() << " clusters but clusters2 has " << clusters2.size() << " clusters" << std::endl;
-        ok=false;
-    }
-
-    for(auto const& cluster1 : clusters1){
-        // First, find the cluster in the other list that contains the first hit from cluster1
-        const dbscan::Cluster* other_cluster=nullptr;
-        dbscan::Hit* hit1=cluster1.hits.hits[0];
-        for(auto const& cluster2 : clusters2){
-            if(cluster_has_hit(cluster2, hit1)){
-                other_cluster=&cluster2;
-                break;
+    typedef dbscan::PerfCounters PC;
+    const PC& pc = counters.counters();
+    std::cout << "Hardware counters per hit:" << std::endl;
+    for (size_t i = 0; i < dbscan::kNPhases; ++i) {
+        auto phase = dbscan::Phase(i);
+        const PC::Counts& totals = counters.totals(phase);
+        std::cout << "  " << dbscan::phase_name(phase) << ":";
+        for (int e = 0; e < PC::kNEvents; ++e) {
+            if (pc.has_event(e)) {
+                std::cout << " " << PC::event_name(e) << " "
+                          << (double(totals[e]) / n_hits);
             }
         }
-        
-        if(!other_cluster){
-            std::cout << "(" << hit1->time << ", " << hit1->chan
-                      << ") has cluster " << hit1->cluster << " but is not present in clusters2" << std::endl;
-            ok=false;
-        }
-
-        if(cluster1.hits.size() != other_cluster->hits.size()){
-            std::cout << "cluster1 has " << cluster1.hits.size() << " hits but other_cluster has " << other_cluster->hits.size() << " hits" << std::endl;
-            std::cout << "cluster1 hits:" << std::endl;
-            print_cluster_hits(cluster1);
-            std::cout << "other_cluster hits:" << std::endl;
-            print_cluster_hits(*other_cluster);
-            ok=false;
-        }
-        
-        for(auto const& hit : cluster1.hits){
-            if(!cluster_has_hit(*other_cluster, hit)){
-                std::cout << "Hit (" << hit1->time << ", " << hit1->chan << ") is present in cluster1 but not other_cluster" << std::endl;
-                ok=false;
-            }
+        if (pc.has_event(PC::kCycles) && pc.has_event(PC::kInstructions) &&
+            totals[PC::kCycles] > 0) {
+            std::cout << ", IPC "
+                      << (double(totals[PC::kInstructions]) /
+                          totals[PC::kCycles]);
         }
+        std::cout << std::endl;
     }
-
-    return ok;
-    // bool all_same = true;
-    // // Map from cluster index in v1 to cluster index in v2
-    // std::map<int, int> index_map;
-
-    // // Noise must map to noise
-    // index_map[-1]=-1;
-
-    // for (size_t i = 0; i < v1.size(); ++i) {
-    //     for (size_t j = 0; j < v1[i].hits.size(); ++j) {
-    //     dbscan::Hit* hit1 = v1[i];
-    //     dbscan::Hit* hit2 = v2[i];
-    //     if (hit1->time != hit2->time || hit1->chan != hit2->chan) {
-    //         std::cout << "Mismatched input vectors" << std::endl;
-    //         all_same = false;
-    //         break;
-    //     }
-
-    //     int index1 = hit1->cluster;
-    //     if (index1 < 0)
-    //         index1 = -1;
-    //     int index2 = hit2->cluster;
-    //     if (index2 < 0)
-    //         index2 = -1;
-
-    //     bool differ = false;
-    //     if((index1 < 0 && index2 >= 0) ||
-    //        (index1 >= 0 && index2 < 0)){
-    //         // One is noise, other is in a cluster
-    //         differ = true;
-    //     }
-    //     else if (index_map.count(index1)) {
-    //         if (index2 != index_map[index1]) {
-    //             differ = true;
-    //         }
-    //     } else {
-    //         index_map[index1] = index2;
-    //     }
-
-    //     if(differ){
-    //         std::cout << "(" << hit1->time << ", " << hit1->chan
-    //                   << ") has cluster " << hit1->cluster << " but ("
-    //                   << hit2->time << ", " << hit2->chan
-    //                   << ") has cluster " << hit2->cluster << std::endl;
-    //         all_same=false;
-    //     }
-
-    // }
-    // return all_same;
+    if (!pc.error().empty())
+        std::cout << "Some counters were unavailable: " << pc.error()
+                  << std::endl;
 }
 
 //======================================================================
+//
+// Run the clustering in the time domain `T` (`dbscan::tick_t` for
+// exact integer ticks, or `float` for the original float times) with
+// the distance metric `metric` and the core-point criterion `core`
+template<class T, class Metric, class Core>
 void
-test_dbscan(std::string filename,
-            int nhits,
-            int nskip,
-            bool test,
-            bool plot,
-            std::string profile_filename,
-            int minPts,
-            float eps)
+test_dbscan(const Options& opts, const Metric& metric, const Core& core)
 {
+    const bool test = opts.test;
+#ifdef HAVE_ROOT
+    const bool plot = opts.plot;
+#endif
+#ifdef HAVE_PROFILER
+    const std::string& profile_filename = opts.profile_filename;
+#endif
+    const int minPts = opts.minPts;
+
     std::cout << "Reading hits" << std::endl;
-    auto points = get_points(filename, nhits, nskip);
+    auto points = get_points(opts.filename, opts.nhits, opts.nskip);
     std::cout << "Sorting hits" << std::endl;
     // Sort the hits by time for the incremental DBSCAN, which
     // requires it. We'll also give regular DBSCAN the sorted hits,
     // which will make later comparisons easier
-    std::sort(points.begin(), points.end(), [](const Point& a, const Point& b) {
-        return a.time < b.time;
-    });
+    auto sort_start = std::chrono::steady_clock::now();
+    bool sorted = sort_points_by_time(points, opts.nthreads);
+    std::cout << (sorted ? "Sorted hits in " : "Hits already sorted, checked in ")
+              << std::chrono::duration<double>(
+                     std::chrono::steady_clock::now() - sort_start)
+                     .count()
+              << "s" << std::endl;
+    if (opts.hot_window > 0 || !opts.mask_channels.empty())
+        filter_channels<T>(opts, points);
+    if (points.empty()) {
+        std::cerr << "No hits to cluster" << std::endl;
+        exit(1);
+    }
 
-    std::vector<dbscan::Cluster> clusters_orig;
+    std::vector<dbscan::Cluster<T>> clusters_orig;
+    // Owns the hits used by the reference DBSCAN
+    dbscan::HitArena<T> arena;
     if (test) {
-        // Run the naive DBSCAN implementation for comparison with the
+        // Run a batch DBSCAN implementation for comparison with the
         // incremental one
-        auto hits=points_to_hits(points);
-        std::cout << "Running dbscan_orig" << std::endl;
-        auto clusters=dbscan::dbscan_orig(hits, eps, minPts);
+        auto hits=arena.make_hits(points);
+        std::vector<dbscan::Cluster<T>> clusters;
+        if (opts.min_charge > 0) {
+            std::cout << "Running dbscan_grid_weighted" << std::endl;
+            clusters = dbscan::dbscan_grid_weighted(
+                hits, metric, opts.min_charge, opts.nthreads);
+        } else if (opts.reference == "orig") {
+            std::cout << "Running dbscan_orig" << std::endl;
+            clusters=dbscan::dbscan_orig(hits, metric, minPts);
+        } else {
+            std::cout << "Running dbscan_grid" << std::endl;
+            clusters=dbscan::dbscan_grid(hits, metric, minPts, opts.nthreads);
+        }
         clusters_orig=clusters;
+#ifdef HAVE_ROOT
         if(plot){
             TCanvas* c = draw_clusters(clusters, points);
             c->Print("dbscan-orig.png");
         }
+#endif
     }
 
     // // We make a copy so we can compare the output of dbscan_orig and
@@ -220,35 +265,210 @@ test_dbscan(std::string filename,
     // incremental DBSCAN, not the hit reading and the original DBSCAN
     if (profile_filename != "")
         ProfilerStart(profile_filename.c_str());
-#else
-    if (profile_filename != "")
-        std::cerr << "profile filename specified, but run_dbscan built without "
-                     "profiler support"
-                  << std::endl;
 #endif
 
     std::cout << "Running incremental dbscan" << std::endl;
-    dbscan::IncrementalDBSCAN dbscanner(eps, minPts);
-    TStopwatch ts;
+    // Completed clusters point at hits in IncrementalDBSCAN's pool,
+    // which get reused once the pool wraps around. We need all the
+    // clusters intact at the end in test mode, so make the pool big
+    // enough for every hit
+    size_t pool_size = 100000;
+    if (test)
+        pool_size = std::max(pool_size, points.size() + 1);
+    dbscan::IncrementalDBSCAN<T, Metric, Core> dbscanner(
+        metric,
+        core,
+        pool_size,
+        opts.neighbour_index == "occupancy"
+            ? dbscan::NeighbourIndex::kPerChannelOccupancy
+        : opts.neighbour_index == "channel"
+            ? dbscan::NeighbourIndex::kPerChannel
+            : dbscan::NeighbourIndex::kTimeOrdered);
+    if (opts.trim_margin >= 0)
+        dbscanner.set_trim_margin(T(opts.trim_margin));
+    dbscanner.set_prefilter(!opts.no_prefilter);
+
+    // Hardware counters, if asked for and available
+    std::unique_ptr<dbscan::PhaseCounters> phase_counters;
+    if (opts.perf_counters) {
+        phase_counters = std::make_unique<dbscan::PhaseCounters>();
+        if (phase_counters->available()) {
+            dbscanner.set_phase_counters(phase_counters.get());
+        } else {
+            std::cout << "Hardware counters unavailable ("
+                      << phase_counters->counters().error()
+                      << "), running without them" << std::endl;
+        }
+    }
+
+    // For early emission, record when each cluster crossed the
+    // thresholds, to see how much sooner than completion that was
+    std::unordered_map<int, T> crossing_time;
+    size_t n_crossed = 0;
+    double total_lead_time = 0;
+    if (opts.early_hits || opts.early_chan_extent || opts.early_charge) {
+        dbscan::EarlyEmissionThresholds<T> thresholds;
+        thresholds.min_hits = opts.early_hits;
+        thresholds.min_chan_extent = opts.early_chan_extent;
+        thresholds.min_charge = opts.early_charge;
+        dbscanner.set_cluster_callback(
+            [&](dbscan::ClusterEvent event,
+                const dbscan::Cluster<T>& cluster,
+                int other) {
+                T now = dbscanner.latest_time();
+                switch (event) {
+                    case dbscan::ClusterEvent::kCrossed:
+                        crossing_time.emplace(cluster.index, now);
+                        break;
+                    case dbscan::ClusterEvent::kUpdated:
+                        break;
+                    case dbscan::ClusterEvent::kMerged: {
+                        // The merged cluster crossed first, so its
+                        // crossing counts for the cluster it joined
+                        T t = crossing_time.at(cluster.index);
+                        auto it = crossing_time.emplace(other, t).first;
+                        it->second = std::min(it->second, t);
+                        crossing_time.erase(cluster.index);
+                        break;
+                    }
+                    case dbscan::ClusterEvent::kCompleted:
+                        ++n_crossed;
+                        total_lead_time +=
+                            double(now - crossing_time.at(cluster.index));
+                        crossing_time.erase(cluster.index);
+                        break;
+                }
+            },
+            thresholds);
+    }
+    if (opts.load_state != "") {
+        std::ifstream fin(opts.load_state, std::ios::binary);
+        auto restore_start = std::chrono::steady_clock::now();
+        if (!dbscanner.restore_state(fin)) {
+            std::cerr << "Couldn't restore state from " << opts.load_state
+                      << std::endl;
+            exit(1);
+        }
+        std::cout << "Restored state from " << opts.load_state << " in "
+                  << std::chrono::duration<double, std::milli>(
+                         std::chrono::steady_clock::now() - restore_start)
+                         .count()
+                  << "ms" << std::endl;
+    }
+    auto start_time = std::chrono::steady_clock::now();
+    auto elapsed = [&start_time]() {
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                             start_time)
+            .count();
+    };
     int i = 0;
     double last_real_time = 0;
-    std::vector<dbscan::Cluster> clusters;
+    std::vector<dbscan::Cluster<T>> clusters;
+    std::vector<dbscan::ClusterSummary<T>> summaries;
+    auto clusters_out = opts.summaries_only ? nullptr : &clusters;
+    auto summaries_out = opts.summaries_only ? &summaries : nullptr;
+
+    // Write each cluster to the stream and the store as soon as it's
+    // completed, while its hits are still in the pool
+    std::ofstream stream_file, store_file;
+    std::unique_ptr<dbscan::ClusterStreamWriter> stream_writer;
+    std::unique_ptr<dbscan::ClusterStoreWriter> store_writer;
+    size_t n_streamed = 0;
+    // The time spent writing to each of the outputs
+    double stream_time = 0, store_time = 0;
+    auto seconds_since = [](std::chrono::steady_clock::time_point start) {
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                             start)
+            .count();
+    };
+    auto write_new_clusters = [&]() {
+        if constexpr (std::is_same<T, dbscan::tick_t>::value) {
+            if (stream_writer) {
+                auto start = std::chrono::steady_clock::now();
+                for (size_t i = n_streamed; i < clusters.size(); ++i) {
+                    stream_writer->write(clusters[i]);
+                }
+                stream_time += seconds_since(start);
+            }
+            if (store_writer) {
+                auto start = std::chrono::steady_clock::now();
+                for (size_t i = n_streamed; i < clusters.size(); ++i) {
+                    store_writer->write(clusters[i]);
+                }
+                store_time += seconds_since(start);
+            }
+            n_streamed = clusters.size();
+        }
+    };
+    if constexpr (std::is_same<T, dbscan::tick_t>::value) {
+        if (opts.write_clusters != "") {
+            stream_file.open(opts.write_clusters, std::ios::binary);
+            if (!stream_file) {
+                std::cerr << "Couldn't open " << opts.write_clusters
+                          << std::endl;
+                exit(1);
+            }
+            stream_writer = std::make_unique<dbscan::ClusterStreamWriter>(
+                stream_file, !opts.no_compress);
+        }
+        if (opts.write_store != "") {
+            store_file.open(opts.write_store, std::ios::binary);
+            if (!store_file) {
+                std::cerr << "Couldn't open " << opts.write_store << std::endl;
+                exit(1);
+            }
+            store_writer =
+                std::make_unique<dbscan::ClusterStoreWriter>(store_file);
+        }
+    }
+
     for (auto p : points) {
-        dbscanner.add_point(p.time, p.chan, &clusters);
+        dbscanner.add_point_with_charge(
+            T(p.time), p.chan, p.charge, clusters_out, summaries_out);
+        write_new_clusters();
+        if (opts.memory_interval > 0 && (i + 1) % opts.memory_interval == 0) {
+            print_memory("Memory after " + std::to_string(i + 1) + " hits",
+                         dbscanner.memory_usage());
+        }
         if (++i % 100000 == 0) {
-            double real_time = ts.RealTime();
-            ts.Continue();
+            double real_time = elapsed();
             std::cout << "100k hits took " << (real_time - last_real_time)
                       << "s" << std::endl;
             last_real_time = real_time;
         }
-        dbscanner.trim_hits();
     }
 
-    // Give it a far-future hit so it goes through all of the hits
-    Point future_point{110, 10000000};
-    dbscanner.add_point(future_point.time, future_point.chan, &clusters);
-    ts.Stop();
+    if (opts.save_state != "") {
+        std::ofstream fout(opts.save_state, std::ios::binary);
+        if (!dbscanner.save_state(fout)) {
+            std::cerr << "Couldn't save state to " << opts.save_state
+                      << std::endl;
+            exit(1);
+        }
+    }
+
+    // Complete the clusters that are still open at the end of the input
+    dbscanner.flush(clusters_out, summaries_out);
+    write_new_clusters();
+    if (stream_writer) {
+        auto start = std::chrono::steady_clock::now();
+        if (!stream_writer->close()) {
+            std::cerr << "Couldn't write clusters to " << opts.write_clusters
+                      << std::endl;
+            exit(1);
+        }
+        stream_time += seconds_since(start);
+    }
+    if (store_writer) {
+        auto start = std::chrono::steady_clock::now();
+        if (!store_writer->close()) {
+            std::cerr << "Couldn't write clusters to " << opts.write_store
+                      << std::endl;
+            exit(1);
+        }
+        store_time += seconds_since(start);
+    }
+    double processing_time = elapsed();
 
 #ifdef HAVE_PROFILER
     if (profile_filename != "")
@@ -257,63 +477,287 @@ test_dbscan(std::string filename,
 
     // Clock is 50 MHz, but we divided the time by 100 when we read in the hits
     double data_time = (points.back().time - points.front().time) / 50e4;
-    double processing_time = ts.RealTime();
-    std::cout << "Found " << clusters.size() << " clusters total" << std::endl;
+    if (opts.summaries_only) {
+        size_t n_hits = 0;
+        for (auto const& s : summaries) {
+            n_hits += s.n_hits;
+        }
+        std::cout << "Found " << summaries.size() << " clusters total, with "
+                  << n_hits << " hits" << std::endl;
+    } else {
+        std::cout << "Found " << clusters.size() << " clusters total"
+                  << std::endl;
+    }
     std::cout << "Processed " << points.size() << " hits representing "
               << data_time << "s of data in " << processing_time
               << "s. Ratio=" << (data_time / processing_time) << std::endl;
+    if (dbscanner.get_prefilter()) {
+        std::cout << dbscanner.n_prefiltered() << " hits ("
+                  << (100. * dbscanner.n_prefiltered() / points.size())
+                  << "%) were isolated and skipped the neighbour search"
+                  << std::endl;
+    }
+    if (stream_writer) {
+        std::cout << "Wrote " << stream_writer->n_clusters()
+                  << " clusters to " << opts.write_clusters << ": "
+                  << stream_writer->stored_bytes() << " bytes ("
+                  << stream_writer->raw_bytes() << " before compression, "
+                  << (double(stream_writer->stored_bytes()) /
+                      stream_writer->n_hits())
+                  << " per hit) in " << stream_time << "s, "
+                  << (stream_writer->raw_bytes() / 1e6 / stream_time)
+                  << " MB/s raw" << std::endl;
+    }
+    if (store_writer) {
+        std::cout << "Wrote " << store_writer->n_clusters()
+                  << " clusters to " << opts.write_store << ": "
+                  << store_writer->bytes() << " bytes in " << store_time
+                  << "s, " << (store_writer->bytes() / 1e6 / store_time)
+                  << " MB/s" << std::endl;
+    }
+    if (stream_writer || store_writer) {
+        double write_time = stream_time + store_time;
+        std::cout << "Writing the clusters took " << write_time << "s, "
+                  << (write_time / processing_time * 100)
+                  << "% of the processing time" << std::endl;
+    }
+    if (phase_counters && phase_counters->available()) {
+        print_phase_counters(*phase_counters, points.size());
+    }
+    if (opts.memory_interval > 0) {
+        print_memory("Memory at the end", dbscanner.memory_usage());
+        print_memory("Peak memory by structure",
+                     dbscanner.peak_memory_usage());
+        std::cout << "Peak total memory: "
+                  << (dbscanner.peak_total_memory() / 1e6) << " MB"
+                  << std::endl;
+    }
+    if (n_crossed) {
+        std::cout << n_crossed << " clusters crossed the early-emission "
+                  << "thresholds, on average "
+                  << (total_lead_time / n_crossed)
+                  << " ticks before they were complete" << std::endl;
+    }
 
+#ifdef HAVE_ROOT
     if (plot) {
-        TCanvas* c = dbscan::draw_clusters(clusters, points);
+        TCanvas* c = dbscan::draw_clusters<T>(clusters, points);
         c->Print("dbscan-incremental.png");
     }
+#endif
 
     if (test) {
-        bool same = compare_clusters(clusters_orig, clusters);
-        if (same) {
-            std::cout << "dbscan_orig and incremental results matched"
-                      << std::endl;
+        auto comparison = dbscan::compare_clusters(clusters_orig, clusters);
+        dbscan::print_comparison(std::cout, comparison);
+        if (comparison.identical) {
+            std::cout << "dbscan_" << opts.reference
+                      << " and incremental results matched" << std::endl;
         } else {
-            std::cout << "dbscan_orig and incremental results differed"
-                      << std::endl;
+            std::cout << "dbscan_" << opts.reference
+                      << " and incremental results differed" << std::endl;
         }
     }
 }
 
+//======================================================================
+//
+// Pick the core-point criterion given by the options, and run with it
+template<class T, class Metric>
+void
+run_with_core(const Options& opts, const Metric& metric)
+{
+    if (opts.min_charge > 0) {
+        test_dbscan<T>(opts, metric, dbscan::MinCharge(opts.min_charge));
+    } else {
+        test_dbscan<T>(opts, metric, dbscan::MinPts(opts.minPts));
+    }
+}
+
+//======================================================================
+//
+// Pick the metric policy named in the options, and run with it
+template<class T>
+void
+run_with_metric(const Options& opts, T eps, T eps_time, T eps_chan)
+{
+    if (opts.metric == "euclidean") {
+        run_with_core<T>(opts, dbscan::EuclideanMetric<T>(eps));
+    } else if (opts.metric == "manhattan") {
+        run_with_core<T>(opts, dbscan::ManhattanMetric<T>(eps));
+    } else if (opts.metric == "chebyshev") {
+        run_with_core<T>(opts, dbscan::ChebyshevMetric<T>(eps));
+    } else if (opts.metric == "ellipse") {
+        run_with_core<T>(
+            opts, dbscan::AnisotropicEuclideanMetric<T>(eps_time, eps_chan));
+    } else if (opts.metric == "box") {
+        run_with_core<T>(opts,
+                         dbscan::AnisotropicBoxMetric<T>(eps_time, eps_chan));
+    }
+}
+
 //======================================================================
 int
 main(int argc, char** argv)
 {
     CLI::App cliapp{ "Run incremental DBSCAN" };
 
-    std::string filename;
-    ;
-    cliapp.add_option("-f,--file", filename, "Input file of hits");
-    bool test = false;
+    Options opts;
+    cliapp.add_option("-f,--file", opts.filename, "Input file of hits");
     cliapp.add_flag(
-        "-t,--test", test, "Test mode (compare to original dbscan)");
-    bool plot = false;
-    cliapp.add_flag("--plot", plot, "Plot results");
-    std::string profile;
+        "-t,--test", opts.test, "Test mode (compare to batch dbscan)");
+    cliapp.add_flag("--plot", opts.plot, "Plot results");
+    cliapp.add_option("-p,--profile",
+                      opts.profile_filename,
+                      "Run perftools profiler with output to file");
     cliapp.add_option(
-        "-p,--profile", profile, "Run perftools profiler with output to file");
-    int nskip = 0;
+        "-s,--nskip", opts.nskip, "Number of hits at start of file to skip");
     cliapp.add_option(
-        "-s,--nskip", nskip, "Number of hits at start of file to skip");
-    int nhits = -1;
+        "-n,--nhits", opts.nhits, "Maximum number of hits to read from file");
     cliapp.add_option(
-        "-n,--nhits", nhits, "Maximum number of hits to read from file");
-    int minPts = 2;
-    cliapp.add_option(
-        "-m,--minpts", minPts, "Minimum number of hits to form a cluster");
+        "-m,--minpts", opts.minPts, "Minimum number of hits to form a cluster");
+    cliapp.add_option("--min-charge",
+                      opts.min_charge,
+                      "Use weighted DBSCAN: a hit is core if the total "
+                      "charge of its neighbourhood, including itself, is at "
+                      "least this (overrides --minpts)");
     float eps=10;
     cliapp.add_option(
         "-d,--distance", eps, "Distance threshold for points to be neighbours");
+    cliapp
+        .add_option("--metric",
+                    opts.metric,
+                    "Distance metric: euclidean, manhattan, chebyshev, or "
+                    "ellipse or box with separate time and channel "
+                    "thresholds")
+        ->check(CLI::IsMember(
+            { "euclidean", "manhattan", "chebyshev", "ellipse", "box" }));
+    cliapp
+        .add_option("--reference",
+                    opts.reference,
+                    "Batch DBSCAN to compare to in test mode: grid (fast) or "
+                    "orig (brute force)")
+        ->check(CLI::IsMember({ "grid", "orig" }));
+    cliapp.add_option("-j,--threads",
+                      opts.nthreads,
+                      "Number of threads for sorting the hits and for the "
+                      "grid DBSCAN (default: one per hardware thread)");
+    cliapp.add_option("--trim-margin",
+                      opts.trim_margin,
+                      "How far before the earliest active cluster to keep "
+                      "hits (default: 10 times the time threshold; at least "
+                      "twice the time threshold)");
+    cliapp.add_option("--load-state",
+                      opts.load_state,
+                      "Restore the clustering state from this file before "
+                      "adding any hits");
+    cliapp.add_option("--save-state",
+                      opts.save_state,
+                      "Save the clustering state to this file after the "
+                      "last input hit");
+    cliapp.add_flag("--summaries-only",
+                    opts.summaries_only,
+                    "Only collect summaries of the completed clusters, not "
+                    "their hits");
+    cliapp.add_option("--early-hits",
+                      opts.early_hits,
+                      "Report open clusters as soon as they have this many "
+                      "hits");
+    cliapp.add_option("--early-chan-extent",
+                      opts.early_chan_extent,
+                      "Report open clusters as soon as they span this many "
+                      "channels");
+    cliapp.add_option("--early-charge",
+                      opts.early_charge,
+                      "Report open clusters as soon as their total charge "
+                      "reaches this");
+    cliapp.add_flag("--no-prefilter",
+                    opts.no_prefilter,
+                    "Don't fast-path isolated hits: send every hit through "
+                    "the full neighbour search");
+    cliapp
+        .add_option("--neighbour-index",
+                    opts.neighbour_index,
+                    "How to find neighbours: time (scan all the hits in the "
+                    "time window), channel (scan each nearby channel's "
+                    "recent hits) or occupancy (the same, skipping channels "
+                    "with no recent hits)")
+        ->check(CLI::IsMember({ "time", "channel", "occupancy" }));
+    cliapp.add_option("--hot-window",
+                      opts.hot_window,
+                      "Mask channels whose hit rate over a sliding window of "
+                      "this length is too high (see --hot-rate)");
+    cliapp.add_option("--hot-rate",
+                      opts.hot_rate,
+                      "Mask a channel when it has more than this many hits "
+                      "in --hot-window");
+    cliapp.add_option("--hot-release",
+                      opts.hot_release,
+                      "Unmask a hot channel when it has fewer than this many "
+                      "hits in --hot-window (default: half of --hot-rate)");
+    cliapp.add_option("--hot-downsample",
+                      opts.hot_downsample,
+                      "Pass one in this many hits from hot channels instead "
+                      "of dropping them all");
+    cliapp.add_option("--mask-channels",
+                      opts.mask_channels,
+                      "Channels to drop all hits from");
+    cliapp.add_option("--write-clusters",
+                      opts.write_clusters,
+                      "Write the completed clusters' hits to this file as a "
+                      "compressed cluster stream");
+    cliapp.add_flag("--no-compress",
+                    opts.no_compress,
+                    "Don't compress the blocks of the --write-clusters "
+                    "stream");
+    cliapp.add_option("--memory-interval",
+                      opts.memory_interval,
+                      "Print the clustering's memory use every this many "
+                      "hits, and its peak at the end");
+    cliapp.add_flag("--perf-counters",
+                    opts.perf_counters,
+                    "Count cycles, instructions, cache misses and branch "
+                    "misses in each phase of the clustering, and report "
+                    "them per hit (slows the clustering down)");
+    cliapp.add_option("--write-store",
+                      opts.write_store,
+                      "Write the completed clusters to this file as a "
+                      "columnar store, for querying with query_clusters");
+    float eps_time = -1;
+    cliapp.add_option("--eps-time",
+                      eps_time,
+                      "Time threshold for the ellipse and box metrics "
+                      "(default: --distance)");
+    float eps_chan = -1;
+    cliapp.add_option("--eps-chan",
+                      eps_chan,
+                      "Channel threshold for the ellipse and box metrics "
+                      "(default: --distance)");
+    bool float_time = false;
+    cliapp.add_flag("--float-time",
+                    float_time,
+                    "Use float times instead of integer ticks (loses "
+                    "precision on long runs)");
 
     CLI11_PARSE(cliapp, argc, argv);
 
+    if (eps_time <= 0)
+        eps_time = eps;
+    if (eps_chan <= 0)
+        eps_chan = eps;
+
+    // The metric's time window: trimming any closer than two of them
+    // would lose the neighbours of hits that have just become core
+    float time_window =
+        (opts.metric == "ellipse" || opts.metric == "box") ? eps_time : eps;
+    if (opts.trim_margin >= 0 && opts.trim_margin < 2 * time_window) {
+        std::cerr << "--trim-margin can't be less than twice the time "
+                     "threshold ("
+                  << 2 * time_window << ")" << std::endl;
+        exit(1);
+    }
+
 #ifndef HAVE_PROFILER
-    if (profile != "") {
+    if (opts.profile_filename != "") {
         std::cerr << "Profile filename specified but run_dbscan built without "
                      "profiler support"
                   << std::endl;
@@ -321,18 +765,74 @@ main(int argc, char** argv)
     }
 #endif
 
+    if (opts.min_charge > 0 && opts.test && opts.reference == "orig") {
+        std::cerr << "--min-charge can only be tested against the grid "
+                     "reference"
+                  << std::endl;
+        exit(1);
+    }
+
+    if (opts.hot_window > 0 &&
+        (opts.hot_rate <= 0 || opts.hot_release == 0 ||
+         opts.hot_release > opts.hot_rate)) {
+        std::cerr << "--hot-window needs a positive --hot-rate, and "
+                     "--hot-release must be positive and no more than "
+                     "--hot-rate"
+                  << std::endl;
+        exit(1);
+    }
+
+    if ((opts.write_clusters != "" || opts.write_store != "") &&
+        (opts.summaries_only || float_time)) {
+        std::cerr << "--write-clusters and --write-store can't be used with "
+                     "--summaries-only or --float-time"
+                  << std::endl;
+        exit(1);
+    }
+
+    if (opts.summaries_only && (opts.test || opts.plot)) {
+        std::cerr << "--summaries-only can't be used with --test or --plot"
+                  << std::endl;
+        exit(1);
+    }
+
+#ifdef HAVE_ROOT
     int dummy_argc = 1;
     const char* dummy_argv[] = { "foo" };
     // TRint is here to start up the ROOT event loop so we can display the
     // canvases on screen
     TRint* app = nullptr;
-    if (plot)
+    if (opts.plot)
         app = new TRint("foo", &dummy_argc, const_cast<char**>(dummy_argv));
+#else
+    if (opts.plot) {
+        std::cerr << "Plotting requested but run_dbscan built without ROOT "
+                     "support"
+                  << std::endl;
+        exit(1);
+    }
+#endif
 
-    test_dbscan(filename, nhits, nskip, test, plot, profile, minPts, eps);
-    if (plot)
+    if (float_time) {
+        run_with_metric<float>(opts, eps, eps_time, eps_chan);
+    } else {
+        if (eps != std::floor(eps) || eps_time != std::floor(eps_time) ||
+            eps_chan != std::floor(eps_chan)) {
+            std::cerr << "Distance thresholds must be whole numbers of ticks "
+                         "unless --float-time is given"
+                      << std::endl;
+            exit(1);
+        }
+        run_with_metric<dbscan::tick_t>(opts,
+                                        dbscan::tick_t(eps),
+                                        dbscan::tick_t(eps_time),
+                                        dbscan::tick_t(eps_chan));
+    }
+#ifdef HAVE_ROOT
+    if (opts.plot)
         app->Run();
     delete app;
+#endif
     return 0;
 }
 
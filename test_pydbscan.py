@@ -0,0 +1,182 @@
+import os
+import re
+import subprocess
+
+import pytest
+
+np = pytest.importorskip("numpy")
+import pydbscan  # noqa: E402
+
+# Tests for the pydbscan module. ctest runs them with the module's
+# directory on PYTHONPATH and RUN_DBSCAN set to the run_dbscan
+# executable. Set DBSCAN_SAMPLE to a hit file to check that too
+
+EPS = 10
+
+
+def make_hits(n=20000, seed=1):
+    """Noise plus short tracks, as int64 times and int32 channels,
+    sorted by time"""
+    rng = np.random.default_rng(seed)
+    times = [rng.integers(0, 50 * n, n)]
+    chans = [rng.integers(0, 2000, n)]
+    for _ in range(n // 40):
+        t0, c0, length = rng.integers(0, 50 * n), rng.integers(0, 2000), 8
+        times.append(t0 + np.cumsum(rng.integers(0, 4, length)))
+        chans.append(c0 + np.arange(length))
+    times = np.concatenate(times).astype(np.int64)
+    chans = np.concatenate(chans).astype(np.int32)
+    order = np.argsort(times, kind="stable")
+    return times[order], chans[order]
+
+
+def read_hits(filename):
+    """Read a hit file the way run_dbscan does"""
+    a = np.loadtxt(filename, dtype=np.int64, usecols=(0, 1), ndmin=2)
+    times = (a[:, 1] - a[0, 1]) // 100
+    order = np.argsort(times, kind="stable")
+    return times[order], a[order, 0].astype(np.int32)
+
+
+def write_hits(filename, times, chans):
+    np.savetxt(filename, np.column_stack([chans, times * 100]), fmt="%d")
+
+
+def partition(labels):
+    """The clusters as a set of frozensets of hit positions, so that
+    labellings can be compared whatever their numbering"""
+    clusters = {}
+    for i, label in enumerate(labels):
+        if label >= 0:
+            clusters.setdefault(label, []).append(i)
+    return {frozenset(c) for c in clusters.values()}
+
+
+def reference_labels(times, chans, eps):
+    """Brute-force DBSCAN with min_pts=2, where every hit with a
+    neighbour is core, so the clusters are just the connected
+    components of the neighbour graph and there are no border points
+    to disagree about"""
+    n = len(times)
+    parent = np.arange(n)
+
+    def find(i):
+        while parent[i] != i:
+            parent[i] = parent[parent[i]]
+            i = parent[i]
+        return i
+
+    has_neighbour = np.zeros(n, dtype=bool)
+    for i in range(n):
+        j = i + 1
+        while j < n and times[j] - times[i] < eps:
+            dt = int(times[j] - times[i])
+            dc = int(chans[j]) - int(chans[i])
+            if dt * dt + dc * dc < eps * eps:
+                has_neighbour[i] = has_neighbour[j] = True
+                parent[find(i)] = find(j)
+            j += 1
+    return np.array([find(i) if has_neighbour[i] else -1 for i in range(n)])
+
+
+def run_dbscan_n_clusters(filename, *args):
+    """The number of clusters that run_dbscan finds in a hit file"""
+    exe = os.environ.get("RUN_DBSCAN")
+    if not exe:
+        pytest.skip("RUN_DBSCAN isn't set")
+    out = subprocess.run(
+        [exe, "-f", str(filename), "-d", str(EPS)] + list(args),
+        capture_output=True,
+        text=True,
+        check=True,
+    ).stdout
+    return int(re.search(r"Found (\d+) clusters total", out).group(1))
+
+
+def test_matches_brute_force():
+    times, chans = make_hits(5000)
+    labels = pydbscan.cluster_labels(times, chans, eps=EPS, min_pts=2)
+    assert partition(labels) == partition(reference_labels(times, chans, EPS))
+
+
+@pytest.mark.parametrize("min_pts", [2, 3, 5])
+def test_matches_run_dbscan(tmp_path, min_pts):
+    times, chans = make_hits()
+    filename = tmp_path / "hits.txt"
+    write_hits(filename, times, chans)
+    labels = pydbscan.cluster_labels(times, chans, eps=EPS, min_pts=min_pts)
+    n_clusters = len(set(labels[labels >= 0].tolist()))
+    assert n_clusters == run_dbscan_n_clusters(filename, "-m", str(min_pts))
+
+
+def test_sample_file():
+    filename = os.environ.get("DBSCAN_SAMPLE")
+    if not filename:
+        pytest.skip("DBSCAN_SAMPLE isn't set")
+    times, chans = read_hits(filename)
+    labels = pydbscan.cluster_labels(times, chans, eps=EPS, min_pts=2)
+    n_clusters = len(set(labels[labels >= 0].tolist()))
+    assert n_clusters == run_dbscan_n_clusters(filename, "-m", "2")
+
+
+def test_streaming_matches_batch():
+    times, chans = make_hits()
+    labels = pydbscan.cluster_labels(times, chans, eps=EPS, min_pts=3)
+    d = pydbscan.IncrementalDBSCAN(eps=EPS, min_pts=3)
+    streamed = np.full(len(times), -1)
+    label = 0
+    batches = [d.add_points(times[i : i + 997], chans[i : i + 997])
+               for i in range(0, len(times), 997)]
+    for done in batches + [d.flush()]:
+        offsets, hit_index = done["offsets"], done["hit_index"]
+        for k in range(len(offsets) - 1):
+            streamed[hit_index[offsets[k] : offsets[k + 1]]] = label
+            label += 1
+    assert partition(streamed) == partition(labels)
+
+
+def test_int64_channels():
+    times, chans = make_hits(5000)
+    expected = pydbscan.cluster_labels(times, chans, eps=EPS, min_pts=3)
+    labels = pydbscan.cluster_labels(
+        times, chans.astype(np.int64), eps=EPS, min_pts=3)
+    assert (labels == expected).all()
+    wide = chans.astype(np.int64)
+    wide[0] = 2**40
+    with pytest.raises(ValueError):
+        pydbscan.cluster_labels(times, wide, eps=EPS, min_pts=3)
+
+
+def test_charges():
+    times, chans = make_hits(5000)
+    # With every charge 1, a minimum charge is a minimum number of hits
+    expected = pydbscan.cluster_labels(times, chans, eps=EPS, min_pts=3)
+    ones = np.ones(len(times), dtype=np.float32)
+    labels = pydbscan.cluster_labels(
+        times, chans, eps=EPS, min_pts=2, charges=ones, min_charge=3)
+    assert partition(labels) == partition(expected)
+
+    # A heavy enough hit is a cluster on its own
+    charges = ones.copy()
+    charges[0] = 5
+    labels = pydbscan.cluster_labels(
+        times, chans, eps=EPS, min_pts=2, charges=charges, min_charge=5)
+    assert labels[0] >= 0
+
+    d = pydbscan.IncrementalDBSCAN(eps=EPS, min_pts=2, min_charge=5)
+    done = [d.add_points(times, chans, charges), d.flush()]
+    hit_index = np.concatenate([x["hit_index"] for x in done])
+    charge = np.concatenate([x["charge"] for x in done])
+    assert charge[list(hit_index).index(0)] == 5
+
+    charges[1] = -1
+    with pytest.raises(ValueError):
+        pydbscan.cluster_labels(
+            times, chans, eps=EPS, min_pts=2, charges=charges, min_charge=5)
+
+
+def test_time_order():
+    d = pydbscan.IncrementalDBSCAN(eps=EPS, min_pts=2)
+    d.add_points(np.array([10, 20], dtype=np.int64), np.array([1, 2]))
+    with pytest.raises(ValueError):
+        d.add_points(np.array([15], dtype=np.int64), np.array([1]))